@@ -11,7 +11,73 @@
  *
  * Parameters:
  *   lt: A pointer to the layout to analyze.
+ *   plan: The statistics to calculate, or NULL for every stat that is not
+ *         skipped. Meta statistics are only calculated without a plan.
  */
-void single_analyze(layout *lt);
+void single_analyze(layout *lt, eval_plan *plan);
+
+/*
+ * Holds single_analyze() to one engine, for the engine self-check.
+ *
+ * Parameters:
+ *   engine: 'm' to sum every stat member by member, 'c' to sum over all
+ *           position pairs and the sparse corpus where they are built, 'a' to
+ *           pick the cheaper one per ngram width (the default).
+ */
+void force_engine(char engine);
+
+/* Layouts analyzed side by side by multi_analyze(), one per vector lane. */
+#ifdef __AVX512F__
+#define MULTI_LANES 16
+#else
+#define MULTI_LANES 8
+#endif
+
+/*
+ * Performs analysis on up to MULTI_LANES layouts at once for the same plan,
+ * with the same results as single_analyze() on each. Each stat's member list
+ * is walked once for all of them: the character tables hold one lane per
+ * layout side by side, so every member gathers the frequencies of all layouts
+ * together and the lane loops vectorize. Plans that single_analyze() would
+ * score over all position pairs or the sparse corpus are analyzed one layout
+ * at a time.
+ *
+ * Parameters:
+ *   lts: The layouts to analyze.
+ *   count: The number of layouts, from 1 to MULTI_LANES.
+ *   plan: The statistics to calculate.
+ */
+void multi_analyze(layout **lts, int count, eval_plan *plan);
+
+/*
+ * Performs analysis on a single layout like single_analyze(), but sums the
+ * raw corpus counts of each stat's members as integers and divides by the
+ * total of the stat's order once at the end. Integer sums do not depend on
+ * the order they are added in, so the results are bit for bit the same
+ * whatever the thread count, vector width or member order.
+ *
+ * Parameters:
+ *   lt: A pointer to the layout to analyze.
+ *   plan: The statistics to calculate, or NULL for every stat that is not
+ *         skipped. Meta statistics are only calculated without a plan.
+ */
+void exact_analyze(layout *lt, eval_plan *plan);
+
+/*
+ * Updates the statistics of a layout whose keys differ from an analyzed base
+ * layout at only a few positions. Each stat starts from the base's value and
+ * only re-sums its members that touch a changed position, once with the old
+ * keys and once with the new ones, so the cost is proportional to the
+ * affected ngrams rather than to all of them.
+ *
+ * Parameters:
+ *   lt: A pointer to the changed layout, whose scores are overwritten.
+ *   base: A pointer to the base layout, analyzed with the same plan.
+ *   positions: The flat key positions at which the two layouts differ.
+ *   count: The number of positions.
+ *   plan: The statistics to update, or NULL for every stat that is not
+ *         skipped. Meta statistics are only updated without a plan.
+ */
+void delta_analyze(layout *lt, layout *base, const int *positions, int count, eval_plan *plan);
 
 #endif
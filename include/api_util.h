@@ -4,22 +4,77 @@
 #include "global.h"
 #include "structs.h"
 #include <json-c/json.h>
+#include <limits.h>
+
+// Maximum number of weighted statistics in a single API request.
+#define MAX_WEIGHTS 100
 
 // Holds the custom weights provided in a single API request.
+// Each entry keeps the key used by the client and the stat it resolved to,
+// as a type ('m', 'b', 't', 'q', or '1'-'9' for skipgrams) and an index.
 typedef struct CustomWeights {
-    double sfb;
-    double sfs;
-    double lsb;
-    double alt;
-    double rolls;
+    int length;
+    char keys[MAX_WEIGHTS][61];
+    char types[MAX_WEIGHTS];
+    int indices[MAX_WEIGHTS];
+    double values[MAX_WEIGHTS];
 } CustomWeights;
 
 // Parses a 30-character layout string into the layout matrix.
 // Assumes the layout string contains characters present in the loaded language.
 int parse_layout_from_string(layout *lt, const char *layout_str);
 
-// Builds the final JSON response string.
+// Size of a buffer that holds any layout string written by write_layout_string.
+#define LAYOUT_STRING_SIZE (30 * MB_LEN_MAX + 1)
+
+// Writes the 30-character layout string of a layout into buf, the inverse of
+// parse_layout_from_string. buf must hold LAYOUT_STRING_SIZE bytes.
+void write_layout_string(char *buf, layout *lt);
+
+// Converts an index into the 30-character layout string to its flat key
+// position (row * COL + column).
+int key_position(int i);
+
+// Swaps the keys at two indices into the 30-character layout string.
+void swap_keys(layout *lt, int a, int b);
+
+// Maximum number of key swaps applied to a single candidate layout.
+#define MAX_SWAPS 15
+
+// Applies a list of key swaps to a layout. The list holds pairs of indices into
+// the 30-character layout string: [a, b, c, d] swaps a with b, then c with d.
+// Returns 0 if the list is malformed, leaving the layout partially swapped.
+int apply_swaps(layout *lt, json_object *j_swaps);
+
+// Collects the flat key positions at which two layouts differ.
+// Returns the number of positions written, at most DIM1.
+int diff_layouts(layout *a, layout *b, int *positions);
+
+// Parses the weights object of a request. Keys are either one of the short
+// aliases (sfb, sfs, lsb, alt, rolls) or the full name of an enabled stat,
+// with skipgram names followed by their skip distance ("Same Finger Skipgram 2").
+// Values must be finite numbers.
+// Returns 0 if the object is malformed, names an unknown or skipped stat, or
+// gives a value that is not a finite number.
+int parse_weights(json_object *j_weights, CustomWeights *weights);
+
+// Fills an evaluation plan with exactly the stats the weights refer to.
+void build_eval_plan(eval_plan *plan, CustomWeights *weights);
+
+// Reads the value of a single stat out of an analyzed layout.
+float stat_value(layout *lt, char type, int index);
+
+// Writes the value of a single stat into a layout, the inverse of stat_value.
+void set_stat_value(layout *lt, char type, int index, float value);
+
+// Returns the weighted score of an analyzed layout, the sum of each weighted
+// stat's value times its weight.
+float weighted_score(layout *lt, CustomWeights *weights);
+
+// Writes the compact JSON response for an analyzed layout into buf.
 // This function calculates the final score using custom weights.
-char *build_json_response(layout *lt, CustomWeights *weights);
+// Works like snprintf: returns the length of the full response, which did not
+// fit (and was truncated) if it is size or more.
+int write_json_response(char *buf, size_t size, layout *lt, CustomWeights *weights);
 
 #endif
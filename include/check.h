@@ -0,0 +1,24 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "global.h"
+#include "structs.h"
+
+/* Random layouts scored by every engine in make check. */
+#define CHECK_LAYOUTS 256
+
+/*
+ * Scores random layouts with every analysis engine and compares each with the
+ * member by member sums of single_analyze(lt, NULL): multi_analyze() must match
+ * exactly, while the position pair, sparse corpus, delta and tensor engines add
+ * in another order and must match within a small tolerance. Every mismatch is
+ * logged. The corpus, stats, skip rows and sparse ngrams must all be loaded.
+ *
+ * Parameters:
+ *   layouts: The number of random layouts to score.
+ *
+ * Returns: The number of mismatches, 0 if every engine agrees.
+ */
+int check_engines(int layouts);
+
+#endif
@@ -33,18 +33,28 @@ extern char *corpus_name;
 /* Control flags for program execution. */
 extern char output_mode;
 
+/* Number of analyzed layouts the result cache keeps, set with -r. */
+extern long result_cache_size;
+
 /* The selected language's character set. */
 extern wchar_t *lang_arr;
 
 /* Hash table for character code lookup. */
 extern int *char_table;
 
-/* Arrays to store raw frequency counts from the corpus. */
-extern int *corpus_mono;
-extern int **corpus_bi;
-extern int ***corpus_tri;
-extern int ****corpus_quad;
-extern int ***corpus_skip;
+/* Arrays to store raw frequency counts from the corpus, laid out like linear_*. */
+extern long long *corpus_mono;
+extern long long *corpus_bi;
+extern long long *corpus_tri;
+extern long long *corpus_quad;
+extern long long *corpus_skip;
+
+/* Totals of the raw counts, skipgrams by skip distance, the percentages' denominators. */
+extern long long total_mono;
+extern long long total_bi;
+extern long long total_tri;
+extern long long total_quad;
+extern long long total_skip[10];
 
 /* Arrays to store normalized frequency data (percentages). */
 extern float *linear_mono;
@@ -53,6 +63,10 @@ extern float *linear_tri;
 extern float *linear_quad;
 extern float *linear_skip;
 
+/* linear_skip interleaved by distance, skip_rows[(c0 * LANG_LENGTH + c1) * SKIP_ROW + k] for skip-k. */
+#define SKIP_ROW 16
+extern float *skip_rows;
+
 /* total umber of statistics for each ngram type. */
 extern int MONO_LENGTH;
 extern int BI_LENGTH;
@@ -73,8 +73,12 @@ void check_setup();
 void read_lang();
 
 /*
- * Attempts to read corpus data from a cache file. If the cache file exists,
- * it reads the pre-computed ngram frequencies into the global corpus arrays.
+ * Attempts to read corpus data from the binary cache file. The cache holds the
+ * normalized frequencies, which are memory-mapped and used as the linear_*
+ * arrays directly, the sparse raw counts, which fill the corpus arrays, and
+ * their totals.
+ * A cache taken with another language, from a corpus that changed since, or
+ * in an older format (including the old text cache) is treated as absent.
  *
  * Returns:
  *   1 if the cache file was successfully read, 0 otherwise.
@@ -82,20 +86,55 @@ void read_lang();
 int read_corpus_cache();
 
 /*
- * Reads and processes a corpus text file to collect ngram frequency data. Reads
- * the corpus character by character, updating the frequency counts in the
- * global corpus arrays for monograms, bigrams, trigrams, quadgrams,
- * and skipgrams.
+ * Reads and processes a corpus text file to collect ngram frequency data. The
+ * file is memory-mapped and split into chunks at UTF-8 character boundaries,
+ * which the worker pool decodes and counts into separate histograms. These are
+ * then merged into the global corpus arrays for monograms, bigrams, trigrams,
+ * quadgrams, and skipgrams.
  */
 void read_corpus();
 
 /*
- * Creates or updates a cache file with the current corpus frequency data.
- * This function writes the current state of the global corpus arrays to a
- * cache file, allowing for quicker initialization in future runs.
+ * Creates or updates the binary cache file with the current corpus data. This
+ * function writes the normalized linear_* arrays and the sparse raw counts of
+ * the global corpus arrays, so it must run after normalize_corpus(). The file
+ * is written under a temporary name and renamed into place.
  */
 void cache_corpus();
 
+/*
+ * Releases the corpus cache mapping, if the corpus was read from one. The
+ * linear_* arrays that point into the mapping are cleared first so they can
+ * then be freed as usual.
+ */
+void free_corpus_cache();
+
+/*
+ * Attempts to read the mono, bi, tri, quad, and skip stat definitions from the
+ * stat cache. The cache is memory-mapped and each stat's members point into
+ * the mapping, so no ngrams need to be enumerated. A cache built for another
+ * geometry or version of the stat definitions is ignored.
+ *
+ * Returns:
+ *   1 if the stats were read from the cache, 0 otherwise.
+ */
+int read_stats_cache();
+
+/*
+ * Writes the current mono, bi, tri, quad, and skip stat definitions to the
+ * stat cache so later runs can map them instead of rebuilding them. The file
+ * is written under a temporary name and renamed into place, so a process
+ * starting at the same time never maps a partial cache.
+ */
+void cache_stats();
+
+/*
+ * Releases the stat cache mapping, if the stats were read from one. Members
+ * that point into the mapping are cleared first so the stats can then be
+ * freed as usual.
+ */
+void free_stats_cache();
+
 /*
  * Prints the layout name and score.
  * Parameters:
@@ -0,0 +1,106 @@
+#ifndef OPTIMIZE_H
+#define OPTIMIZE_H
+
+#include <stdint.h>
+#include <json-c/json.h>
+
+#include "global.h"
+#include "structs.h"
+#include "api_util.h"
+#include "weights_cache.h"
+
+/* Upper bounds on what a single optimize request may ask for. */
+#define MAX_CHAINS 64
+#define MAX_TOP 100
+#define MAX_OPTIMIZE_SECONDS 60
+
+/* Longest a chain holds a worker before it yields to other jobs. */
+#define ANNEAL_SLICE_SECONDS 0.01
+
+/* Where an annealing chain stands between two of its time slices. */
+typedef struct anneal_state {
+    /* NULL until the chain's first slice, freed after its last */
+    layout *current;
+    layout *candidate;
+    float score;
+    float temperature;
+    /* the chain's best distinct layouts, and the score of the last of them */
+    layout_node *best;
+    int ranked;
+    float worst;
+    uint64_t generator;
+    long accepted;
+    long iterations;
+    /* set when the chain starts, so chains waiting in the queue keep their budget */
+    double deadline;
+    int finished;
+} anneal_state;
+
+/*
+ * A simulated annealing run: several independent chains start from the same
+ * layout, each with its own generator, and keep the best distinct layouts
+ * they visit. Chains only swap keys that are not pinned and score every swap
+ * incrementally against their current layout. Each chain runs in short time
+ * slices, so the worker pool can serve other requests in between.
+ */
+typedef struct optimize_run {
+    /* the weights with their plan, and their tensors for exact scores of the ranked layouts */
+    compiled_weights *compiled;
+    layout *start;
+    /* nonzero for layout string indices whose keys never move */
+    int pinned[30];
+    /* budget of each chain, whichever runs out first; seconds is 0 without a time budget */
+    long iterations;
+    double seconds;
+    float start_temperature;
+    float end_temperature;
+    uint64_t seed;
+    int top;
+    int chains;
+    anneal_state *states;
+} optimize_run;
+
+/*
+ * Parses an optimize request and analyzes its start layout. The time budget
+ * of each chain starts counting with its first slice.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+optimize_run *create_optimize_run(json_object *request, const char **message);
+
+/*
+ * Runs the next time slice of an annealing chain, at most ANNEAL_SLICE_SECONDS
+ * long. Safe to call for different chains of the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   chain: The index of the chain, from 0 to run->chains - 1.
+ *
+ * Returns: 1 if the chain has used up its budget, 0 if it needs another slice.
+ */
+int anneal_chain(optimize_run *run, int chain);
+
+/*
+ * Merges the rankings of all chains into the run's best distinct layouts,
+ * best first by their exact scores. The chain rankings are consumed.
+ *
+ * Parameters:
+ *   run: The run, after all of its chains have finished.
+ *
+ * Returns: The merged ranking, to be freed with free_ranking().
+ */
+layout_node *merge_rankings(optimize_run *run);
+
+/*
+ * Frees an optimize run and its start layout, and releases its weights.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_optimize_run(optimize_run *run);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+/*
+ * Starts the shared worker pool, one thread per online processor. Does nothing
+ * if the pool is already running.
+ */
+void create_thread_pool();
+
+/*
+ * Stops the worker pool. Jobs already queued are finished first, then all
+ * worker threads are joined.
+ */
+void destroy_thread_pool();
+
+/* Returns the number of worker threads in the pool. */
+int pool_size();
+
+/*
+ * Runs a job on the worker pool and blocks until it is done. The job calls
+ * run(arg, i) once for every i in [0, count), in chunks spread over all
+ * workers and interleaved with any other jobs in the queue.
+ * Must not be called from inside a worker thread. Without a running pool the
+ * job runs on the calling thread.
+ * Parameters:
+ *   run: The function to run for each index.
+ *   arg: Passed through to run.
+ *   count: The number of indices.
+ */
+void run_job(void (*run)(void *arg, size_t index), void *arg, size_t count);
+
+/*
+ * Queues a job on the worker pool without waiting for it. Once run(arg, i)
+ * has returned for every i in [0, count), done(arg) is called on the worker
+ * that finished last. Safe to call from inside a worker thread. Without a
+ * running pool the job runs on the calling thread before returning.
+ * Parameters:
+ *   run: The function to run for each index.
+ *   arg: Passed through to run and done.
+ *   count: The number of indices, done is called right away if zero.
+ *   done: Called once the whole job is complete, may be NULL.
+ */
+void submit_job(void (*run)(void *arg, size_t index), void *arg, size_t count,
+    void (*done)(void *arg));
+
+#endif
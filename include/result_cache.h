@@ -0,0 +1,62 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "global.h"
+#include "structs.h"
+#include "weights_cache.h"
+
+/* Number of independently locked shards, a power of two. */
+#define RESULT_CACHE_SHARDS 16
+
+/*
+ * Restores the weighted stats of a layout from an earlier analysis of the
+ * same layout with the same compiled weights, if the cache holds one. Counts
+ * a hit or a miss. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The layout.
+ *   cw: The compiled weights.
+ *   exact: Nonzero for the results of exact_analyze(), which are kept apart.
+ *
+ * Returns: 1 if the stats were restored, 0 if the layout must be analyzed.
+ */
+int restore_result(layout *lt, compiled_weights *cw, int exact);
+
+/*
+ * Caches the weighted stats of a layout just analyzed with the plan of some
+ * compiled weights. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The analyzed layout.
+ *   cw: The compiled weights.
+ *   exact: Nonzero if the layout was analyzed with exact_analyze().
+ */
+void store_result(layout *lt, compiled_weights *cw, int exact);
+
+/*
+ * Analyzes a layout for the stats of a weight set, or restores those stats
+ * from an earlier analysis of the same layout with the same compiled weights.
+ * Only the weighted stats of the layout are valid afterwards, as after
+ * single_analyze() with the weights' plan. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The layout to analyze.
+ *   cw: The compiled weights.
+ */
+void cached_analyze(layout *lt, compiled_weights *cw);
+
+/*
+ * Reads the counters of the cache.
+ *
+ * Parameters:
+ *   hits, misses: Set to the analyses restored from the cache and those that
+ *                 ran, since the server started.
+ *   entries: Set to the number of results cached.
+ *   capacity: Set to the number of results the cache keeps at most.
+ */
+void result_cache_counts(long *hits, long *misses, long *entries, long *capacity);
+
+/* Frees every cached result. */
+void free_result_cache();
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <json-c/json.h>
+
+#include "global.h"
+#include "structs.h"
+#include "api_util.h"
+#include "weights_cache.h"
+
+/* Upper bounds on what a single search request may ask for, 12! placements at most. */
+#define MAX_SEARCH_KEYS 12
+#define MAX_SEARCH_TOP 100
+#define MAX_SEARCH_SECONDS 600
+
+/* Time budget of a search that does not set one. */
+#define DEFAULT_SEARCH_SECONDS 60
+
+/* Longest a subtree holds a worker before it yields to other jobs. */
+#define SEARCH_SLICE_SECONDS 0.01
+
+struct subtree_search;
+
+/*
+ * An exhaustive search over the placements of a few free keys, with every
+ * other key pinned. Placements are built one key at a time: each weighted
+ * ngram member is scored as soon as all of its free keys are placed, and a
+ * partial placement is dropped once even the best case of its remaining
+ * members cannot reach the current top layouts. The best case of each free
+ * key counts its members with the placed keys exactly, over the characters
+ * still unplaced. Subtrees are searched in short time slices, so the worker
+ * pool can serve other requests in between, and the search stops early once
+ * its time budget runs out.
+ */
+typedef struct search_run {
+    /* the weights with their plan, and their tensors whose merged members the scoring tables are built from */
+    compiled_weights *compiled;
+    layout *start;
+    /* the free keys in placement order, as layout string indices */
+    int keys;
+    int index[MAX_SEARCH_KEYS];
+    /* the characters placed on them, as in the start layout */
+    int chars[MAX_SEARCH_KEYS];
+    /* weighted score of the members that touch no free key */
+    float constant;
+    /*
+     * Weighted score of the members that touch one or two free keys, by the
+     * character slots placed on them: unary[d][c] for depth d holding slot c,
+     * pair[((d * MAX_SEARCH_KEYS + e) * MAX_SEARCH_KEYS + c) * MAX_SEARCH_KEYS + x]
+     * for depths d < e holding slots c and x, and the best of each pair.
+     */
+    float unary[MAX_SEARCH_KEYS][MAX_SEARCH_KEYS];
+    float *pair;
+    float pair_max[MAX_SEARCH_KEYS][MAX_SEARCH_KEYS];
+    /* members touching more free keys, left with one after depth d: terms[term_start[d]] to terms[term_start[d + 1] - 1] */
+    struct search_term *terms;
+    int term_start[MAX_SEARCH_KEYS + 1];
+    /* upper bound on the pairs of keys still free and the terms with two or more after placing depth d */
+    float rest[MAX_SEARCH_KEYS];
+    int top;
+    /* best layouts so far, shared by all subtrees */
+    pthread_mutex_t mutex;
+    layout_node *best;
+    int ranked;
+    _Atomic float threshold;
+    atomic_long nodes;
+    /* the time budget, counted from the first slice, and set if it cut the search short */
+    double seconds;
+    _Atomic double deadline;
+    atomic_int incomplete;
+    /* per subtree: its search between slices, and whether it is done */
+    struct subtree_search **subtrees;
+    unsigned char *finished;
+} search_run;
+
+/*
+ * Parses a search request, analyzes its start layout and prepares the scoring
+ * terms and bounds of the free keys.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+search_run *create_search_run(json_object *request, const char **message);
+
+/*
+ * Returns the number of subtrees of a search, one per choice of characters
+ * on the first two free keys.
+ */
+size_t search_subtrees(search_run *run);
+
+/*
+ * Searches the next time slice of a subtree, at most SEARCH_SLICE_SECONDS
+ * long. Once the subtree is exhausted or the run is out of time, its best
+ * layouts are merged into the run's. Safe to call for different subtrees of
+ * the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   subtree: The index of the subtree, below search_subtrees(run).
+ *
+ * Returns: 1 if the subtree is done, 0 if it needs another slice.
+ */
+int search_subtree(search_run *run, size_t subtree);
+
+/*
+ * Returns the run's best layouts, best first by their exact scores. The run
+ * gives up the ranking.
+ *
+ * Parameters:
+ *   run: The run, after all of its subtrees have been searched.
+ *
+ * Returns: The ranking, to be freed with free_ranking().
+ */
+layout_node *search_results(search_run *run);
+
+/*
+ * Frees a search run and its start layout, and releases its weights.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_search_run(search_run *run);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "global.h"
+#include "structs.h"
+
+/*
+ * The nonzero ngrams of the corpus of one width (3 or 4), for scoring stats by
+ * walking the corpus instead of each stat's members. Every tuple of key
+ * positions maps to the set of enabled stats it is a member of; distinct sets
+ * are stored once. An ngram placed on a tuple adds its frequency to every stat
+ * of the tuple's set.
+ */
+typedef struct sparse_ngrams {
+    int width;
+    /* the nonzero ngrams by decreasing frequency, character k in byte k */
+    uint32_t *chars;
+    float *freqs;
+    size_t length;
+    /* set of each tuple, tuple_set[((p0 * dim1 + p1) * dim1 + p2) ...], 0 for the empty set */
+    uint16_t *tuple_set;
+    /* set s is the words bits sets[s * words] to sets[s * words + words - 1], bit b for stat stat_of_bit[b] */
+    uint64_t *sets;
+    int words;
+    int set_count;
+    /* the bit of each stat, -1 if it is skipped, and the stat of each bit */
+    int *bit_of_stat;
+    int *stat_of_bit;
+} sparse_ngrams;
+
+/* The sparse trigrams and quadgrams, NULL where no stat is enabled or they could not be built. */
+extern sparse_ngrams *sparse_tri;
+extern sparse_ngrams *sparse_quad;
+
+/*
+ * Builds the sparse trigrams and quadgrams from the normalized corpus and the
+ * enabled stats, which must both be loaded.
+ */
+void build_sparse_ngrams();
+
+/*
+ * Scores stats of one width by walking the nonzero ngrams of the corpus.
+ *
+ * Parameters:
+ *   sp: The sparse ngrams of the stats' width.
+ *   where: The flat key position of each character, -1 if not on the layout.
+ *          No character may be on the layout twice.
+ *   stats: The indices of the stats to score, all enabled.
+ *   count: The number of stats to score.
+ *   scores: The layout's scores of that width, indexed like the stats.
+ */
+void sparse_analyze(const sparse_ngrams *sp, const int where[], const int *stats,
+    int count, float *scores);
+
+/* Frees the sparse trigrams and quadgrams. */
+void free_sparse_ngrams();
+
+#endif
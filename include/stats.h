@@ -1,11 +1,18 @@
 #ifndef STATS_H
 #define STATS_H
 
+/*
+ * Version of the stat cache file format. Changes to the stat definitions
+ * themselves are caught by STATS_FINGERPRINT, a checksum of their sources
+ * that the Makefile passes in.
+ */
+#define STATS_CACHE_VERSION 2
+
 /*
  * Initializes all statistic data structures. This involves
  * initializing arrays for each type of n-gram statistic as well as
  * meta-statistics. The function delegates the initialization of each statistic
- * type to its respective module.
+ * type to its respective module, unless the stat cache already holds them.
  */
 void initialize_stats();
 
@@ -8,12 +8,6 @@
  */
 void initialize_mono_stats();
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_mono_stats();
-
 /* Frees the memory allocated for the monogram statistics array. */
 void free_mono_stats();
 
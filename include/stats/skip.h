@@ -8,12 +8,6 @@
  */
 void initialize_skip_stats();
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_skip_stats();
-
 /* Frees the memory allocated for the skipgram statistics array. */
 void free_skip_stats();
 
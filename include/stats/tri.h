@@ -8,12 +8,6 @@
  */
 void initialize_tri_stats();
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_tri_stats();
-
 /* Frees the memory allocated for the trigram statistics array. */
 void free_tri_stats();
 
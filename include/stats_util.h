@@ -17,6 +17,32 @@
  */
 int find_stat_index(char *stat_name, char type);
 
+/*
+ * Builds the reverse index of a stat's members by key position.
+ *
+ * Parameters:
+ *   pos: The stat's members, width flat key positions each.
+ *   width: The number of positions per member (1 to 4).
+ *   length: The number of members.
+ *
+ * Returns:
+ *   The index, to be released with free().
+ */
+stat_index *build_stat_index(const unsigned char *pos, int width, int length);
+
+/*
+ * Builds the mask of a bigram or skipgram stat's members over all position
+ * pairs, 1 at p0 * dim1 + p1 for the member (p0, p1) and 0 elsewhere.
+ *
+ * Parameters:
+ *   pos: The stat's members.
+ *   length: The number of members.
+ *
+ * Returns:
+ *   The PAIR_LENGTH floats of the mask, 64-byte aligned, to be released with free().
+ */
+float *build_pair_mask(const unsigned char (*pos)[2], int length);
+
 /* 'l' for left hand, 'r' for right hand. */
 char hand(int row0, int col0);
 
@@ -1,6 +1,8 @@
 #ifndef STRUCTS_H
 #define STRUCTS_H
 
+#include <stdint.h>
+
 /* Dimensions of the layout grid. */
 #define row 3
 #define col 12
@@ -9,12 +11,17 @@
 #define dim3 dim2 * dim1
 #define dim4 dim3 * dim1
 
+/* Floats of a mask over all position pairs, p0 * dim1 + p1, in whole 64-byte vectors. */
+#define PAIR_LENGTH ((dim2 + 15) / 16 * 16)
+
 // ALL NAMES 60 CHARACTERS LONG FOR PRINTING IN 80 CHARACTER LINES
 
 /* Structure for a keyboard layout and its stats. */
 typedef struct layout {
     char name[61];
     int matrix[row][col];
+    /* every stat's score, indexed by stat_id(), the arrays below point into it */
+    float *scores;
     float *mono_score;
     float *bi_score;
     float *tri_score;
@@ -27,14 +34,33 @@ typedef struct layout {
 /* Node for a linked list of layouts, used for ranking. */
 typedef struct layout_node {
     char name[61];
+    int matrix[row][col];
     float score;
     struct layout_node *next;
 } layout_node;
 
-/* Structures to represent statistics based on ngrams. */
+/*
+ * Reverse index of a stat from key positions to its members: the members that
+ * touch flat key position p are members[start[p]] to members[start[p + 1] - 1],
+ * each listed once per position even if it touches that position twice.
+ */
+typedef struct stat_index {
+    int start[dim1 + 1];
+    int members[];
+} stat_index;
+
+/*
+ * Structures to represent statistics based on ngrams. While a stat is being
+ * defined, ngrams points at a shared dimN scratch array; trimming packs its
+ * members into pos, one flat key position (row * col + column) per character
+ * of the ngram, and leaves ngrams NULL. by_pos indexes pos by key position for
+ * stats that are not skipped, and is NULL otherwise.
+ */
 typedef struct mono_stat {
     char name[61];
-    int ngrams[dim1];
+    int *ngrams;
+    unsigned char *pos;
+    stat_index *by_pos;
     int length;
     float weight;
     int skip;
@@ -42,7 +68,11 @@ typedef struct mono_stat {
 
 typedef struct bi_stat {
     char name[61];
-    int ngrams[dim2];
+    int *ngrams;
+    unsigned char (*pos)[2];
+    stat_index *by_pos;
+    /* the members as a 0/1 position pair mask, NULL if skipped */
+    float *pair_mask;
     int length;
     float weight;
     int skip;
@@ -50,7 +80,9 @@ typedef struct bi_stat {
 
 typedef struct tri_stat {
     char name[61];
-    int ngrams[dim3];
+    int *ngrams;
+    unsigned char (*pos)[3];
+    stat_index *by_pos;
     int length;
     float weight;
     int skip;
@@ -58,7 +90,9 @@ typedef struct tri_stat {
 
 typedef struct quad_stat {
     char name[61];
-    int ngrams[dim4];
+    int *ngrams;
+    unsigned char (*pos)[4];
+    stat_index *by_pos;
     int length;
     float weight;
     int skip;
@@ -66,7 +100,11 @@ typedef struct quad_stat {
 
 typedef struct skip_stat {
     char name[61];
-    int ngrams[dim2];
+    int *ngrams;
+    unsigned char (*pos)[2];
+    stat_index *by_pos;
+    /* the members as a 0/1 position pair mask, NULL if skipped */
+    float *pair_mask;
     int length;
     /* multiple weights for skip-X-grams */
     float weight[10];
@@ -88,4 +126,24 @@ typedef struct meta_stat {
     int skip;
 } meta_stat;
 
+/*
+ * Structure to represent an evaluation plan, the subset of statistics an
+ * analysis actually needs. Each list holds indices into the matching stats_*
+ * array. For skipgrams, skip_masks holds one bit per needed skip distance
+ * (bit k for skip-k) of the stat at the same position in the skip list.
+ */
+typedef struct eval_plan {
+    int *mono;
+    int mono_length;
+    int *bi;
+    int bi_length;
+    int *tri;
+    int tri_length;
+    int *quad;
+    int quad_length;
+    int *skip;
+    int *skip_masks;
+    int skip_length;
+} eval_plan;
+
 #endif
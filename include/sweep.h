@@ -0,0 +1,71 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stddef.h>
+#include <json-c/json.h>
+
+#include "global.h"
+#include "structs.h"
+#include "api_util.h"
+
+/* Upper bound on the weight sets of a single sweep request. */
+#define MAX_SWEEP_WEIGHTS 1024
+
+/* Layouts analyzed and scored together by one unit of work. */
+#define SWEEP_BLOCK 8
+
+/*
+ * A weight sweep: every layout is analyzed once for the union of the stats
+ * its weight sets name, then scored under all of them at once as a block of
+ * stat vectors times the stats by weight sets matrix.
+ */
+typedef struct sweep_run {
+    json_object *layouts;
+    size_t count;
+    int sets;
+    /* the union of the weighted stats, and their stat_id() in plan order */
+    eval_plan *plan;
+    int stats;
+    int *ids;
+    /* stats rows by sets columns, the weight of each stat in each set or 0 */
+    float *matrix;
+    /* count rows by sets columns, the score of each layout under each set */
+    float *scores;
+    /* nonzero for layouts whose string is invalid */
+    char *invalid;
+} sweep_run;
+
+/*
+ * Parses a sweep request and compiles its weight sets into one plan and
+ * weight matrix. The run keeps using the request's layouts array.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+sweep_run *create_sweep_run(json_object *request, const char **message);
+
+/* Returns the number of blocks of a sweep, SWEEP_BLOCK layouts each. */
+size_t sweep_blocks(sweep_run *run);
+
+/*
+ * Analyzes one block of layouts and fills its rows of the score matrix. Safe
+ * to call for different blocks of the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   block: The index of the block, from 0 to sweep_blocks(run) - 1.
+ */
+void sweep_block(sweep_run *run, size_t block);
+
+/*
+ * Frees a sweep run.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_sweep_run(sweep_run *run);
+
+#endif
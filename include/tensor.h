@@ -0,0 +1,70 @@
+#ifndef TENSOR_H
+#define TENSOR_H
+
+#include "global.h"
+#include "structs.h"
+#include "api_util.h"
+
+/* A tuple of key positions holding a weight, with the linear_* table it reads. */
+typedef struct weighted_tuple {
+    unsigned char pos[4];
+    float weight;
+    const float *table;
+} weighted_tuple;
+
+/*
+ * A weight set compiled to per-position weights. Every stat sums the
+ * frequencies of the ngrams placed on its members, so a weighted score is the
+ * sum over tuples of key positions of the tuple's summed weight times the
+ * frequency of the characters a layout puts on it. Members shared by several
+ * weighted stats are merged into one tuple. The dense tensors hold every
+ * tuple; the tuple lists hold only those with a weight, which is all the
+ * scoring pass reads.
+ */
+typedef struct weight_tensors {
+    float mono[dim1];
+    /* bi[p0 * dim1 + p1] */
+    float *bi;
+    /* skip[(k - 1) * dim2 + p0 * dim1 + p1] for skip distance k, bit k of skip_mask set if any is weighted */
+    float *skip;
+    int skip_mask;
+    /* tri[(p0 * dim1 + p1) * dim1 + p2] */
+    float *tri;
+    /* bigram and skipgram tuples, trigram tuples, and quadgram tuples, sorted */
+    weighted_tuple *pairs;
+    int pair_length;
+    weighted_tuple *triples;
+    int triple_length;
+    weighted_tuple *quads;
+    int quad_length;
+} weight_tensors;
+
+/*
+ * Compiles a weight set into per-position weights.
+ *
+ * Parameters:
+ *   weights: The weight set, as accepted by parse_weights().
+ *
+ * Returns: The compiled weights, to be freed with free_weight_tensors().
+ */
+weight_tensors *compile_weights(CustomWeights *weights);
+
+/*
+ * Returns the weighted score of a layout in one pass over the compiled
+ * weights. The layout needs no analysis and its scores are left untouched.
+ *
+ * Parameters:
+ *   t: The compiled weights.
+ *   lt: The layout to score.
+ */
+float tensor_score(weight_tensors *t, layout *lt);
+
+/*
+ * Frees compiled weights.
+ *
+ * Parameters:
+ *   t: The compiled weights to free.
+ */
+void free_weight_tensors(weight_tensors *t);
+
+#endif
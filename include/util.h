@@ -1,6 +1,8 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
+
 #include "global.h"
 #include "structs.h"
 
@@ -124,19 +126,74 @@ size_t index_skip(int skip_index, int j, int k);
 void normalize_corpus();
 
 /*
- * Allocates memory for a new layout.
+ * Interleaves the normalized skipgram frequencies by skip distance into
+ * skip_rows, so the nine distances of a pair of characters are one vector.
+ * Slot 0 and the padding of each row stay zero.
+ */
+void interleave_skips();
+
+/*
+ * Returns the position of a stat in a layout's flat scores array.
+ * Parameters:
+ *   type: The type of the statistic ('m', 'b', 't', 'q', '1'-'9' for the
+ *         skipgram distances, or 'e' for meta).
+ *   index: The index of the statistic within its type.
+ */
+int stat_id(char type, int index);
+
+/*
+ * Allocates memory for a new layout. The layout and all of its scores live in
+ * a single cache-aligned block, with the scores as one flat array indexed by
+ * stat_id(); the per-type score pointers point into it.
  * Parameters:
- *   lt: Pointer to a layout pointer where the newly allocated layout will be stored.
+ *   lt: Pointer to a layout pointer where the newly allocated layout will be stored.
  */
 void alloc_layout(layout **lt);
 
 /*
  * Frees the memory occupied by a layout.
  * Parameters:
- *   lt: Pointer to the layout to be freed.
+ *   lt: Pointer to the layout to be freed.
  */
 void free_layout(layout *lt);
 
+/* Number of scratch layouts each thread may hold at once. */
+#define THREAD_LAYOUTS 16
+
+/*
+ * Returns a scratch layout owned by the calling thread, allocated on its first
+ * use and freed when the thread exits. Every call on a thread with the same
+ * slot returns the same layout, so it must not be freed and its contents do
+ * not survive the next user of that slot on that thread.
+ * Parameters:
+ *   slot: Which of the thread's layouts to return, from 0 to THREAD_LAYOUTS - 1.
+ */
+layout *thread_layout(int slot);
+
+/*
+ * Allocates memory for a new, empty evaluation plan.
+ * Parameters:
+ *   plan: Pointer to a plan pointer where the newly allocated plan will be stored.
+ */
+void alloc_plan(eval_plan **plan);
+
+/*
+ * Frees the memory occupied by an evaluation plan.
+ * Parameters:
+ *   plan: Pointer to the plan to be freed.
+ */
+void free_plan(eval_plan *plan);
+
+/*
+ * Adds a statistic to an evaluation plan, ignoring stats already planned.
+ * Parameters:
+ *   plan: Pointer to the plan.
+ *   type: The type of the statistic ('m', 'b', 't', 'q', or '1'-'9' for the
+ *         skip distance of a skipgram stat).
+ *   index: The index of the statistic in its stats_* array.
+ */
+void plan_stat(eval_plan *plan, char type, int index);
+
 /*
  * Calculates and assigns the overall score to a layout based on its statistics.
  * Parameters:
@@ -160,7 +217,40 @@ void copy(layout *lt_dest, layout *lt_src);
  */
 void skeleton_copy(layout *lt_dest, layout *lt_src);
 
-/* Returns a random float between 0 and 1. */
-float random_float();
+/*
+ * Returns a random float between 0 and 1 from a caller-owned xorshift64*
+ * generator. Each thread keeps its own state, so concurrent searches never
+ * contend on the global rand().
+ * Parameters:
+ *   state: Pointer to the generator state, which must not be zero.
+ */
+float random_float(uint64_t *state);
+
+/*
+ * Returns a random integer between 0 and n - 1.
+ * Parameters:
+ *   state: Pointer to the generator state, which must not be zero.
+ *   n: The number of possible values.
+ */
+int random_int(uint64_t *state, int n);
+
+/*
+ * Inserts a layout into a ranking, best first, keeping at most top distinct
+ * layouts. A layout already ranked keeps its better score.
+ * Parameters:
+ *   head: Pointer to the head of the ranking.
+ *   length: Pointer to the number of layouts in the ranking.
+ *   top: The maximum number of layouts to keep.
+ *   matrix: The keys of the layout.
+ *   score: The score of the layout.
+ */
+void rank_layout(layout_node **head, int *length, int top, int matrix[row][col], float score);
+
+/*
+ * Frees a ranking list.
+ * Parameters:
+ *   list: The head of the list, may be NULL.
+ */
+void free_ranking(layout_node *list);
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef WEIGHTS_CACHE_H
+#define WEIGHTS_CACHE_H
+
+#include <stdint.h>
+#include <json-c/json.h>
+
+#include "global.h"
+#include "structs.h"
+#include "api_util.h"
+#include "tensor.h"
+
+/* Number of distinct weight sets kept compiled between requests. */
+#define WEIGHTS_CACHE_SIZE 32
+
+/*
+ * A weight set with everything derived from it: the resolved stats, the plan
+ * of stats to analyze and the compiled per-position weights. Shared by every
+ * request with the same weights object and read-only once built.
+ */
+typedef struct compiled_weights {
+    CustomWeights weights;
+    eval_plan *plan;
+    weight_tensors *tensors;
+    /* unique to this compilation, for keying results computed with it */
+    uint64_t id;
+    /* bookkeeping of the cache, guarded by its lock */
+    char *key;
+    uint64_t hash;
+    int refs;
+    int cached;
+    struct compiled_weights *chain;
+    struct compiled_weights *newer;
+    struct compiled_weights *older;
+} compiled_weights;
+
+/*
+ * Returns the compiled form of a weights object, from the cache if the same
+ * object was compiled recently, otherwise compiling and caching it. The least
+ * recently used weight set leaves the cache once it is full. Safe to call
+ * from any thread.
+ *
+ * Parameters:
+ *   j_weights: The weights object of a request.
+ *
+ * Returns: The compiled weights, to be given back with release_weights(), or
+ *          NULL if parse_weights() rejects the object.
+ */
+compiled_weights *acquire_weights(json_object *j_weights);
+
+/*
+ * Gives back compiled weights from acquire_weights(). Weights that already
+ * left the cache are freed with their last user.
+ *
+ * Parameters:
+ *   cw: The compiled weights.
+ */
+void release_weights(compiled_weights *cw);
+
+/*
+ * Reads the counters of the cache.
+ *
+ * Parameters:
+ *   hits, misses: Set to the lookups answered from the cache and those that
+ *                 compiled, since the server started.
+ *   entries: Set to the number of weight sets cached.
+ */
+void weights_cache_counts(long *hits, long *misses, long *entries);
+
+/* Frees every cached weight set. No weights may be in use. */
+void free_weights_cache();
+
+#endif
@@ -4,132 +4,173 @@
  * Implements single layout cpu analysis.
  */
 
+#include <string.h>
+
 #include "analyze.h"
 #include "global.h"
 #include "structs.h"
 #include "util.h"
+#include "sparse.h"
 
 /*
- * Performs analysis on a single layout, calculating statistics for monograms,
- * bigrams, trigrams, quadgrams, and skipgrams. Then uses those values for meta
- * statistics.
+ * Member sums are split into MEMBER_LANES partial sums, member j into partial
+ * j % MEMBER_LANES, added up in order at the end. This file is compiled without
+ * reassociation, so the fixed order is what lets single_analyze() vectorize its
+ * member sums and multi_analyze() repeat them bit for bit.
+ */
+#define MEMBER_LANES 8
+
+/* Adds up the partial sums of a member sum in order. */
+static float add_lanes(const float sums[MEMBER_LANES])
+{
+    float score = 0;
+    for (int k = 0; k < MEMBER_LANES; k++) {score += sums[k];}
+    return score;
+}
+
+/* Adds up the partial sums of layout l's member sum in multi_analyze(), in the order of add_lanes(). */
+static float add_lanes_of(float sums[MEMBER_LANES][MULTI_LANES], int l)
+{
+    float score = 0;
+    for (int k = 0; k < MEMBER_LANES; k++) {score += sums[k][l];}
+    return score;
+}
+
+/* The engine single_analyze() is held to, see force_engine(). */
+static char forced_engine = 'a';
+
+/*
+ * Holds single_analyze() to one engine, for the engine self-check.
  *
  * Parameters:
- *   lt: A pointer to the layout to analyze.
+ *   engine: 'm' to sum every stat member by member, 'c' to sum over all
+ *           position pairs and the sparse corpus where they are built, 'a' to
+ *           pick the cheaper one per ngram width (the default).
  */
-void single_analyze(layout *lt)
+void force_engine(char engine)
 {
-    int row0, col0, row1, col1, row2, col2, row3, col3;
+    forced_engine = engine;
+}
 
-    /* Calculate monogram statistics. */
-    for (int i = 0; i < MONO_LENGTH; i++)
+/*
+ * Maps every flat key position of a layout to its character, pre-scaled for
+ * each place in an ngram so a linear_* index is just a sum of lookups. Empty
+ * keys map to character 0 (the space), which the corpus never counts, so they
+ * add nothing without needing a branch.
+ */
+static void fill_tables(layout *lt, int c1[], int c2[], int c3[], int c4[])
+{
+    for (int r = 0; r < ROW; r++)
     {
-        if(!stats_mono[i].skip)
+        for (int c = 0; c < COL; c++)
         {
-            lt->mono_score[i] = 0;
-            int length = stats_mono[i].length;
-            for (int j = 0; j < length; j++)
-            {
-                /* unflattens a 1D index into a 2D matrix coordinate */
-                unflat_mono(stats_mono[i].ngrams[j], &row0, &col0); /* util.c */
-                if (lt->matrix[row0][col0] != -1)
-                {
-                    /* calculates the index for a monogram in a linearized array */
-                    size_t index = index_mono(lt->matrix[row0][col0]); /* util.c */
-                    lt->mono_score[i] += linear_mono[index];
-                }
-            }
+            int ch = lt->matrix[r][c] != -1 ? lt->matrix[r][c] : 0;
+            c1[r * COL + c] = ch;
+            c2[r * COL + c] = ch * LANG_LENGTH;
+            c3[r * COL + c] = ch * LANG_LENGTH * LANG_LENGTH;
+            c4[r * COL + c] = ch * LANG_LENGTH * LANG_LENGTH * LANG_LENGTH;
         }
     }
+}
 
-    /* Calculate bigram statistics. */
-    for (int i = 0; i < BI_LENGTH; i++)
+/*
+ * Maps every character of the language to the flat key position holding it,
+ * -1 if it is not on the layout.
+ *
+ * Returns: 0 if a character is on the layout twice, 1 otherwise.
+ */
+static int place_chars(layout *lt, int where[])
+{
+    for (int i = 0; i < LANG_LENGTH; i++) {where[i] = -1;}
+    for (int p = 0; p < DIM1; p++)
     {
-        if(!stats_bi[i].skip)
-        {
-            lt->bi_score[i] = 0;
-            int length = stats_bi[i].length;
-            for (int j = 0; j < length; j++)
-            {
-                /* unflattens a 1D index into a 4D matrix coordinate */
-                unflat_bi(stats_bi[i].ngrams[j], &row0, &col0, &row1, &col1); /* util.c */
-                if (lt->matrix[row0][col0] != -1 && lt->matrix[row1][col1] != -1)
-                {
-                    /* calculates the index for a bigram in a linearized array */
-                    size_t index = index_bi(lt->matrix[row0][col0], lt->matrix[row1][col1]); /* util.c */
-                    lt->bi_score[i] += linear_bi[index];
-                }
-            }
-        }
+        int ch = lt->matrix[p / COL][p % COL];
+        if (ch == -1) {continue;}
+        if (where[ch] != -1) {return 0;}
+        where[ch] = p;
     }
+    return 1;
+}
 
-    /* Calculate trigram statistics. */
-    for (int i = 0; i < TRI_LENGTH; i++)
+/*
+ * Gathers the frequency of every position pair of a layout from a bigram or
+ * skipgram table, pairs[p0 * dim1 + p1], zero past the last pair.
+ */
+static void fill_pairs(const float *table, const int c1[], const int c2[],
+    float pairs[PAIR_LENGTH])
+{
+    for (int p0 = 0; p0 < DIM1; p0++)
     {
-        if(!stats_tri[i].skip)
-        {
-            lt->tri_score[i] = 0;
-            int length = stats_tri[i].length;
-            for (int j = 0; j < length; j++)
-            {
-                /* unflattens a 1D index into a 6D matrix coordinate */
-                unflat_tri(stats_tri[i].ngrams[j], &row0, &col0, &row1, &col1, &row2, &col2); /* util.c */
-                if (lt->matrix[row0][col0] != -1 && lt->matrix[row1][col1] != -1 && lt->matrix[row2][col2] != -1)
-                {
-                    /* calculates the index for a trigram in a linearized array */
-                    size_t index = index_tri(lt->matrix[row0][col0], lt->matrix[row1][col1], lt->matrix[row2][col2]); /* util.c */
-                    lt->tri_score[i] += linear_tri[index];
-                }
-            }
-        }
+        const float *from = table + c2[p0];
+        float *to = pairs + p0 * DIM1;
+        for (int p1 = 0; p1 < DIM1; p1++) {to[p1] = from[c1[p1]];}
     }
+    memset(pairs + DIM2, 0, (PAIR_LENGTH - DIM2) * sizeof(float));
+}
 
-    /* Calculate quadgram statistics. */
-    for (int i = 0; i < QUAD_LENGTH; i++)
-    {
-        if(!stats_quad[i].skip)
-        {
-            lt->quad_score[i] = 0;
-            int length = stats_quad[i].length;
-            for (int j = 0; j < length; j++)
-            {
-                /* unflattens a 1D index into a 8D matrix coordinate */
-                unflat_quad(stats_quad[i].ngrams[j], &row0, &col0, &row1, &col1, &row2, &col2, &row3, &col3); /* util.c */
-                if (lt->matrix[row0][col0] != -1 && lt->matrix[row1][col1] != -1 && lt->matrix[row2][col2] != -1 && lt->matrix[row3][col3] != -1)
-                {
-                    /* calculates the index for a quadgram in a linearized array */
-                    size_t index = index_quad(lt->matrix[row0][col0], lt->matrix[row1][col1], lt->matrix[row2][col2], lt->matrix[row3][col3]); /* util.c */
-                    lt->quad_score[i] += linear_quad[index];
-                }
-            }
-        }
-    }
+/*
+ * Returns whether gathering all position pairs and summing each stat as a dot
+ * product beats summing the stats member by member. Costs are in tenths of a
+ * bigram member sum, measured with the Makefile's flags on AVX-512: one gather
+ * of all pairs costs 11 * dim2, one dot product dim2, and one member of the
+ * interleaved skipgram rows 60.
+ *
+ * Parameters:
+ *   members: The members of the stats summed member by member.
+ *   member_cost: The cost of one of those members.
+ *   passes: The gathers of all pairs needed instead.
+ *   dots: The dot products needed instead.
+ */
+static int pairs_cheaper(int members, int member_cost, int passes, int dots)
+{
+    if (forced_engine != 'a') {return forced_engine == 'c';}
+    return members * member_cost > DIM2 * (11 * passes + dots);
+}
 
-    /* Calculate skipgram statistics. */
-    for (int i = 0; i < SKIP_LENGTH; i++)
+/*
+ * Returns whether walking the sparse corpus beats summing the stats member by
+ * member. Walking the corpus costs the same for any number of stats.
+ *
+ * Parameters:
+ *   sp: The sparse ngrams of the stats' width, NULL if not built.
+ *   members: The members of the stats.
+ */
+static int sparse_cheaper(const sparse_ngrams *sp, int members)
+{
+    if (!sp) {return 0;}
+    if (forced_engine != 'a') {return forced_engine == 'c';}
+    return (size_t)members > sp->length;
+}
+
+/*
+ * Sums the pair frequencies under the 0/1 mask of each of several stats into
+ * their scores, each as a dot product of the pairs with the mask. The products
+ * are added into 16 partial sums, one per vector lane, so the loop vectorizes
+ * without reassociating, which this file is compiled without.
+ */
+static void sum_pairs(const float pairs[PAIR_LENGTH], float *const masks[],
+    float *const scores[], int count)
+{
+    for (int s = 0; s < count; s++)
     {
-        if(!stats_skip[i].skip)
+        const float *restrict mask = __builtin_assume_aligned(masks[s], 64);
+        float sums[16] = {0};
+        for (int j = 0; j < PAIR_LENGTH; j += 16)
         {
-            int length = stats_skip[i].length;
-            for (int k = 1; k <= 9; k++)
-            {
-                lt->skip_score[k][i] = 0;
-                for (int j = 0; j < length; j++)
-                {
-                    /* unflattens a 1D index into a 4D matrix coordinate */
-                    unflat_bi(stats_skip[i].ngrams[j], &row0, &col0, &row1, &col1); /* util.c */
-                    if (lt->matrix[row0][col0] != -1 && lt->matrix[row1][col1] != -1)
-                    {
-                        /* calculates the index for a skipgram in a linearized array */
-                        size_t index = index_skip(k, lt->matrix[row0][col0], lt->matrix[row1][col1]); /* util.c */
-                        lt->skip_score[k][i] += linear_skip[index];
-                    }
-                }
-            }
+            for (int k = 0; k < 16; k++) {sums[k] += pairs[j + k] * mask[j + k];}
         }
+        float sum = 0;
+        for (int k = 0; k < 16; k++) {sum += sums[k];}
+        *scores[s] = sum;
     }
+}
 
-    /* Perform meta-analysis, which may depend on previously calculated statistics. */
+/*
+ * Calculates the meta statistics of a layout from its other statistics, which
+ * must all be up to date.
+ */
+static void meta_analyze(layout *lt)
+{
     for (int i = 0; i < META_LENGTH; i++)
     {
         if (!stats_meta[i].skip)
@@ -186,3 +227,668 @@ void single_analyze(layout *lt)
         }
     }
 }
+
+/*
+ * Performs analysis on a single layout, calculating statistics for monograms,
+ * bigrams, trigrams, quadgrams, and skipgrams. Then uses those values for meta
+ * statistics.
+ *
+ * Parameters:
+ *   lt: A pointer to the layout to analyze.
+ *   plan: The statistics to calculate, or NULL for every stat that is not
+ *         skipped. Meta statistics are only calculated without a plan.
+ */
+void single_analyze(layout *lt, eval_plan *plan)
+{
+    int c1[DIM1], c2[DIM1], c3[DIM1], c4[DIM1];
+    fill_tables(lt, c1, c2, c3, c4);
+
+    /* Calculate monogram statistics. */
+    int count = plan ? plan->mono_length : MONO_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->mono[p] : p;
+        if(plan || !stats_mono[i].skip)
+        {
+            const unsigned char *pos = stats_mono[i].pos;
+            int length = stats_mono[i].length;
+            float score = 0;
+            for (int j = 0; j < length; j++)
+            {
+                score += linear_mono[c1[pos[j]]];
+            }
+            lt->mono_score[i] = score;
+        }
+    }
+
+    /* Calculate bigram statistics. */
+    count = plan ? plan->bi_length : BI_LENGTH;
+    /* the stats of one pass over the pairs, bigrams or one skip distance */
+    float *masks[(count > SKIP_LENGTH ? count : SKIP_LENGTH) + 1];
+    float *scores[(count > SKIP_LENGTH ? count : SKIP_LENGTH) + 1];
+    float pairs[PAIR_LENGTH] __attribute__((aligned(64)));
+    int planned = 0, members = 0;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->bi[p] : p;
+        if(plan || !stats_bi[i].skip)
+        {
+            masks[planned] = stats_bi[i].pair_mask;
+            scores[planned++] = &lt->bi_score[i];
+            members += stats_bi[i].length;
+        }
+    }
+    if (pairs_cheaper(members, 10, 1, planned))
+    {
+        fill_pairs(linear_bi, c1, c2, pairs);
+        sum_pairs(pairs, masks, scores, planned);
+    }
+    else
+    {
+        for (int p = 0; p < count; p++)
+        {
+            int i = plan ? plan->bi[p] : p;
+            if(plan || !stats_bi[i].skip)
+            {
+                const unsigned char (*pos)[2] = stats_bi[i].pos;
+                int length = stats_bi[i].length;
+                float sums[MEMBER_LANES] = {0};
+                int j = 0;
+                for (; j + MEMBER_LANES <= length; j += MEMBER_LANES)
+                {
+                    for (int k = 0; k < MEMBER_LANES; k++) {
+                        sums[k] += linear_bi[c2[pos[j + k][0]] + c1[pos[j + k][1]]];
+                    }
+                }
+                for (; j < length; j++) {
+                    sums[j % MEMBER_LANES] += linear_bi[c2[pos[j][0]] + c1[pos[j][1]]];
+                }
+                lt->bi_score[i] = add_lanes(sums);
+            }
+        }
+    }
+
+    /* the stats of one width for the sparse corpus, and where each character sits */
+    int sparse_stats[(TRI_LENGTH > QUAD_LENGTH ? TRI_LENGTH : QUAD_LENGTH) + 1];
+    int where[LANG_LENGTH];
+    int placed = place_chars(lt, where);
+
+    /* Calculate trigram statistics. */
+    count = plan ? plan->tri_length : TRI_LENGTH;
+    planned = 0;
+    members = 0;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->tri[p] : p;
+        if(plan || !stats_tri[i].skip)
+        {
+            sparse_stats[planned++] = i;
+            members += stats_tri[i].length;
+        }
+    }
+    if (placed && sparse_cheaper(sparse_tri, members))
+    {
+        sparse_analyze(sparse_tri, where, sparse_stats, planned, lt->tri_score); /* sparse.c */
+    }
+    else
+    {
+        for (int p = 0; p < planned; p++)
+        {
+            int i = sparse_stats[p];
+            const unsigned char (*pos)[3] = stats_tri[i].pos;
+            int length = stats_tri[i].length;
+            float sums[MEMBER_LANES] = {0};
+            int j = 0;
+            for (; j + MEMBER_LANES <= length; j += MEMBER_LANES)
+            {
+                for (int k = 0; k < MEMBER_LANES; k++) {
+                    const unsigned char *m = pos[j + k];
+                    sums[k] += linear_tri[c3[m[0]] + c2[m[1]] + c1[m[2]]];
+                }
+            }
+            for (; j < length; j++) {
+                sums[j % MEMBER_LANES] += linear_tri[c3[pos[j][0]] + c2[pos[j][1]] + c1[pos[j][2]]];
+            }
+            lt->tri_score[i] = add_lanes(sums);
+        }
+    }
+
+    /* Calculate quadgram statistics. */
+    count = plan ? plan->quad_length : QUAD_LENGTH;
+    planned = 0;
+    members = 0;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->quad[p] : p;
+        if(plan || !stats_quad[i].skip)
+        {
+            sparse_stats[planned++] = i;
+            members += stats_quad[i].length;
+        }
+    }
+    if (placed && sparse_cheaper(sparse_quad, members))
+    {
+        sparse_analyze(sparse_quad, where, sparse_stats, planned, lt->quad_score); /* sparse.c */
+    }
+    else
+    {
+        for (int p = 0; p < planned; p++)
+        {
+            int i = sparse_stats[p];
+            const unsigned char (*pos)[4] = stats_quad[i].pos;
+            int length = stats_quad[i].length;
+            float sums[MEMBER_LANES] = {0};
+            int j = 0;
+            for (; j + MEMBER_LANES <= length; j += MEMBER_LANES)
+            {
+                for (int k = 0; k < MEMBER_LANES; k++) {
+                    const unsigned char *m = pos[j + k];
+                    sums[k] += linear_quad[c4[m[0]] + c3[m[1]] + c2[m[2]] + c1[m[3]]];
+                }
+            }
+            for (; j < length; j++) {
+                sums[j % MEMBER_LANES] += linear_quad[c4[pos[j][0]] + c3[pos[j][1]] + c2[pos[j][2]] + c1[pos[j][3]]];
+            }
+            lt->quad_score[i] = add_lanes(sums);
+        }
+    }
+
+    /* Calculate skipgram statistics. */
+    count = plan ? plan->skip_length : SKIP_LENGTH;
+    members = 0;
+    int distances = 0, dots = 0;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->skip[p] : p;
+        if(plan || !stats_skip[i].skip)
+        {
+            members += stats_skip[i].length;
+            /* bit k set for each skip distance to calculate */
+            int mask = plan ? plan->skip_masks[p] : 0x3FE;
+            distances |= mask;
+            dots += __builtin_popcount(mask);
+        }
+    }
+    /* one pair pass per distance, against one interleaved row per member */
+    if (pairs_cheaper(members, 60, __builtin_popcount(distances), dots))
+    {
+        for (int k = 1; k <= 9; k++)
+        {
+            /* skip-k table of the linearized skipgram array */
+            const float *skip = linear_skip + index_skip(k, 0, 0); /* util.c */
+            planned = 0;
+            for (int p = 0; p < count; p++)
+            {
+                int i = plan ? plan->skip[p] : p;
+                int mask = plan ? plan->skip_masks[p] : 0x3FE;
+                if((plan || !stats_skip[i].skip) && (mask & (1 << k)))
+                {
+                    masks[planned] = stats_skip[i].pair_mask;
+                    scores[planned++] = &lt->skip_score[k][i];
+                }
+            }
+            if (!planned) {continue;}
+            fill_pairs(skip, c1, c2, pairs);
+            sum_pairs(pairs, masks, scores, planned);
+        }
+    }
+    else
+    {
+        for (int p = 0; p < count; p++)
+        {
+            int i = plan ? plan->skip[p] : p;
+            if(plan || !stats_skip[i].skip)
+            {
+                const unsigned char (*pos)[2] = stats_skip[i].pos;
+                int length = stats_skip[i].length;
+                /* every distance of a member in one add of its interleaved row */
+                float score[SKIP_ROW] = {0};
+                for (int j = 0; j < length; j++)
+                {
+                    const float *freqs = skip_rows + (c2[pos[j][0]] + c1[pos[j][1]]) * SKIP_ROW;
+                    for (int k = 0; k < SKIP_ROW; k++) {score[k] += freqs[k];}
+                }
+                int mask = plan ? plan->skip_masks[p] : 0x3FE;
+                for (int k = 1; k <= 9; k++)
+                {
+                    if (mask & (1 << k)) {lt->skip_score[k][i] = score[k];}
+                }
+            }
+        }
+    }
+
+    /* Perform meta-analysis, which may depend on previously calculated statistics. */
+    if (!plan) {meta_analyze(lt);}
+}
+
+/*
+ * Returns whether single_analyze() would sum every stat of a plan member by
+ * member, rather than over all position pairs or the sparse corpus.
+ */
+static int plan_sums_members(eval_plan *plan)
+{
+    int members = 0;
+    for (int p = 0; p < plan->bi_length; p++) {members += stats_bi[plan->bi[p]].length;}
+    if (pairs_cheaper(members, 10, 1, plan->bi_length)) {return 0;}
+
+    members = 0;
+    for (int p = 0; p < plan->tri_length; p++) {members += stats_tri[plan->tri[p]].length;}
+    if (sparse_cheaper(sparse_tri, members)) {return 0;}
+
+    members = 0;
+    for (int p = 0; p < plan->quad_length; p++) {members += stats_quad[plan->quad[p]].length;}
+    if (sparse_cheaper(sparse_quad, members)) {return 0;}
+
+    members = 0;
+    int distances = 0, dots = 0;
+    for (int p = 0; p < plan->skip_length; p++)
+    {
+        members += stats_skip[plan->skip[p]].length;
+        distances |= plan->skip_masks[p];
+        dots += __builtin_popcount(plan->skip_masks[p]);
+    }
+    return !pairs_cheaper(members, 60, __builtin_popcount(distances), dots);
+}
+
+/*
+ * Performs analysis on up to MULTI_LANES layouts at once for the same plan,
+ * with the same results as single_analyze() on each. Each stat's member list
+ * is walked once for all of them: the character tables hold one lane per
+ * layout side by side, so every member gathers the frequencies of all layouts
+ * together and the lane loops vectorize. Plans that single_analyze() would
+ * score over all position pairs or the sparse corpus are analyzed one layout
+ * at a time.
+ *
+ * Parameters:
+ *   lts: The layouts to analyze.
+ *   count: The number of layouts, from 1 to MULTI_LANES.
+ *   plan: The statistics to calculate.
+ */
+void multi_analyze(layout **lts, int count, eval_plan *plan)
+{
+    if (count == 1 || !plan_sums_members(plan))
+    {
+        for (int l = 0; l < count; l++) {single_analyze(lts[l], plan);}
+        return;
+    }
+
+    /* lanes past count stay on character 0, which the corpus never counts */
+    int c1[dim1][MULTI_LANES] = {{0}}, c2[dim1][MULTI_LANES] = {{0}};
+    int c3[dim1][MULTI_LANES] = {{0}}, c4[dim1][MULTI_LANES] = {{0}};
+    for (int l = 0; l < count; l++)
+    {
+        int t1[DIM1], t2[DIM1], t3[DIM1], t4[DIM1];
+        fill_tables(lts[l], t1, t2, t3, t4);
+        for (int p = 0; p < DIM1; p++)
+        {
+            c1[p][l] = t1[p];
+            c2[p][l] = t2[p];
+            c3[p][l] = t3[p];
+            c4[p][l] = t4[p];
+        }
+    }
+
+    /* Calculate monogram statistics. */
+    for (int p = 0; p < plan->mono_length; p++)
+    {
+        int i = plan->mono[p];
+        const unsigned char *pos = stats_mono[i].pos;
+        float score[MULTI_LANES] = {0};
+        for (int j = 0; j < stats_mono[i].length; j++)
+        {
+            for (int l = 0; l < MULTI_LANES; l++) {score[l] += linear_mono[c1[pos[j]][l]];}
+        }
+        for (int l = 0; l < count; l++) {lts[l]->mono_score[i] = score[l];}
+    }
+
+    /* Calculate bigram statistics. */
+    for (int p = 0; p < plan->bi_length; p++)
+    {
+        int i = plan->bi[p];
+        const unsigned char (*pos)[2] = stats_bi[i].pos;
+        float sums[MEMBER_LANES][MULTI_LANES] = {{0}};
+        for (int j = 0; j < stats_bi[i].length; j++)
+        {
+            const int *a = c2[pos[j][0]], *b = c1[pos[j][1]];
+            float *sum = sums[j % MEMBER_LANES];
+            for (int l = 0; l < MULTI_LANES; l++) {sum[l] += linear_bi[a[l] + b[l]];}
+        }
+        for (int l = 0; l < count; l++) {lts[l]->bi_score[i] = add_lanes_of(sums, l);}
+    }
+
+    /* Calculate trigram statistics. */
+    for (int p = 0; p < plan->tri_length; p++)
+    {
+        int i = plan->tri[p];
+        const unsigned char (*pos)[3] = stats_tri[i].pos;
+        float sums[MEMBER_LANES][MULTI_LANES] = {{0}};
+        for (int j = 0; j < stats_tri[i].length; j++)
+        {
+            const int *a = c3[pos[j][0]], *b = c2[pos[j][1]], *c = c1[pos[j][2]];
+            float *sum = sums[j % MEMBER_LANES];
+            for (int l = 0; l < MULTI_LANES; l++) {sum[l] += linear_tri[a[l] + b[l] + c[l]];}
+        }
+        for (int l = 0; l < count; l++) {lts[l]->tri_score[i] = add_lanes_of(sums, l);}
+    }
+
+    /* Calculate quadgram statistics. */
+    for (int p = 0; p < plan->quad_length; p++)
+    {
+        int i = plan->quad[p];
+        const unsigned char (*pos)[4] = stats_quad[i].pos;
+        float sums[MEMBER_LANES][MULTI_LANES] = {{0}};
+        for (int j = 0; j < stats_quad[i].length; j++)
+        {
+            const int *a = c4[pos[j][0]], *b = c3[pos[j][1]], *c = c2[pos[j][2]], *d = c1[pos[j][3]];
+            float *sum = sums[j % MEMBER_LANES];
+            for (int l = 0; l < MULTI_LANES; l++) {sum[l] += linear_quad[a[l] + b[l] + c[l] + d[l]];}
+        }
+        for (int l = 0; l < count; l++) {lts[l]->quad_score[i] = add_lanes_of(sums, l);}
+    }
+
+    /* Calculate skipgram statistics. */
+    for (int p = 0; p < plan->skip_length; p++)
+    {
+        int i = plan->skip[p];
+        const unsigned char (*pos)[2] = stats_skip[i].pos;
+        /* every distance of a member in one add of its interleaved row, per lane */
+        float score[MULTI_LANES][SKIP_ROW] = {{0}};
+        for (int j = 0; j < stats_skip[i].length; j++)
+        {
+            const int *a = c2[pos[j][0]], *b = c1[pos[j][1]];
+            for (int l = 0; l < MULTI_LANES; l++)
+            {
+                const float *freqs = skip_rows + (a[l] + b[l]) * SKIP_ROW;
+                for (int k = 0; k < SKIP_ROW; k++) {score[l][k] += freqs[k];}
+            }
+        }
+        for (int k = 1; k <= 9; k++)
+        {
+            if (!(plan->skip_masks[p] & (1 << k))) {continue;}
+            for (int l = 0; l < count; l++) {lts[l]->skip_score[k][i] = score[l][k];}
+        }
+    }
+}
+
+/* Returns a stat's share of an order's total count, in percent, 0 for an empty corpus. */
+static float exact_share(long long count, long long total)
+{
+    return total > 0 ? (float)((double)count * 100 / total) : 0;
+}
+
+/*
+ * Performs analysis on a single layout like single_analyze(), but sums the
+ * raw corpus counts of each stat's members as integers and divides by the
+ * total of the stat's order once at the end. Integer sums do not depend on
+ * the order they are added in, so the results are bit for bit the same
+ * whatever the thread count, vector width or member order.
+ *
+ * Parameters:
+ *   lt: A pointer to the layout to analyze.
+ *   plan: The statistics to calculate, or NULL for every stat that is not
+ *         skipped. Meta statistics are only calculated without a plan.
+ */
+void exact_analyze(layout *lt, eval_plan *plan)
+{
+    int c1[DIM1], c2[DIM1], c3[DIM1], c4[DIM1];
+    fill_tables(lt, c1, c2, c3, c4);
+
+    /* Calculate monogram statistics. */
+    int count = plan ? plan->mono_length : MONO_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->mono[p] : p;
+        if(plan || !stats_mono[i].skip)
+        {
+            const unsigned char *pos = stats_mono[i].pos;
+            long long sum = 0;
+            for (int j = 0; j < stats_mono[i].length; j++)
+            {
+                sum += corpus_mono[c1[pos[j]]];
+            }
+            lt->mono_score[i] = exact_share(sum, total_mono);
+        }
+    }
+
+    /* Calculate bigram statistics. */
+    count = plan ? plan->bi_length : BI_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->bi[p] : p;
+        if(plan || !stats_bi[i].skip)
+        {
+            const unsigned char (*pos)[2] = stats_bi[i].pos;
+            long long sum = 0;
+            for (int j = 0; j < stats_bi[i].length; j++)
+            {
+                sum += corpus_bi[c2[pos[j][0]] + c1[pos[j][1]]];
+            }
+            lt->bi_score[i] = exact_share(sum, total_bi);
+        }
+    }
+
+    /* Calculate trigram statistics. */
+    count = plan ? plan->tri_length : TRI_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->tri[p] : p;
+        if(plan || !stats_tri[i].skip)
+        {
+            const unsigned char (*pos)[3] = stats_tri[i].pos;
+            long long sum = 0;
+            for (int j = 0; j < stats_tri[i].length; j++)
+            {
+                sum += corpus_tri[c3[pos[j][0]] + c2[pos[j][1]] + c1[pos[j][2]]];
+            }
+            lt->tri_score[i] = exact_share(sum, total_tri);
+        }
+    }
+
+    /* Calculate quadgram statistics. */
+    count = plan ? plan->quad_length : QUAD_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->quad[p] : p;
+        if(plan || !stats_quad[i].skip)
+        {
+            const unsigned char (*pos)[4] = stats_quad[i].pos;
+            long long sum = 0;
+            for (int j = 0; j < stats_quad[i].length; j++)
+            {
+                sum += corpus_quad[c4[pos[j][0]] + c3[pos[j][1]] + c2[pos[j][2]] + c1[pos[j][3]]];
+            }
+            lt->quad_score[i] = exact_share(sum, total_quad);
+        }
+    }
+
+    /* Calculate skipgram statistics. */
+    count = plan ? plan->skip_length : SKIP_LENGTH;
+    for (int p = 0; p < count; p++)
+    {
+        int i = plan ? plan->skip[p] : p;
+        if(plan || !stats_skip[i].skip)
+        {
+            const unsigned char (*pos)[2] = stats_skip[i].pos;
+            int mask = plan ? plan->skip_masks[p] : 0x3FE;
+            for (int k = 1; k <= 9; k++)
+            {
+                if (!(mask & (1 << k))) {continue;}
+                const long long *skip = corpus_skip + index_skip(k, 0, 0); /* util.c */
+                long long sum = 0;
+                for (int j = 0; j < stats_skip[i].length; j++)
+                {
+                    sum += skip[c2[pos[j][0]] + c1[pos[j][1]]];
+                }
+                lt->skip_score[k][i] = exact_share(sum, total_skip[k]);
+            }
+        }
+    }
+
+    /* Perform meta-analysis, which may depend on previously calculated statistics. */
+    if (!plan) {meta_analyze(lt);}
+}
+
+/*
+ * Updates the statistics of a layout whose keys differ from an analyzed base
+ * layout at only a few positions. Each stat starts from the base's value and
+ * only re-sums its members that touch a changed position, once with the old
+ * keys and once with the new ones, so the cost is proportional to the
+ * affected ngrams rather than to all of them.
+ *
+ * Parameters:
+ *   lt: A pointer to the changed layout, whose scores are overwritten.
+ *   base: A pointer to the base layout, analyzed with the same plan.
+ *   positions: The flat key positions at which the two layouts differ.
+ *   count: The number of positions.
+ *   plan: The statistics to update, or NULL for every stat that is not
+ *         skipped. Meta statistics are only updated without a plan.
+ */
+void delta_analyze(layout *lt, layout *base, const int *positions, int count, eval_plan *plan)
+{
+    /* new and old keys, as in single_analyze() */
+    int n1[DIM1], n2[DIM1], n3[DIM1], n4[DIM1];
+    int o1[DIM1], o2[DIM1], o3[DIM1], o4[DIM1];
+    fill_tables(lt, n1, n2, n3, n4);
+    fill_tables(base, o1, o2, o3, o4);
+
+    /*
+     * 1 + the order of each changed position, 0 if unchanged. A member that
+     * touches several changed positions is only counted at the first one.
+     */
+    int order[DIM1];
+    memset(order, 0, sizeof(order));
+    for (int a = 0; a < count; a++) {order[positions[a]] = a + 1;}
+    #define EARLIER(p) (order[p] && order[p] <= a)
+
+    /* Update monogram statistics. */
+    int length = plan ? plan->mono_length : MONO_LENGTH;
+    for (int p = 0; p < length; p++)
+    {
+        int i = plan ? plan->mono[p] : p;
+        if(plan || !stats_mono[i].skip)
+        {
+            const stat_index *index = stats_mono[i].by_pos;
+            float delta = 0;
+            for (int a = 0; a < count; a++)
+            {
+                int k = positions[a];
+                /* a monogram member touching k is k itself */
+                if (index->start[k + 1] > index->start[k])
+                {
+                    delta += linear_mono[n1[k]] - linear_mono[o1[k]];
+                }
+            }
+            lt->mono_score[i] = base->mono_score[i] + delta;
+        }
+    }
+
+    /* Update bigram statistics. */
+    length = plan ? plan->bi_length : BI_LENGTH;
+    for (int p = 0; p < length; p++)
+    {
+        int i = plan ? plan->bi[p] : p;
+        if(plan || !stats_bi[i].skip)
+        {
+            const unsigned char (*pos)[2] = stats_bi[i].pos;
+            const stat_index *index = stats_bi[i].by_pos;
+            float delta = 0;
+            for (int a = 0; a < count; a++)
+            {
+                int k = positions[a];
+                for (int j = index->start[k]; j < index->start[k + 1]; j++)
+                {
+                    const unsigned char *m = pos[index->members[j]];
+                    if (EARLIER(m[0]) || EARLIER(m[1])) {continue;}
+                    delta += linear_bi[n2[m[0]] + n1[m[1]]]
+                        - linear_bi[o2[m[0]] + o1[m[1]]];
+                }
+            }
+            lt->bi_score[i] = base->bi_score[i] + delta;
+        }
+    }
+
+    /* Update trigram statistics. */
+    length = plan ? plan->tri_length : TRI_LENGTH;
+    for (int p = 0; p < length; p++)
+    {
+        int i = plan ? plan->tri[p] : p;
+        if(plan || !stats_tri[i].skip)
+        {
+            const unsigned char (*pos)[3] = stats_tri[i].pos;
+            const stat_index *index = stats_tri[i].by_pos;
+            float delta = 0;
+            for (int a = 0; a < count; a++)
+            {
+                int k = positions[a];
+                for (int j = index->start[k]; j < index->start[k + 1]; j++)
+                {
+                    const unsigned char *m = pos[index->members[j]];
+                    if (EARLIER(m[0]) || EARLIER(m[1]) || EARLIER(m[2])) {continue;}
+                    delta += linear_tri[n3[m[0]] + n2[m[1]] + n1[m[2]]]
+                        - linear_tri[o3[m[0]] + o2[m[1]] + o1[m[2]]];
+                }
+            }
+            lt->tri_score[i] = base->tri_score[i] + delta;
+        }
+    }
+
+    /* Update quadgram statistics. */
+    length = plan ? plan->quad_length : QUAD_LENGTH;
+    for (int p = 0; p < length; p++)
+    {
+        int i = plan ? plan->quad[p] : p;
+        if(plan || !stats_quad[i].skip)
+        {
+            const unsigned char (*pos)[4] = stats_quad[i].pos;
+            const stat_index *index = stats_quad[i].by_pos;
+            float delta = 0;
+            for (int a = 0; a < count; a++)
+            {
+                int k = positions[a];
+                for (int j = index->start[k]; j < index->start[k + 1]; j++)
+                {
+                    const unsigned char *m = pos[index->members[j]];
+                    if (EARLIER(m[0]) || EARLIER(m[1]) || EARLIER(m[2]) || EARLIER(m[3])) {continue;}
+                    delta += linear_quad[n4[m[0]] + n3[m[1]] + n2[m[2]] + n1[m[3]]]
+                        - linear_quad[o4[m[0]] + o3[m[1]] + o2[m[2]] + o1[m[3]]];
+                }
+            }
+            lt->quad_score[i] = base->quad_score[i] + delta;
+        }
+    }
+
+    /* Update skipgram statistics. */
+    length = plan ? plan->skip_length : SKIP_LENGTH;
+    for (int p = 0; p < length; p++)
+    {
+        int i = plan ? plan->skip[p] : p;
+        if(plan || !stats_skip[i].skip)
+        {
+            const unsigned char (*pos)[2] = stats_skip[i].pos;
+            const stat_index *index = stats_skip[i].by_pos;
+            /* every distance of a member in one pass over the interleaved rows */
+            float delta[SKIP_ROW] = {0};
+            for (int a = 0; a < count; a++)
+            {
+                int k = positions[a];
+                for (int j = index->start[k]; j < index->start[k + 1]; j++)
+                {
+                    const unsigned char *m = pos[index->members[j]];
+                    if (EARLIER(m[0]) || EARLIER(m[1])) {continue;}
+                    const float *now = skip_rows + (n2[m[0]] + n1[m[1]]) * SKIP_ROW;
+                    const float *was = skip_rows + (o2[m[0]] + o1[m[1]]) * SKIP_ROW;
+                    for (int s = 0; s < SKIP_ROW; s++) {delta[s] += now[s] - was[s];}
+                }
+            }
+            int mask = plan ? plan->skip_masks[p] : 0x3FE;
+            for (int s = 1; s <= 9; s++)
+            {
+                if (mask & (1 << s)) {lt->skip_score[s][i] = base->skip_score[s][i] + delta[s];}
+            }
+        }
+    }
+    #undef EARLIER
+
+    /* Meta statistics are cheap, recalculate them from the updated stats. */
+    if (!plan) {meta_analyze(lt);}
+}
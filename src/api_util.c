@@ -1,9 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
+#include <math.h>
 #include "api_util.h"
 #include "io_util.h"
 #include "stats_util.h"
+#include "util.h"
 #include "io.h"
 
 int parse_layout_from_string(layout *lt, const char *layout_str) {
@@ -41,67 +44,232 @@ int parse_layout_from_string(layout *lt, const char *layout_str) {
     return 1;
 }
 
-char *build_json_response(layout *lt, CustomWeights *weights) {
-    log_print('v', L"Building JSON response...\n");
+void write_layout_string(char *buf, layout *lt) {
+    mbstate_t state;
+    memset(&state, 0, sizeof(state));
+    size_t len = 0;
+    for (int r = 0; r < 3; r++) {
+        for (int c = 1; c <= 10; c++) {
+            size_t n = wcrtomb(buf + len, convert_back(lt->matrix[r][c]), &state);
+            if (n != (size_t)-1) {len += n;}
+        }
+    }
+    buf[len] = '\0';
+}
 
-    json_object *jobj = json_object_new_object();
-    json_object *j_stat_values = json_object_new_object();
+// Converts an index into the 30-character layout string to its row and column,
+// following the same mapping as parse_layout_from_string.
+static void layout_string_position(int i, int *r, int *c) {
+    *r = i / 10;
+    *c = i % 10 + 1;
+}
 
-    float final_score = 0.0f;
+int key_position(int i) {
+    int r, c;
+    layout_string_position(i, &r, &c);
+    return r * COL + c;
+}
+
+void swap_keys(layout *lt, int a, int b) {
+    int ra, ca, rb, cb;
+    layout_string_position(a, &ra, &ca);
+    layout_string_position(b, &rb, &cb);
+    int temp = lt->matrix[ra][ca];
+    lt->matrix[ra][ca] = lt->matrix[rb][cb];
+    lt->matrix[rb][cb] = temp;
+}
+
+int apply_swaps(layout *lt, json_object *j_swaps) {
+    if (!json_object_is_type(j_swaps, json_type_array)) {
+        return 0;
+    }
+    size_t length = json_object_array_length(j_swaps);
+    if (length % 2 != 0 || length > 2 * MAX_SWAPS) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < length; i += 2) {
+        json_object *j_a = json_object_array_get_idx(j_swaps, i);
+        json_object *j_b = json_object_array_get_idx(j_swaps, i + 1);
+        if (!json_object_is_type(j_a, json_type_int) || !json_object_is_type(j_b, json_type_int)) {
+            return 0;
+        }
+        int a = json_object_get_int(j_a), b = json_object_get_int(j_b);
+        if (a < 0 || a >= 30 || b < 0 || b >= 30) {
+            return 0;
+        }
+        swap_keys(lt, a, b);
+    }
+    return 1;
+}
+
+int diff_layouts(layout *a, layout *b, int *positions) {
+    int count = 0;
+    for (int i = 0; i < ROW; i++) {
+        for (int j = 0; j < COL; j++) {
+            if (a->matrix[i][j] != b->matrix[i][j]) {
+                positions[count++] = i * COL + j;
+            }
+        }
+    }
+    return count;
+}
+
+// Short names accepted in the weights object, and the stat each stands for.
+static const struct {
+    const char *key;
+    const char *name;
+    char type;
+} stat_aliases[] = {
+    {"sfb", "Same Finger Bigram", 'b'},
+    {"sfs", "Same Finger Skipgram", '1'}, // skip-1
+    {"lsb", "Index Stretch Bigram", 'b'},
+    {"alt", "Alternation", 't'},
+    {"rolls", "Roll", 't'},
+};
+
+// Like find_stat_index, but returns -1 instead of exiting when the stat does
+// not exist, and treats skipped stats as missing since they are never built.
+static int lookup_stat(const char *name, char type) {
+    switch (type) {
+        case 'm':
+            for (int i = 0; i < MONO_LENGTH; i++) {
+                if (!stats_mono[i].skip && strcmp(stats_mono[i].name, name) == 0) return i;
+            }
+            break;
+        case 'b':
+            for (int i = 0; i < BI_LENGTH; i++) {
+                if (!stats_bi[i].skip && strcmp(stats_bi[i].name, name) == 0) return i;
+            }
+            break;
+        case 't':
+            for (int i = 0; i < TRI_LENGTH; i++) {
+                if (!stats_tri[i].skip && strcmp(stats_tri[i].name, name) == 0) return i;
+            }
+            break;
+        case 'q':
+            for (int i = 0; i < QUAD_LENGTH; i++) {
+                if (!stats_quad[i].skip && strcmp(stats_quad[i].name, name) == 0) return i;
+            }
+            break;
+        default:
+            for (int i = 0; i < SKIP_LENGTH; i++) {
+                if (!stats_skip[i].skip && strcmp(stats_skip[i].name, name) == 0) return i;
+            }
+            break;
+    }
+    return -1;
+}
 
-    // 1. Same Finger Bigram (sfb)
-    int sfb_idx = find_stat_index("Same Finger Bigram", 'b');
-    float sfb_score = (sfb_idx != -1) ? lt->bi_score[sfb_idx] : 0.0f;
-    json_object_object_add(j_stat_values, "sfb", json_object_new_double(sfb_score));
-    final_score += sfb_score * weights->sfb;
-    log_print('v', L"  - SFB: raw=%.4f, weight=%.2f, contribution=%.4f\n", sfb_score, weights->sfb, sfb_score * weights->sfb);
+// Resolves a weights key to a stat type and index. Returns 0 if not found.
+static int resolve_stat_key(const char *key, char *type, int *index) {
+    for (size_t i = 0; i < sizeof(stat_aliases) / sizeof(stat_aliases[0]); i++) {
+        if (strcmp(stat_aliases[i].key, key) == 0) {
+            *type = stat_aliases[i].type;
+            *index = lookup_stat(stat_aliases[i].name, *type);
+            return *index != -1;
+        }
+    }
 
+    const char types[] = {'m', 'b', 't', 'q'};
+    for (size_t i = 0; i < sizeof(types); i++) {
+        if ((*index = lookup_stat(key, types[i])) != -1) {
+            *type = types[i];
+            return 1;
+        }
+    }
 
-    // 2. Same Finger Skipgram (sfs) - Assuming skip-1
-    int sfs_idx = find_stat_index("Same Finger Skipgram", '1');
-    float sfs_score = (sfs_idx != -1) ? lt->skip_score[1][sfs_idx] : 0.0f;
-    json_object_object_add(j_stat_values, "sfs", json_object_new_double(sfs_score));
-    final_score += sfs_score * weights->sfs;
-    log_print('v', L"  - SFS: raw=%.4f, weight=%.2f, contribution=%.4f\n", sfs_score, weights->sfs, sfs_score * weights->sfs);
+    // Skipgram stats are named with their distance appended, e.g. "... 3"
+    size_t len = strlen(key);
+    if (len > 2 && len <= 62 && key[len - 2] == ' ' && key[len - 1] >= '1' && key[len - 1] <= '9') {
+        char name[61];
+        memcpy(name, key, len - 2);
+        name[len - 2] = '\0';
+        *type = key[len - 1];
+        *index = lookup_stat(name, *type);
+        return *index != -1;
+    }
+    return 0;
+}
 
+int parse_weights(json_object *j_weights, CustomWeights *weights) {
+    weights->length = 0;
+    if (!json_object_is_type(j_weights, json_type_object)) {
+        return 0;
+    }
 
-    // 3. Layout Stretch Bigram (lsb)
-    int idx_stretch_idx = find_stat_index("Index Stretch Bigram", 'b');
-    float lsb_score = 0.0f;
-    if (idx_stretch_idx != -1) {
-        lsb_score = lt->bi_score[idx_stretch_idx];
+    json_object_object_foreach(j_weights, key, value) {
+        if (weights->length >= MAX_WEIGHTS || strlen(key) > 60) {
+            return 0;
+        }
+        int i = weights->length;
+        if (!resolve_stat_key(key, &weights->types[i], &weights->indices[i])) {
+            log_print('v', L"Unknown or skipped stat in weights: %s\n", key);
+            return 0;
+        }
+        /* only finite numbers, a NaN or infinite weight poisons every score and comparison */
+        if ((!json_object_is_type(value, json_type_int) && !json_object_is_type(value, json_type_double)) ||
+            !isfinite(json_object_get_double(value))) {
+            log_print('v', L"Weight is not a finite number: %s\n", key);
+            return 0;
+        }
+        strcpy(weights->keys[i], key);
+        weights->values[i] = json_object_get_double(value);
+        weights->length++;
     }
-    json_object_object_add(j_stat_values, "lsb", json_object_new_double(lsb_score));
-    final_score += lsb_score * weights->lsb;
-    log_print('v', L"  - LSB (Index Only): raw=%.4f, weight=%.2f, contribution=%.4f\n", lsb_score, weights->lsb, lsb_score * weights->lsb);
+    return 1;
+}
 
-    // 4. Alternation (alt)
-    int alt_idx = find_stat_index("Alternation", 't');
-    float alt_score = (alt_idx != -1) ? lt->tri_score[alt_idx] : 0.0f;
-    json_object_object_add(j_stat_values, "alt", json_object_new_double(alt_score));
-    final_score += alt_score * weights->alt;
-    log_print('v', L"  - ALT: raw=%.4f, weight=%.2f, contribution=%.4f\n", alt_score, weights->alt, alt_score * weights->alt);
+void build_eval_plan(eval_plan *plan, CustomWeights *weights) {
+    for (int i = 0; i < weights->length; i++) {
+        plan_stat(plan, weights->types[i], weights->indices[i]);
+    }
+}
 
+float stat_value(layout *lt, char type, int index) {
+    return lt->scores[stat_id(type, index)];
+}
 
-    // 5. Rolls
-    int roll_idx = find_stat_index("Roll", 't');
-    float roll_score = (roll_idx != -1) ? lt->tri_score[roll_idx] : 0.0f;
-    json_object_object_add(j_stat_values, "rolls", json_object_new_double(roll_score));
-    final_score += roll_score * weights->rolls;
-    log_print('v', L"  - ROLLS: raw=%.4f, weight=%.2f, contribution=%.4f\n", roll_score, weights->rolls, roll_score * weights->rolls);
+void set_stat_value(layout *lt, char type, int index, float value) {
+    lt->scores[stat_id(type, index)] = value;
+}
 
+float weighted_score(layout *lt, CustomWeights *weights) {
+    float score = 0.0f;
+    for (int i = 0; i < weights->length; i++) {
+        score += stat_value(lt, weights->types[i], weights->indices[i]) * weights->values[i];
+    }
+    return score;
+}
 
-    log_print('v', L"  - FINAL SCORE: %.4f\n", final_score);
+int write_json_response(char *buf, size_t size, layout *lt, CustomWeights *weights) {
+    log_print('v', L"Building JSON response...\n");
 
-    // Add final scores and values to the main JSON object
-    json_object_object_add(jobj, "stat_values", j_stat_values);
-    json_object_object_add(jobj, "score", json_object_new_double(final_score));
+    float final_score = 0.0f;
+    size_t len = 0;
+    int n;
 
-    const char *response_str = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PRETTY);
-    char *response_copy = strdup(response_str);
+    // snprintf-style: keep counting once the buffer is full so the caller
+    // learns the size it needs. Keys passed parse_weights, which only accepts
+    // stat names, so they never need escaping.
+    #define APPEND(...) do { \
+        n = snprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, __VA_ARGS__); \
+        len += n; \
+    } while (0)
 
-    json_object_put(jobj);
+    APPEND("{\"stat_values\":{");
+    // Only the stats named in the weights were analyzed, report exactly those
+    for (int i = 0; i < weights->length; i++) {
+        float raw = stat_value(lt, weights->types[i], weights->indices[i]);
+        APPEND("%s\"%s\":%.9g", i ? "," : "", weights->keys[i], raw);
+        final_score += raw * weights->values[i];
+        log_print('v', L"  - %s: raw=%.4f, weight=%.2f, contribution=%.4f\n",
+                  weights->keys[i], raw, weights->values[i], raw * weights->values[i]);
+    }
+    APPEND("},\"score\":%.9g}", final_score);
+    #undef APPEND
 
+    log_print('v', L"  - FINAL SCORE: %.4f\n", final_score);
     log_print('v', L"JSON response built successfully.\n");
-    return response_copy;
+    return (int)len;
 }
@@ -0,0 +1,228 @@
+/*
+ * check.c - Engine self-check.
+ *
+ * Every stat can be scored by several engines: member by member, over all
+ * position pairs or the sparse corpus, several layouts at once, as an update
+ * of a base layout, or as one weighted sum. They must all agree; make check
+ * builds a binary that runs check_engines() instead of the server.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "analyze.h"
+#include "tensor.h"
+#include "api_util.h"
+#include "util.h"
+#include "io.h"
+
+/* Largest difference allowed between engines that add in different orders, relative to the value. */
+#define CHECK_TOLERANCE 1e-4f
+
+/* Every stat type, and every type a plan holds. */
+#define ALL_TYPES "mbtq123456789e"
+#define PLAN_TYPES "mbtq123456789"
+
+/* Returns the number of stats of a type. */
+static int type_length(char type)
+{
+    switch (type) {
+        case 'm': return MONO_LENGTH;
+        case 'b': return BI_LENGTH;
+        case 't': return TRI_LENGTH;
+        case 'q': return QUAD_LENGTH;
+        case 'e': return META_LENGTH;
+        default:  return SKIP_LENGTH;
+    }
+}
+
+/* Returns whether a stat is enabled. */
+static int stat_enabled(char type, int index)
+{
+    switch (type) {
+        case 'm': return !stats_mono[index].skip;
+        case 'b': return !stats_bi[index].skip;
+        case 't': return !stats_tri[index].skip;
+        case 'q': return !stats_quad[index].skip;
+        case 'e': return !stats_meta[index].skip;
+        default:  return !stats_skip[index].skip;
+    }
+}
+
+/*
+ * Fills a layout with distinct random characters of the language, leaving
+ * keys empty once they run out. Character 0 is the space and never placed.
+ */
+static void random_layout(layout *lt, uint64_t *state)
+{
+    int chars[LANG_LENGTH];
+    for (int i = 1; i < LANG_LENGTH; i++) {chars[i] = i;}
+    for (int i = LANG_LENGTH - 1; i > 1; i--)
+    {
+        int j = 1 + random_int(state, i);
+        int swap = chars[i];
+        chars[i] = chars[j];
+        chars[j] = swap;
+    }
+    for (int p = 0; p < DIM1; p++) {
+        lt->matrix[p / COL][p % COL] = p + 1 < LANG_LENGTH ? chars[p + 1] : -1;
+    }
+}
+
+/* Returns whether two values differ, exactly or beyond the tolerance. */
+static int differs(float expected, float got, int exact)
+{
+    if (exact) {return expected != got;}
+    return fabsf(expected - got) > CHECK_TOLERANCE * (1 + fabsf(expected));
+}
+
+/*
+ * Compares the enabled stats of some types between two layouts.
+ *
+ * Parameters:
+ *   engine: The name of the engine that scored got, for the log.
+ *   expected: The layout scored member by member.
+ *   got: The same layout scored by the engine.
+ *   types: The stat types to compare.
+ *   exact: 1 if the values must be equal, 0 for the tolerance.
+ *
+ * Returns: The number of stats that differ.
+ */
+static int compare_scores(const char *engine, layout *expected, layout *got,
+    const char *types, int exact)
+{
+    int failures = 0;
+    for (const char *type = types; *type; type++)
+    {
+        for (int i = 0; i < type_length(*type); i++)
+        {
+            if (!stat_enabled(*type, i)) {continue;}
+            float want = expected->scores[stat_id(*type, i)];
+            float have = got->scores[stat_id(*type, i)];
+            if (differs(want, have, exact))
+            {
+                log_print('q',L"%s engine: stat %c %d is %f, expected %f\n", engine, *type, i, have, want);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+/*
+ * Scores random layouts with every analysis engine and compares each with the
+ * member by member sums of single_analyze(lt, NULL): multi_analyze() must match
+ * exactly, while the position pair, sparse corpus, delta and tensor engines add
+ * in another order and must match within a small tolerance. Every mismatch is
+ * logged. The corpus, stats, skip rows and sparse ngrams must all be loaded.
+ *
+ * Parameters:
+ *   layouts: The number of random layouts to score.
+ *
+ * Returns: The number of mismatches, 0 if every engine agrees.
+ */
+int check_engines(int layouts)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    layout *expected, *got, *lanes[MULTI_LANES], *singles[MULTI_LANES];
+    alloc_layout(&expected);
+    alloc_layout(&got);
+    for (int l = 0; l < MULTI_LANES; l++)
+    {
+        alloc_layout(&lanes[l]);
+        alloc_layout(&singles[l]);
+    }
+
+    /* every enabled stat but the meta stats, and random weights on some of them */
+    eval_plan *plan;
+    alloc_plan(&plan);
+    CustomWeights *weights = calloc(1, sizeof(CustomWeights));
+    if (!weights) {error("Failed to allocate memory for check weights.");}
+    for (const char *type = PLAN_TYPES; *type; type++)
+    {
+        for (int i = 0; i < type_length(*type); i++)
+        {
+            if (!stat_enabled(*type, i)) {continue;}
+            plan_stat(plan, *type, i);
+            if (weights->length < MAX_WEIGHTS && random_int(&state, 4) == 0)
+            {
+                weights->types[weights->length] = *type;
+                weights->indices[weights->length] = i;
+                weights->values[weights->length++] = random_float(&state) * 2 - 1;
+            }
+        }
+    }
+    weight_tensors *tensors = compile_weights(weights); /* tensor.c */
+
+    int failures = 0;
+    for (int n = 0; n < layouts; n++)
+    {
+        random_layout(expected, &state);
+        force_engine('m');
+        single_analyze(expected, NULL);
+
+        /* all position pairs and the sparse corpus */
+        memcpy(got->matrix, expected->matrix, sizeof(got->matrix));
+        force_engine('c');
+        single_analyze(got, NULL);
+        failures += compare_scores("pair/sparse", expected, got, ALL_TYPES, 0);
+
+        /* two keys swapped, updated from the base and scored afresh */
+        int positions[2] = {random_int(&state, DIM1), random_int(&state, DIM1 - 1)};
+        positions[1] += positions[1] >= positions[0];
+        memcpy(got->matrix, expected->matrix, sizeof(got->matrix));
+        int *a = &got->matrix[positions[0] / COL][positions[0] % COL];
+        int *b = &got->matrix[positions[1] / COL][positions[1] % COL];
+        int swap = *a;
+        *a = *b;
+        *b = swap;
+        force_engine('m');
+        delta_analyze(got, expected, positions, 2, NULL);
+        memcpy(singles[0]->matrix, got->matrix, sizeof(got->matrix));
+        single_analyze(singles[0], NULL);
+        failures += compare_scores("delta", singles[0], got, ALL_TYPES, 0);
+
+        /* the weighted sum in one pass, against the weighted analyzed stats */
+        float want = weighted_score(expected, weights), have = tensor_score(tensors, expected);
+        float scale = 0;
+        for (int i = 0; i < weights->length; i++) {
+            scale += fabsf(stat_value(expected, weights->types[i], weights->indices[i]) * weights->values[i]);
+        }
+        if (fabsf(want - have) > CHECK_TOLERANCE * (1 + scale))
+        {
+            log_print('q',L"tensor engine: weighted score is %f, expected %f\n", have, want);
+            failures++;
+        }
+    }
+
+    /* layouts side by side, against the same plan one at a time */
+    force_engine('m');
+    for (int n = 0; n < layouts; n += MULTI_LANES)
+    {
+        for (int l = 0; l < MULTI_LANES; l++)
+        {
+            random_layout(lanes[l], &state);
+            memcpy(singles[l]->matrix, lanes[l]->matrix, sizeof(lanes[l]->matrix));
+            single_analyze(singles[l], plan);
+        }
+        multi_analyze(lanes, MULTI_LANES, plan);
+        for (int l = 0; l < MULTI_LANES; l++) {
+            failures += compare_scores("multi-lane", singles[l], lanes[l], PLAN_TYPES, 1);
+        }
+    }
+    force_engine('a');
+
+    free_weight_tensors(tensors);
+    free(weights);
+    free_plan(plan);
+    free_layout(expected);
+    free_layout(got);
+    for (int l = 0; l < MULTI_LANES; l++)
+    {
+        free_layout(lanes[l]);
+        free_layout(singles[l]);
+    }
+    return failures;
+}
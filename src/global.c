@@ -39,18 +39,28 @@ char *corpus_name = NULL;
 /* Control flags for program execution. */
 char output_mode = 'v';
 
+/* Number of analyzed layouts the result cache keeps, set with -r. */
+long result_cache_size = 65536;
+
 /* The selected language's character set. */
 wchar_t *lang_arr;
 
 /* Hash table for character code lookup. */
 int *char_table;
 
-/* Arrays to store raw frequency counts from the corpus. */
-int *corpus_mono;
-int **corpus_bi;
-int ***corpus_tri;
-int ****corpus_quad;
-int ***corpus_skip;
+/* Arrays to store raw frequency counts from the corpus, laid out like linear_*. */
+long long *corpus_mono;
+long long *corpus_bi;
+long long *corpus_tri;
+long long *corpus_quad;
+long long *corpus_skip;
+
+/* Totals of the raw counts, skipgrams by skip distance, the percentages' denominators. */
+long long total_mono;
+long long total_bi;
+long long total_tri;
+long long total_quad;
+long long total_skip[10];
 
 /* Arrays to store normalized frequency data (percentages). */
 float *linear_mono;
@@ -59,6 +69,9 @@ float *linear_tri;
 float *linear_quad;
 float *linear_skip;
 
+/* linear_skip interleaved by distance, one padded row per pair of characters. */
+float *skip_rows;
+
 /* total umber of statistics for each ngram type. */
 int MONO_LENGTH = 0;
 int BI_LENGTH = 0;
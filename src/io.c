@@ -12,10 +12,19 @@
 #include <wchar.h>
 #include <getopt.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "io.h"
 #include "io_util.h"
+#include "pool.h"
 #include "util.h"
+#include "stats.h"
+#include "stats_util.h"
 #include "global.h"
 #include "structs.h"
 
@@ -145,13 +154,13 @@ void read_config()
  * It parses arguments passed to the main function and updates
  * corresponding global variables such as language name, corpus name,
  * layout names, weight file, repetitions, threads, run mode, output mode,
- * and backend mode.
+ * backend mode, and result cache size.
  */
 void read_args(int argc, char **argv)
 {
     int opt;
     /* Parse command line arguments. */
-    while ((opt = getopt(argc, argv, "l:c:o:")) != -1) {
+    while ((opt = getopt(argc, argv, "l:c:o:r:")) != -1) {
     switch (opt) {
         case 'l':
             free(lang_name);
@@ -165,9 +174,12 @@ void read_args(int argc, char **argv)
             /* validate and convert output mode */
             output_mode = check_output_mode(optarg); /* io_util.c */
             break;
+        case 'r':
+            result_cache_size = atol(optarg);
+            break;
         case '?':
             error("Improper Usage: %s -l lang_name -c corpus_name "\
-                "-o output_mode");
+                "-o output_mode -r result_cache_size");
         default:
             abort();
         }
@@ -187,6 +199,7 @@ void check_setup()
     {
         error("invalid output mode selected");
     }
+    if (result_cache_size < 1) {error("result cache size must be positive");}
 }
 
 /*
@@ -256,220 +269,860 @@ void read_lang()
     }
 }
 
+/* Magic bytes at the start of the corpus cache, followed by the header. */
+#define CORPUS_CACHE_MAGIC "SVCORPUS"
+/* Increase whenever the layout of the corpus cache changes. */
+#define CORPUS_CACHE_VERSION 1
+
+/* Ngram types in the corpus cache: mono, bi, tri, quad, then skip 1-9. */
+#define CORPUS_CACHE_TYPES 5
+
+/* Fixed header of the corpus cache file. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    int32_t lang_length;
+    /* hash of the language character set the counts were taken with */
+    uint64_t lang_hash;
+    /* size and modification time of the corpus text file */
+    uint64_t corpus_size;
+    int64_t corpus_mtime;
+    /* total mono, bi, tri, and quad counts, then skip-0 to skip-9 */
+    int64_t totals[14];
+    /* offsets of the normalized linear_* arrays, in type order */
+    uint64_t linear_offset[CORPUS_CACHE_TYPES];
+    /*
+     * Sparse raw counts of each type: count_length counts (uint64_t) starting
+     * at count_offset, followed by as many linear_* indices (uint32_t).
+     */
+    uint64_t count_offset[CORPUS_CACHE_TYPES];
+    uint64_t count_length[CORPUS_CACHE_TYPES];
+    uint64_t size;
+} corpus_cache_header;
+
+/* The mapped corpus cache, if the corpus was read from one. */
+static void *corpus_cache_map = NULL;
+static size_t corpus_cache_size = 0;
+
+/* Builds the path to a file next to the corpus, with the given extension. */
+static char *corpus_file_path(const char *extension)
+{
+    char *path = (char*)malloc(strlen("./data//corpora/") + strlen(lang_name)
+        + strlen(corpus_name) + strlen(extension) + 1);
+    strcpy(path, "./data/");
+    strcat(path, lang_name);
+    strcat(path, "/corpora/");
+    strcat(path, corpus_name);
+    strcat(path, extension);
+    return path;
+}
+
+/* Folds a value into an FNV-1a hash. */
+static uint64_t fnv_hash(uint64_t hash, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) {
+        hash ^= (value >> (i * 8)) & 0xFF;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Hashes the current language character set. */
+static uint64_t corpus_cache_lang_hash()
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i <= LANG_FILE_LENGTH; i++) {
+        hash = fnv_hash(hash, lang_arr[i]);
+    }
+    return hash;
+}
+
+/* Returns the number of entries of a type's linear_* array. */
+static size_t corpus_cache_dim(int type)
+{
+    size_t lang = LANG_LENGTH;
+    switch (type) {
+        case 0: return lang;
+        case 1: return lang * lang;
+        case 2: return lang * lang * lang;
+        case 3: return lang * lang * lang * lang;
+        default: return 10 * lang * lang;
+    }
+}
+
+/* Returns the normalized array of a type. */
+static float **corpus_cache_linear(int type)
+{
+    switch (type) {
+        case 0: return &linear_mono;
+        case 1: return &linear_bi;
+        case 2: return &linear_tri;
+        case 3: return &linear_quad;
+        default: return &linear_skip;
+    }
+}
+
+/* Returns the raw counts of a type, laid out like its linear_* array. */
+static long long *corpus_cache_counts(int type)
+{
+    switch (type) {
+        case 0: return corpus_mono;
+        case 1: return corpus_bi;
+        case 2: return corpus_tri;
+        case 3: return corpus_quad;
+        default: return corpus_skip;
+    }
+}
+
+/* Rounds a file offset up so every section is cache line aligned. */
+static uint64_t corpus_cache_align(uint64_t offset)
+{
+    return (offset + 63) & ~(uint64_t)63;
+}
+
 /*
- * Attempts to read corpus data from a cache file. If the cache file exists,
- * it reads the pre-computed ngram frequencies into the global corpus arrays.
+ * Attempts to read corpus data from the binary cache file. The cache holds the
+ * normalized frequencies, which are memory-mapped and used as the linear_*
+ * arrays directly, the sparse raw counts, which fill the corpus arrays, and
+ * their totals.
+ * A cache taken with another language, from a corpus that changed since, or
+ * in an older format (including the old text cache) is treated as absent.
  *
  * Returns:
  *   1 if the cache file was successfully read, 0 otherwise.
  */
 int read_corpus_cache()
 {
-    FILE *corpus;
-    /* Construct the path to the corpus cache file. */
-    char *path = (char*)malloc(strlen("./data//corpora/.cache") +
-        strlen(lang_name) + strlen(corpus_name) + 1);
-    strcpy(path, "./data/");
-    strcat(path, lang_name);
-    strcat(path, "/corpora/");
-    strcat(path, corpus_name);
-    strcat(path, ".cache");
-    corpus = fopen(path, "r");
-    if (corpus == NULL) {
-        free(path);
+    char *path = corpus_file_path(".cache");
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) {
         log_print('v',L"Cache not found... ");
         return 0;
     }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(corpus_cache_header)) {
+        close(fd);
+        log_print('v',L"Cache out of date... ");
+        return 0;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_print('v',L"Cache could not be mapped... ");
+        return 0;
+    }
+
+    /* Check the header before trusting any offsets in the file. */
+    const corpus_cache_header *header = map;
+    int valid = memcmp(header->magic, CORPUS_CACHE_MAGIC, 8) == 0
+        && header->version == CORPUS_CACHE_VERSION
+        && header->lang_length == LANG_LENGTH
+        && header->lang_hash == corpus_cache_lang_hash()
+        && header->size == size;
+
+    /* The cache may be shipped without its corpus, otherwise it must match. */
+    path = corpus_file_path(".txt");
+    struct stat corpus_st;
+    if (valid && stat(path, &corpus_st) == 0) {
+        valid = header->corpus_size == (uint64_t)corpus_st.st_size
+            && header->corpus_mtime == (int64_t)corpus_st.st_mtime;
+    }
+    free(path);
+
+    for (int type = 0; valid && type < CORPUS_CACHE_TYPES; type++) {
+        size_t dim = corpus_cache_dim(type);
+        uint64_t count_bytes = header->count_length[type] * (sizeof(uint64_t) + sizeof(uint32_t));
+        if (header->linear_offset[type] % sizeof(float) != 0
+            || header->linear_offset[type] > size
+            || dim * sizeof(float) > size - header->linear_offset[type]
+            || header->count_offset[type] % sizeof(uint64_t) != 0
+            || header->count_offset[type] > size
+            || header->count_length[type] > dim
+            || count_bytes > size - header->count_offset[type]) {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        munmap(map, size);
+        log_print('v',L"Cache out of date... ");
+        return 0;
+    }
+
     log_print('v',L"Cache found... ");
     log_print('v',L"Reading cache... ");
-    wchar_t curr;
-    int i,j,k,l, value;
-    /* Read cached frequencies for ngrams */
-    while ((curr = fgetwc(corpus)) != WEOF) {
-        switch(curr)
-        {
-            case 'q':
-                fwscanf(corpus, L" %d %d %d %d %d ", &i, &j, &k, &l, &value);
-                corpus_quad[i][j][k][l] = value;
-                break;
-            case 't':
-                fwscanf(corpus, L" %d %d %d %d ", &i, &j, &k, &value);
-                corpus_tri[i][j][k] = value;
-                break;
-            case 'b':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_bi[i][j] = value;
-                break;
-            case 'm':
-                fwscanf(corpus, L" %d %d ", &i, &value);
-                corpus_mono[i] = value;
-                break;
-            case '1':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[1][i][j] = value;
-                break;
-            case '2':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[2][i][j] = value;
-                break;
-            case '3':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[3][i][j] = value;
-                break;
-            case '4':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[4][i][j] = value;
-                break;
-            case '5':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[5][i][j] = value;
-                break;
-            case '6':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[6][i][j] = value;
-                break;
-            case '7':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[7][i][j] = value;
-                break;
-            case '8':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[8][i][j] = value;
-                break;
-            case '9':
-                fwscanf(corpus, L" %d %d %d ", &i, &j, &value);
-                corpus_skip[9][i][j] = value;
-                break;
-            default:
-                break;
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        /* the normalized frequencies are used in place */
+        float **linear = corpus_cache_linear(type);
+        free(*linear);
+        *linear = (float *)((char *)map + header->linear_offset[type]);
+
+        size_t dim = corpus_cache_dim(type);
+        long long *corpus = corpus_cache_counts(type);
+        const uint64_t *counts = (const uint64_t *)((char *)map + header->count_offset[type]);
+        const uint32_t *indices = (const uint32_t *)(counts + header->count_length[type]);
+        for (uint64_t i = 0; i < header->count_length[type]; i++) {
+            if (indices[i] < dim) {corpus[indices[i]] = counts[i];}
         }
     }
-    fclose(corpus);
-    free(path);
+
+    /* the totals were summed when the cache was written */
+    total_mono = header->totals[0];
+    total_bi = header->totals[1];
+    total_tri = header->totals[2];
+    total_quad = header->totals[3];
+    for (int k = 0; k < 10; k++) {total_skip[k] = header->totals[4 + k];}
+
+    corpus_cache_map = map;
+    corpus_cache_size = size;
     return 1;
 }
 
+/* Corpus chunks are at least this many bytes, so small corpora use one. */
+#define CORPUS_CHUNK_MIN (1 << 20)
+/* Corpus chunks are at most this many bytes, fewer characters than INT_MAX. */
+#define CORPUS_CHUNK_MAX (1UL << 30)
+/* Characters before a chunk that feed its window, enough for skip-9. */
+#define CORPUS_OVERLAP 10
+/* Histogram entries summed per merge step. */
+#define CORPUS_MERGE_SLICE (1 << 16)
+
+/* Shared state while counting a memory-mapped corpus. */
+typedef struct {
+    const unsigned char *text;
+    size_t size;
+    size_t chunks;
+    /* chunks are counted in rounds of at most one per worker */
+    size_t first;
+    size_t round;
+    /* one flat histogram per chunk of the round, laid out like linear_* */
+    int **counts;
+    size_t offset[CORPUS_CACHE_TYPES + 1];
+} corpus_reader;
+
 /*
- * Reads and processes a corpus text file to collect ngram frequency data. Reads
- * the corpus character by character, updating the frequency counts in the
- * global corpus arrays for monograms, bigrams, trigrams, quadgrams,
- * and skipgrams.
+ * Decodes one UTF-8 character. Malformed bytes decode to -1 one at a time, so
+ * decoding resynchronizes on the next valid character.
+ *
+ * Returns:
+ *   The number of bytes consumed, at least 1.
  */
-void read_corpus()
+static size_t decode_utf8(const unsigned char *s, size_t n, int *cp)
 {
-    FILE *corpus;
-    /* Construct the path to the corpus text file. */
-    char *path = (char*)malloc(strlen("./data//corpora/.txt") +
-        strlen(lang_name) + strlen(corpus_name) + 1);
-    strcpy(path, "./data/");
-    strcat(path, lang_name);
-    strcat(path, "/corpora/");
-    strcat(path, corpus_name);
-    strcat(path, ".txt");
-    corpus = fopen(path, "r");
-    if (corpus == NULL) {
-        error("Corpus file not found, make sure the file ends in .txt, but the name in config/parameters does not");
+    unsigned char c = s[0];
+    size_t length;
+    int value;
+    if (c < 0x80) {*cp = c; return 1;}
+    else if ((c & 0xE0) == 0xC0) {length = 2; value = c & 0x1F;}
+    else if ((c & 0xF0) == 0xE0) {length = 3; value = c & 0x0F;}
+    else if ((c & 0xF8) == 0xF0) {length = 4; value = c & 0x07;}
+    else {*cp = -1; return 1;}
+
+    if (length > n) {*cp = -1; return 1;}
+    for (size_t i = 1; i < length; i++) {
+        if ((s[i] & 0xC0) != 0x80) {*cp = -1; return 1;}
+        value = (value << 6) | (s[i] & 0x3F);
     }
-    log_print('v',L"Corpus file found... ");
+    *cp = value;
+    return length;
+}
+
+/* Moves a byte offset forward to the start of a UTF-8 character. */
+static size_t utf8_boundary(const unsigned char *text, size_t size, size_t i)
+{
+    while (i < size && (text[i] & 0xC0) == 0x80) {i++;}
+    return i;
+}
 
-    /* Memory for the last 11 seen characters */
-    int mem[] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-
-    wchar_t curr;
-    while ((curr = fgetwc(corpus)) != WEOF) {
-        /* convert characters based on the lang file */
-        mem[0] = convert_char(curr); /* io_util.c */
-        /* If character is valid in the language */
-        if (mem[0] > 0 && mem[0] < 51) {
-            corpus_mono[mem[0]]++;
-
-            /* If there is a previous character, record the bigram */
-            if (mem[1] > 0 && mem[1] < 51) {
-                corpus_bi[mem[1]][mem[0]]++;
-                /* If there are two, record the trigram */
-                if (mem[2] > 0 && mem[2] < 51) {
-                    corpus_tri[mem[2]][mem[1]][mem[0]]++;
-                    /* If there are three, record the quadgram */
-                    if (mem[3] > 0 && mem[3] < 51) {
-                        corpus_quad[mem[3]][mem[2]][mem[1]][mem[0]]++;
+/*
+ * Counts the ngrams ending in one chunk of the corpus into the chunk's own
+ * histogram. The characters just before the chunk only fill the window, so
+ * every ngram is counted by exactly one chunk.
+ */
+static void count_corpus_chunk(void *arg, size_t index)
+{
+    corpus_reader *reader = arg;
+    size_t chunk = reader->first + index;
+    const unsigned char *text = reader->text;
+    size_t start = utf8_boundary(text, reader->size, reader->size / reader->chunks * chunk);
+    size_t end = chunk + 1 == reader->chunks ? reader->size
+        : utf8_boundary(text, reader->size, reader->size / reader->chunks * (chunk + 1));
+
+    int *counts = calloc(reader->offset[CORPUS_CACHE_TYPES], sizeof(int));
+    if (!counts) {
+        error("Failed to allocate memory for corpus histogram.");
+    }
+    int *mono = counts + reader->offset[0];
+    int *bi = counts + reader->offset[1];
+    int *tri = counts + reader->offset[2];
+    int *quad = counts + reader->offset[3];
+    int *skip = counts + reader->offset[4];
+    int lang = LANG_LENGTH;
+
+    /* Step back over the overlap to prime the window. */
+    size_t i = start;
+    for (int seen = 0; i > 0 && seen < CORPUS_OVERLAP; ) {
+        i--;
+        if ((text[i] & 0xC0) != 0x80) {seen++;}
+    }
+
+    /* The last 16 characters, the newest at mem[n & 15]. */
+    int mem[16];
+    for (int j = 0; j < 16; j++) {mem[j] = -1;}
+    unsigned int n = 0;
+    while (i < end) {
+        int cp;
+        size_t length = decode_utf8(text + i, end - i, &cp);
+        int c = cp > 0 && cp <= UNICODE_MAX ? convert_char(cp) : -1; /* io_util.c */
+        /* drop anything outside of the language */
+        if (c <= 0 || c >= lang) {c = -1;}
+        n++;
+        mem[n & 15] = c;
+
+        /* only count the ngrams that end inside this chunk */
+        if (i >= start && c != -1) {
+            int c1 = mem[(n - 1) & 15];
+            mono[c]++;
+            if (c1 != -1) {
+                bi[c1 * lang + c]++;
+                int c2 = mem[(n - 2) & 15];
+                if (c2 != -1) {
+                    tri[(c2 * lang + c1) * lang + c]++;
+                    int c3 = mem[(n - 3) & 15];
+                    if (c3 != -1) {
+                        quad[((c3 * lang + c2) * lang + c1) * lang + c]++;
                     }
                 }
             }
-
-            /* Record skipgrams from skip-1 to skip-9 */
-            for (int i = 2; i < 11; i++)
-            {
-                if (mem[i] > 0 && mem[i] < 51)
-                {
-                    corpus_skip[i-1][mem[i]][mem[0]]++;
+            for (int k = 1; k <= 9; k++) {
+                int before = mem[(n - k - 1) & 15];
+                if (before != -1) {
+                    skip[(k * lang + before) * lang + c]++;
                 }
             }
         }
-        /* shift over an array one index, dropping the last value */
-        iterate(mem, 11); /* io_util.c */
+        i += length;
+    }
+
+    reader->counts[index] = counts;
+}
+
+/* Adds one slice of every chunk's histogram to the global corpus arrays. */
+static void merge_corpus_slice(void *arg, size_t slice)
+{
+    corpus_reader *reader = arg;
+    size_t lo = slice * CORPUS_MERGE_SLICE;
+    size_t hi = lo + CORPUS_MERGE_SLICE;
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        size_t from = lo > reader->offset[type] ? lo : reader->offset[type];
+        size_t to = hi < reader->offset[type + 1] ? hi : reader->offset[type + 1];
+        long long *corpus = corpus_cache_counts(type);
+        for (size_t f = from; f < to; f++) {
+            long long sum = 0;
+            for (size_t c = 0; c < reader->round; c++) {
+                sum += reader->counts[c][f];
+            }
+            corpus[f - reader->offset[type]] += sum;
+        }
     }
+}
 
-    fclose(corpus);
+/*
+ * Reads and processes a corpus text file to collect ngram frequency data. The
+ * file is memory-mapped and split into chunks at UTF-8 character boundaries,
+ * which the worker pool decodes and counts into separate histograms. These are
+ * then merged into the global corpus arrays for monograms, bigrams, trigrams,
+ * quadgrams, and skipgrams.
+ */
+void read_corpus()
+{
+    char *path = corpus_file_path(".txt");
+    int fd = open(path, O_RDONLY);
     free(path);
+    if (fd == -1) {
+        error("Corpus file not found, make sure the file ends in .txt, but the name in config/parameters does not");
+    }
+    log_print('v',L"Corpus file found... ");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        error("Corpus file could not be read.");
+    }
+    corpus_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.size = st.st_size;
+    if (reader.size == 0) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, reader.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        error("Corpus file could not be mapped.");
+    }
+    madvise(map, reader.size, MADV_SEQUENTIAL);
+    reader.text = map;
+
+    /* one chunk per worker, unless the corpus is too small to be worth it */
+    create_thread_pool(); /* pool.c */
+    reader.chunks = reader.size / CORPUS_CHUNK_MIN;
+    if (reader.chunks > (size_t)pool_size()) {reader.chunks = pool_size();}
+    /* keep chunks small enough that their int histograms cannot overflow */
+    if (reader.chunks < reader.size / CORPUS_CHUNK_MAX + 1) {
+        reader.chunks = reader.size / CORPUS_CHUNK_MAX + 1;
+    }
+
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        reader.offset[type + 1] = reader.offset[type] + corpus_cache_dim(type);
+    }
+    size_t per_round = reader.chunks < (size_t)pool_size() ? reader.chunks : (size_t)pool_size();
+    reader.counts = calloc(per_round, sizeof(int *));
+    if (!reader.counts) {
+        error("Failed to allocate memory for corpus histograms.");
+    }
+
+    /* merging after every round bounds the memory to one histogram per worker */
+    log_print('v',L"Counting %d chunks... ", (int)reader.chunks);
+    size_t total = reader.offset[CORPUS_CACHE_TYPES];
+    for (reader.first = 0; reader.first < reader.chunks; reader.first += per_round) {
+        reader.round = reader.chunks - reader.first < per_round ? reader.chunks - reader.first : per_round;
+        run_job(count_corpus_chunk, &reader, reader.round); /* pool.c */
+        run_job(merge_corpus_slice, &reader, (total + CORPUS_MERGE_SLICE - 1) / CORPUS_MERGE_SLICE);
+        for (size_t c = 0; c < reader.round; c++) {
+            free(reader.counts[c]);
+        }
+    }
+    free(reader.counts);
+    munmap(map, reader.size);
 }
 
 /*
- * Creates or updates a cache file with the current corpus frequency data.
- * This function writes the current state of the global corpus arrays to a
- * cache file, allowing for quicker initialization in future runs.
+ * Creates or updates the binary cache file with the current corpus data. This
+ * function writes the normalized linear_* arrays and the sparse raw counts of
+ * the global corpus arrays, so it must run after normalize_corpus(). The file
+ * is written under a temporary name and renamed into place.
  */
 void cache_corpus()
 {
-    FILE *corpus;
-    /* Construct the path to the corpus cache file. */
-    char *path = (char*)malloc(strlen("./data//corpora/.cache") +
-        strlen(lang_name) + strlen(corpus_name) + 1);
-    strcpy(path, "./data/");
-    strcat(path, lang_name);
-    strcat(path, "/corpora/");
-    strcat(path, corpus_name);
-    strcat(path, ".cache");
-    corpus = fopen(path, "w");
+    char *path = corpus_file_path(".cache");
+    char *tmp_path = (char*)malloc(strlen(path) + 32);
+    sprintf(tmp_path, "%s.%ld", path, (long)getpid());
+    FILE *corpus = fopen(tmp_path, "wb");
     if (corpus == NULL) {
         error("Corpus cache file failed to be created.");
     }
     log_print('n',L"Created cache file... ");
 
-    for (int i = 0; i < 51; i++) {
-        for (int j = 0; j < 51; j++) {
-            for (int k = 0; k < 51; k++) {
-                for (int l = 0; l < 51; l++) {
-                    /* Write all quadgrams to the cache file. */
-                    if (corpus_quad[i][j][k][l] > 0) {
-                        fprintf(corpus, "q %d %d %d %d %d\n", i, j, k, l,
-                            corpus_quad[i][j][k][l]);
-                    }
-                }
-                /* Write all trigrams to the cache file. */
-                if (corpus_tri[i][j][k] > 0) {
-                    fprintf(corpus, "t %d %d %d %d\n", i, j, k,
-                        corpus_tri[i][j][k]);
-                }
+    corpus_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CORPUS_CACHE_MAGIC, 8);
+    header.version = CORPUS_CACHE_VERSION;
+    header.lang_length = LANG_LENGTH;
+    header.lang_hash = corpus_cache_lang_hash();
+    char *text_path = corpus_file_path(".txt");
+    struct stat corpus_st;
+    if (stat(text_path, &corpus_st) == 0) {
+        header.corpus_size = corpus_st.st_size;
+        header.corpus_mtime = corpus_st.st_mtime;
+    }
+    free(text_path);
+
+    /* Lay out the sections and collect the totals. */
+    uint64_t offset = corpus_cache_align(sizeof(header));
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        size_t dim = corpus_cache_dim(type);
+        header.linear_offset[type] = offset;
+        offset = corpus_cache_align(offset + dim * sizeof(float));
+
+        const long long *counts = corpus_cache_counts(type);
+        for (size_t i = 0; i < dim; i++) {
+            if (counts[i] > 0) {
+                header.count_length[type]++;
+                /* skipgrams keep a total per distance */
+                header.totals[type < 4 ? type : 4 + i / (dim / 10)] += counts[i];
             }
-            /* Write all bigrams to the cache file. */
-            if (corpus_bi[i][j] > 0) {
-                fprintf(corpus, "b %d %d %d\n", i, j, corpus_bi[i][j]);
+        }
+        header.count_offset[type] = offset;
+        header.size = offset + header.count_length[type]
+            * (sizeof(uint64_t) + sizeof(uint32_t));
+        offset = corpus_cache_align(header.size);
+    }
+
+    /* seeking past the end leaves the padding between sections zeroed */
+    int ok = fwrite(&header, sizeof(header), 1, corpus) == 1;
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        size_t dim = corpus_cache_dim(type);
+        ok = ok && fseek(corpus, header.linear_offset[type], SEEK_SET) == 0;
+        ok = ok && fwrite(*corpus_cache_linear(type), sizeof(float), dim, corpus) == dim;
+
+        /* Write the non-zero counts, then the indices they belong to. */
+        ok = ok && fseek(corpus, header.count_offset[type], SEEK_SET) == 0;
+        const long long *counts = corpus_cache_counts(type);
+        for (size_t i = 0; i < dim; i++) {
+            if (counts[i] > 0) {
+                uint64_t value = counts[i];
+                ok = ok && fwrite(&value, sizeof(value), 1, corpus) == 1;
+            }
+        }
+        for (size_t i = 0; i < dim; i++) {
+            if (counts[i] > 0) {
+                uint32_t index = i;
+                ok = ok && fwrite(&index, sizeof(index), 1, corpus) == 1;
+            }
+        }
+    }
+
+    if (fclose(corpus) != 0 || !ok || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        error("Corpus cache file failed to be written.");
+    }
+    free(tmp_path);
+    free(path);
+}
+
+/*
+ * Releases the corpus cache mapping, if the corpus was read from one. The
+ * linear_* arrays that point into the mapping are cleared first so they can
+ * then be freed as usual.
+ */
+void free_corpus_cache()
+{
+    if (corpus_cache_map == NULL) {return;}
+    for (int type = 0; type < CORPUS_CACHE_TYPES; type++) {
+        *corpus_cache_linear(type) = NULL;
+    }
+    munmap(corpus_cache_map, corpus_cache_size);
+    corpus_cache_map = NULL;
+    corpus_cache_size = 0;
+}
+
+/* Magic bytes at the start of the stat cache, followed by the header. */
+#define STATS_CACHE_MAGIC "SVSTATS"
+#define STATS_CACHE_PATH "./data/stats.cache"
+
+/* Fixed header of the stat cache file. */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    /* number of mono, bi, tri, quad, and skip stats, in that order */
+    int32_t lengths[5];
+    uint64_t key;
+    uint64_t size;
+} stats_cache_header;
+
+/* One entry per stat, the members live at offset from the start of the file. */
+typedef struct {
+    char name[64];
+    int32_t length;
+    int32_t skip;
+    uint64_t offset;
+} stats_cache_entry;
+
+/* Bytes per member for each stat type in the cache, in header order. */
+static const int stats_cache_width[5] = {1, 2, 3, 4, 2};
+
+/* The mapped stat cache, if the stats were read from one. */
+static void *stats_cache_map = NULL;
+static size_t stats_cache_size = 0;
+
+/* Checksum of the stat definition sources, normally set by the Makefile. */
+#ifndef STATS_FINGERPRINT
+#define STATS_FINGERPRINT 0
+#endif
+
+/*
+ * Computes the key of the stat cache from the grid geometry every stat is
+ * defined over and the fingerprint of the stat definitions themselves,
+ * including which stats are skipped.
+ */
+static uint64_t stats_cache_key()
+{
+    uint64_t hash = 14695981039346656037ULL;
+    hash = fnv_hash(hash, STATS_CACHE_VERSION);
+    hash = fnv_hash(hash, STATS_FINGERPRINT);
+    hash = fnv_hash(hash, ROW);
+    hash = fnv_hash(hash, COL);
+    for (int i = 0; i < ROW; i++) {
+        for (int j = 0; j < COL; j++) {
+            hash = fnv_hash(hash, hand(i, j)); /* stats_util.c */
+            hash = fnv_hash(hash, finger(i, j));
+            hash = fnv_hash(hash, is_stretch(i, j));
+        }
+    }
+    return hash;
+}
+
+/* Returns the number of stats of a type, in header order. */
+static int stats_cache_length(int type)
+{
+    switch (type) {
+        case 0: return MONO_LENGTH;
+        case 1: return BI_LENGTH;
+        case 2: return TRI_LENGTH;
+        case 3: return QUAD_LENGTH;
+        default: return SKIP_LENGTH;
+    }
+}
+
+/* Fills a cache entry for stat i of a type, returning its packed members. */
+static const void *stats_cache_describe(int type, int i, stats_cache_entry *entry)
+{
+    memset(entry, 0, sizeof(stats_cache_entry));
+    switch (type) {
+        case 0:
+            strcpy(entry->name, stats_mono[i].name);
+            entry->length = stats_mono[i].length;
+            entry->skip = stats_mono[i].skip;
+            return stats_mono[i].pos;
+        case 1:
+            strcpy(entry->name, stats_bi[i].name);
+            entry->length = stats_bi[i].length;
+            entry->skip = stats_bi[i].skip;
+            return stats_bi[i].pos;
+        case 2:
+            strcpy(entry->name, stats_tri[i].name);
+            entry->length = stats_tri[i].length;
+            entry->skip = stats_tri[i].skip;
+            return stats_tri[i].pos;
+        case 3:
+            strcpy(entry->name, stats_quad[i].name);
+            entry->length = stats_quad[i].length;
+            entry->skip = stats_quad[i].skip;
+            return stats_quad[i].pos;
+        default:
+            strcpy(entry->name, stats_skip[i].name);
+            entry->length = stats_skip[i].length;
+            entry->skip = stats_skip[i].skip;
+            return stats_skip[i].pos;
+    }
+}
+
+/* Sets up stat i of a type from a cache entry and its mapped members. */
+static void stats_cache_attach(int type, int i, const stats_cache_entry *entry,
+    unsigned char *members)
+{
+    switch (type) {
+        case 0:
+            strcpy(stats_mono[i].name, entry->name);
+            stats_mono[i].ngrams = NULL;
+            stats_mono[i].pos = members;
+            stats_mono[i].length = entry->length;
+            stats_mono[i].weight = -INFINITY;
+            stats_mono[i].skip = entry->skip;
+            break;
+        case 1:
+            strcpy(stats_bi[i].name, entry->name);
+            stats_bi[i].ngrams = NULL;
+            stats_bi[i].pos = (unsigned char (*)[2])members;
+            stats_bi[i].length = entry->length;
+            stats_bi[i].weight = -INFINITY;
+            stats_bi[i].skip = entry->skip;
+            break;
+        case 2:
+            strcpy(stats_tri[i].name, entry->name);
+            stats_tri[i].ngrams = NULL;
+            stats_tri[i].pos = (unsigned char (*)[3])members;
+            stats_tri[i].length = entry->length;
+            stats_tri[i].weight = -INFINITY;
+            stats_tri[i].skip = entry->skip;
+            break;
+        case 3:
+            strcpy(stats_quad[i].name, entry->name);
+            stats_quad[i].ngrams = NULL;
+            stats_quad[i].pos = (unsigned char (*)[4])members;
+            stats_quad[i].length = entry->length;
+            stats_quad[i].weight = -INFINITY;
+            stats_quad[i].skip = entry->skip;
+            break;
+        default:
+            strcpy(stats_skip[i].name, entry->name);
+            stats_skip[i].ngrams = NULL;
+            stats_skip[i].pos = (unsigned char (*)[2])members;
+            stats_skip[i].length = entry->length;
+            for (int k = 0; k < 10; k++) {stats_skip[i].weight[k] = -INFINITY;}
+            stats_skip[i].skip = entry->skip;
+            break;
+    }
+}
+
+/*
+ * Attempts to read the mono, bi, tri, quad, and skip stat definitions from the
+ * stat cache. The cache is memory-mapped and each stat's members point into
+ * the mapping, so no ngrams need to be enumerated. A cache built for another
+ * geometry or version of the stat definitions, or holding a member outside
+ * the grid, is ignored.
+ *
+ * Returns:
+ *   1 if the stats were read from the cache, 0 otherwise.
+ */
+int read_stats_cache()
+{
+    int fd = open(STATS_CACHE_PATH, O_RDONLY);
+    if (fd == -1) {
+        log_print('v',L"Cache not found... ");
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(stats_cache_header)) {
+        close(fd);
+        log_print('v',L"Cache invalid... ");
+        return 0;
+    }
+    size_t size = st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_print('v',L"Cache could not be mapped... ");
+        return 0;
+    }
+
+    /* Check the header before trusting any offsets in the file. */
+    const stats_cache_header *header = map;
+    int entries = 0;
+    int valid = memcmp(header->magic, STATS_CACHE_MAGIC, 8) == 0
+        && header->version == STATS_CACHE_VERSION
+        && header->key == stats_cache_key()
+        && header->size == size;
+    for (int type = 0; valid && type < 5; type++) {
+        if (header->lengths[type] < 0) {valid = 0;}
+        entries += header->lengths[type];
+    }
+    if (valid && sizeof(stats_cache_header) + entries * sizeof(stats_cache_entry) > size) {
+        valid = 0;
+    }
+    const stats_cache_entry *entry = (const stats_cache_entry *)(header + 1);
+    for (int type = 0, e = 0; valid && type < 5; type++) {
+        for (int i = 0; valid && i < header->lengths[type]; i++, e++) {
+            if (entry[e].length < 0
+                || memchr(entry[e].name, '\0', sizeof(entry[e].name)) == NULL
+                || strlen(entry[e].name) > 60
+                || entry[e].offset > size
+                || (uint64_t)entry[e].length * stats_cache_width[type] > size - entry[e].offset) {
+                valid = 0;
+                continue;
             }
-            /* Write all skipgrams to the cache file. */
-            for (int skip = 1; skip < 10; skip++) {
-                if (corpus_skip[skip][i][j] > 0) {
-                    fprintf(corpus, "%d %d %d %d\n", skip, i, j,
-                        corpus_skip[skip][i][j]);
+            /* every member byte is a key position, used as a table index */
+            const unsigned char *members = (const unsigned char *)map + entry[e].offset;
+            size_t bytes = (size_t)entry[e].length * stats_cache_width[type];
+            for (size_t b = 0; b < bytes; b++) {
+                if (members[b] >= DIM1) {
+                    valid = 0;
+                    break;
                 }
             }
         }
-        /* Write all monograms to the cache file. */
-        if (corpus_mono[i] > 0) {
-            fprintf(corpus, "m %d %d\n", i, corpus_mono[i]);
+    }
+    if (!valid) {
+        munmap(map, size);
+        log_print('v',L"Cache out of date... ");
+        return 0;
+    }
+
+    log_print('v',L"Cache found... ");
+    MONO_LENGTH = header->lengths[0];
+    BI_LENGTH = header->lengths[1];
+    TRI_LENGTH = header->lengths[2];
+    QUAD_LENGTH = header->lengths[3];
+    SKIP_LENGTH = header->lengths[4];
+    stats_mono = (mono_stat *)malloc(sizeof(mono_stat) * MONO_LENGTH);
+    stats_bi = (bi_stat *)malloc(sizeof(bi_stat) * BI_LENGTH);
+    stats_tri = (tri_stat *)malloc(sizeof(tri_stat) * TRI_LENGTH);
+    stats_quad = (quad_stat *)malloc(sizeof(quad_stat) * QUAD_LENGTH);
+    stats_skip = (skip_stat *)malloc(sizeof(skip_stat) * SKIP_LENGTH);
+
+    for (int type = 0, e = 0; type < 5; type++) {
+        for (int i = 0; i < header->lengths[type]; i++, e++) {
+            stats_cache_attach(type, i, &entry[e], (unsigned char *)map + entry[e].offset);
         }
     }
-    fclose(corpus);
-    free(path);
+
+    stats_cache_map = map;
+    stats_cache_size = size;
+    return 1;
+}
+
+/*
+ * Writes the current mono, bi, tri, quad, and skip stat definitions to the
+ * stat cache so later runs can map them instead of rebuilding them. The file
+ * is written under a temporary name and renamed into place, so a process
+ * starting at the same time never maps a partial cache.
+ */
+void cache_stats()
+{
+    char *tmp_path = (char*)malloc(strlen(STATS_CACHE_PATH) + 32);
+    sprintf(tmp_path, "%s.%ld", STATS_CACHE_PATH, (long)getpid());
+    FILE *cache = fopen(tmp_path, "wb");
+    if (cache == NULL) {
+        /* Not fatal, the stats are simply rebuilt on the next run. */
+        log_print('v',L"Cache could not be created... ");
+        free(tmp_path);
+        return;
+    }
+
+    stats_cache_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STATS_CACHE_MAGIC, 8);
+    header.version = STATS_CACHE_VERSION;
+    header.key = stats_cache_key();
+    int entries = 0;
+    for (int type = 0; type < 5; type++) {
+        header.lengths[type] = stats_cache_length(type);
+        entries += header.lengths[type];
+    }
+
+    /* Members follow the entry table, in the same order. */
+    uint64_t offset = sizeof(stats_cache_header) + entries * sizeof(stats_cache_entry);
+    stats_cache_entry entry;
+    for (int type = 0; type < 5; type++) {
+        for (int i = 0; i < header.lengths[type]; i++) {
+            stats_cache_describe(type, i, &entry);
+            offset += (uint64_t)entry.length * stats_cache_width[type];
+        }
+    }
+    header.size = offset;
+
+    int ok = fwrite(&header, sizeof(header), 1, cache) == 1;
+    offset = sizeof(stats_cache_header) + entries * sizeof(stats_cache_entry);
+    for (int type = 0; type < 5; type++) {
+        for (int i = 0; i < header.lengths[type]; i++) {
+            stats_cache_describe(type, i, &entry);
+            entry.offset = offset;
+            offset += (uint64_t)entry.length * stats_cache_width[type];
+            ok = ok && fwrite(&entry, sizeof(entry), 1, cache) == 1;
+        }
+    }
+    for (int type = 0; type < 5; type++) {
+        for (int i = 0; i < header.lengths[type]; i++) {
+            const void *members = stats_cache_describe(type, i, &entry);
+            size_t bytes = (size_t)entry.length * stats_cache_width[type];
+            ok = ok && (bytes == 0 || fwrite(members, bytes, 1, cache) == 1);
+        }
+    }
+
+    if (fclose(cache) != 0 || !ok || rename(tmp_path, STATS_CACHE_PATH) != 0) {
+        log_print('v',L"Cache could not be written... ");
+        remove(tmp_path);
+    }
+    free(tmp_path);
+}
+
+/*
+ * Releases the stat cache mapping, if the stats were read from one. Members
+ * that point into the mapping are cleared first so the stats can then be
+ * freed as usual.
+ */
+void free_stats_cache()
+{
+    if (stats_cache_map == NULL) {return;}
+    for (int i = 0; i < MONO_LENGTH; i++) {stats_mono[i].pos = NULL;}
+    for (int i = 0; i < BI_LENGTH; i++) {stats_bi[i].pos = NULL;}
+    for (int i = 0; i < TRI_LENGTH; i++) {stats_tri[i].pos = NULL;}
+    for (int i = 0; i < QUAD_LENGTH; i++) {stats_quad[i].pos = NULL;}
+    for (int i = 0; i < SKIP_LENGTH; i++) {stats_skip[i].pos = NULL;}
+    munmap(stats_cache_map, stats_cache_size);
+    stats_cache_map = NULL;
+    stats_cache_size = 0;
 }
 
 /*
@@ -11,6 +11,8 @@
 #include "util.h"
 #include "mode.h"
 #include "stats.h"
+#include "sparse.h"
+#include "check.h"
 
 #define UNICODE_MAX 65535
 
@@ -34,58 +36,33 @@ void start_up()
     /* Allocate arrays for ngrams directly from corpus. */
     log_print('n',L"3/3: Allocating corpus arrays...\n");
     log_print('v',L"     Monograms... Integer... ");
-    corpus_mono = (int *)calloc(LANG_LENGTH, sizeof(int));
+    corpus_mono = (long long *)calloc(LANG_LENGTH, sizeof(long long));
     log_print('v',L"Floating Point... ");
     linear_mono = (float *)calloc(LANG_LENGTH, sizeof(float));
     log_print('v',L"Done\n");
 
     log_print('v',L"     Bigrams... Integer... ");
-    corpus_bi = (int **)malloc(LANG_LENGTH * sizeof(int *));
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        corpus_bi[i] = (int *)calloc(LANG_LENGTH, sizeof(int));
-    }
+    corpus_bi = (long long *)calloc(LANG_LENGTH * LANG_LENGTH, sizeof(long long));
     log_print('v',L"Floating Point... ");
     linear_bi = (float *)calloc(LANG_LENGTH * LANG_LENGTH, sizeof(float));
     log_print('v',L"Done\n");
 
     log_print('v',L"     Trigrams... Integer... ");
-    corpus_tri = (int ***)malloc(LANG_LENGTH * sizeof(int **));
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        corpus_tri[i] = (int **)malloc(LANG_LENGTH * sizeof(int *));
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            corpus_tri[i][j] = (int *)calloc(LANG_LENGTH, sizeof(int));
-        }
-    }
+    corpus_tri = (long long *)calloc(LANG_LENGTH * LANG_LENGTH * LANG_LENGTH, sizeof(long long));
     log_print('v',L"Floating Point... ");
     linear_tri = (float *)calloc(LANG_LENGTH * LANG_LENGTH * LANG_LENGTH, sizeof(float));
     log_print('v',L"Done\n");
 
     log_print('v',L"     Quadgrams... Integer... ");
-    corpus_quad = (int ****)malloc(LANG_LENGTH * sizeof(int ***));
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        corpus_quad[i] = (int ***)malloc(LANG_LENGTH * sizeof(int **));
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            corpus_quad[i][j] = (int **)malloc(LANG_LENGTH * sizeof(int *));
-            for (int k = 0; k < LANG_LENGTH; k++) {
-                corpus_quad[i][j][k] = (int *)calloc(LANG_LENGTH, sizeof(int));
-            }
-        }
-    }
+    corpus_quad = (long long *)calloc(LANG_LENGTH * LANG_LENGTH * LANG_LENGTH * LANG_LENGTH, sizeof(long long));
     log_print('v',L"Floating Point... ");
     linear_quad = (float *)calloc(LANG_LENGTH * LANG_LENGTH * LANG_LENGTH * LANG_LENGTH, sizeof(float));
     log_print('v',L"Done\n");
 
-    log_print('v',L"     Skipgrams...\n");
-    corpus_skip = (int ***)malloc(10 * sizeof(int **));
-    for (int i = 1; i <= 9; i++) {
-        log_print('v',L"       Skip-%d... Integer... ", i);
-        corpus_skip[i] = (int **)malloc(LANG_LENGTH * sizeof(int *));
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            corpus_skip[i][j] = (int *)calloc(LANG_LENGTH, sizeof(int));
-        }
-        log_print('v',L"Done\n");
-    }
-    log_print('v',L"       Floating Point... ");
+    /* skip-1 to skip-9, the first slice is unused like in linear_skip */
+    log_print('v',L"     Skipgrams... Integer... ");
+    corpus_skip = (long long *)calloc(10 * LANG_LENGTH * LANG_LENGTH, sizeof(long long));
+    log_print('v',L"Floating Point... ");
     linear_skip = (float *)calloc(10 * LANG_LENGTH * LANG_LENGTH, sizeof(float));
     log_print('v',L"Done\n");
 
@@ -107,56 +84,36 @@ void shut_down()
 
     /* Free arrays for ngrams directly from corpus. */
     log_print('n',L"2/3: Freeing corpus arrays... ");
+    free_corpus_cache(); /* io.c */
     log_print('v',L"\n     Monograms... ");
     free(corpus_mono);
     free(linear_mono);
     log_print('v',L"Done\n");
 
     log_print('v',L"     Bigrams... ");
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        free(corpus_bi[i]);
-    }
     free(corpus_bi);
     free(linear_bi);
     log_print('v',L"Done\n");
 
     log_print('v',L"     Trigrams... ");
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            free(corpus_tri[i][j]);
-        }
-        free(corpus_tri[i]);
-    }
     free(corpus_tri);
     free(linear_tri);
     log_print('v',L"Done\n");
 
     log_print('v',L"     Quadgrams... ");
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            for (int k = 0; k < LANG_LENGTH; k++) {
-                free(corpus_quad[i][j][k]);
-            }
-            free(corpus_quad[i][j]);
-        }
-        free(corpus_quad[i]);
-    }
     free(corpus_quad);
     free(linear_quad);
     log_print('v',L"Done\n");
 
-    log_print('v',L"     Skipgrams...\n");
-    for (int i = 1; i <= 9; i++) {
-        log_print('v',L"       Skip-%d... ", i);
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            free(corpus_skip[i][j]);
-        }
-        free(corpus_skip[i]);
-        log_print('v',L"Done\n");
-    }
+    log_print('v',L"     Skipgrams... ");
     free(corpus_skip);
     free(linear_skip);
-    log_print('v',L"       Done\n");
+    free(skip_rows);
+    log_print('v',L"Done\n");
+
+    log_print('v',L"     Sparse ngrams... ");
+    free_sparse_ngrams(); /* sparse.c */
+    log_print('v',L"Done\n");
     log_print('n',L"     Done\n\n");
 
     /* frees all stats */
@@ -277,16 +234,33 @@ int main(int argc, char **argv) {
         log_print('n',L"     2.3/3: Reading raw corpus... ");
         read_corpus(); /* io.c */
         log_print('n',L"Done\n\n");
+    }
+
+    /* take corpus arrays from raw frequencies to percentages */
+    log_print('n',L"3/3: Normalize corpus... ");
+    if (corpus_cache) {
+        /* the cache already holds the normalized frequencies and their totals */
+        log_print('v',L"Read from cache... ");
+    } else {
+        normalize_corpus(); /* util.c */
+    }
+    log_print('n',L"Done\n\n");
 
+    if (!corpus_cache) {
         /* create new corpus cache */
-        log_print('n',L"     2.6/3: Creating corpus cache... ");
+        log_print('n',L"     3.5/3: Creating corpus cache... ");
         cache_corpus(); /* io.c */
         log_print('n',L"Done\n\n");
     }
 
-    /* take corpus arrays from raw frequencies to percentages */
-    log_print('n',L"3/3: Normalize corpus... ");
-    normalize_corpus(); /* util.c */
+    /* lay the skip distances of each pair of characters side by side */
+    log_print('n',L"     3.6/3: Interleaving skipgrams... ");
+    interleave_skips(); /* util.c */
+    log_print('n',L"Done\n\n");
+
+    /* index the nonzero trigrams and quadgrams for scoring many stats at once */
+    log_print('n',L"     3.75/3: Indexing sparse ngrams... ");
+    build_sparse_ngrams(); /* sparse.c */
     log_print('n',L"Done\n\n");
 
     clock_gettime(CLOCK_MONOTONIC, &end);
@@ -303,8 +277,16 @@ int main(int argc, char **argv) {
     log_print_centered('q',L"Running");
     log_print('q',L"\n");
 
+#ifdef SELF_CHECK
+    /* make check: compare the analysis engines instead of serving */
+    log_print('q',L"Checking analysis engines... ");
+    int failures = check_engines(CHECK_LAYOUTS); /* check.c */
+    if (failures) {error("analysis engines disagree");}
+    log_print('q',L"Done\n\n");
+#else
     /* all in mode.c */
     start_server();
+#endif
 
     clock_gettime(CLOCK_MONOTONIC, &end);
     elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
@@ -13,6 +13,7 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
+#include <stdatomic.h>
 
 #include "mode.h"
 #include "util.h"
@@ -21,6 +22,12 @@
 #include "global.h"
 #include "structs.h"
 #include "api_util.h"
+#include "pool.h"
+#include "optimize.h"
+#include "search.h"
+#include "sweep.h"
+#include "weights_cache.h"
+#include "result_cache.h"
 
 #define PORT 8888
 
@@ -33,202 +40,1015 @@ void handle_signal(int signal) {
 }
 
 
-typedef struct {
-    json_object *layout_data;
-    char **response_data;
-} AnalysisTask;
+/* Space reserved for each result record, larger records spill to the heap. */
+#define RECORD_SIZE 512
 
+/*
+ * The compact JSON result of one layout. data points at the record's slot in
+ * a preallocated buffer, or at its own heap copy if it did not fit. ready is
+ * set once the record is complete, for reading partial results of a job.
+ */
 typedef struct {
-    pthread_t *threads;
-    AnalysisTask *tasks;
-    int num_threads;
-    int task_count;
-    int tasks_assigned;
-    int tasks_completed;
-    int shutdown;
-    pthread_mutex_t mutex;
-    pthread_cond_t task_cond;
-    pthread_cond_t batch_done_cond;
-} ThreadPool;
+    char *slot;
+    char *data;
+    size_t length;
+    atomic_int ready;
+    /* index of the next identical element of a batch, 0 if there is none */
+    size_t duplicate;
+} Record;
+
+static void record_string(Record *rec, const char *str) {
+    rec->length = strlen(str);
+    rec->data = rec->length < RECORD_SIZE ? rec->slot : malloc(rec->length + 1);
+    memcpy(rec->data, str, rec->length + 1);
+}
 
-ThreadPool *pool = NULL;
+static void record_response(Record *rec, layout *lt, CustomWeights *weights) {
+    rec->data = rec->slot;
+    rec->length = write_json_response(rec->slot, RECORD_SIZE, lt, weights);
+    if (rec->length >= RECORD_SIZE) {
+        rec->data = malloc(rec->length + 1);
+        write_json_response(rec->data, rec->length + 1, lt, weights);
+    }
+}
+
+static void free_record(Record *rec) {
+    if (rec->data != rec->slot) {free(rec->data);}
+}
 
-void *worker_thread(void *arg);
+/*
+ * Parses the layout of a request element into lt and acquires its weights.
+ * Sets exact if the element asks for exact integer analysis. Returns NULL and
+ * records the error if the element is invalid.
+ */
+static compiled_weights *prepare_layout_analysis(json_object *layout_data, layout *lt, Record *rec,
+                                                 int *exact) {
+    json_object *j_layout_str, *j_weights, *j_exact;
+    if (!json_object_object_get_ex(layout_data, "layout", &j_layout_str) ||
+        !json_object_object_get_ex(layout_data, "weights", &j_weights)) {
+        record_string(rec, "{\"error\": \"Invalid JSON payload: missing layout or weights.\"}");
+        return NULL;
+    }
 
-void create_thread_pool() {
-    if (pool) return;
+    const char *layout_str = json_object_get_string(j_layout_str);
+    /* only the stats that are weighted get analyzed, with a plan compiled once per weight set */
+    compiled_weights *cw = acquire_weights(j_weights);
+    if (!cw) {
+        record_string(rec, "{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}");
+        return NULL;
+    }
 
-    pool = calloc(1, sizeof(ThreadPool));
-    if (!pool) {
-        error("Failed to allocate memory for thread pool.");
+    if (!parse_layout_from_string(lt, layout_str)) {
+        record_string(rec, "{\"error\": \"Invalid layout string.\"}");
+        release_weights(cw);
+        return NULL;
+    }
+    strcpy(lt->name, "api_layout");
+    *exact = 0;
+    if (json_object_object_get_ex(layout_data, "exact", &j_exact)) {
+        if (!json_object_is_type(j_exact, json_type_boolean)) {
+            record_string(rec, "{\"error\": \"Invalid exact: expected true or false.\"}");
+            release_weights(cw);
+            return NULL;
+        }
+        *exact = json_object_get_boolean(j_exact);
     }
+    return cw;
+}
 
-    pool->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-    pool->threads = calloc(pool->num_threads, sizeof(pthread_t));
-    if (!pool->threads) {
-        error("Failed to allocate memory for threads.");
+/* Analyzes a layout with the plan of its weights, going through the result cache. */
+static void analyze_layout(layout *lt, compiled_weights *cw, int exact) {
+    if (!exact) {
+        cached_analyze(lt, cw);
+        return;
     }
+    if (restore_result(lt, cw, 1)) {return;}
+    exact_analyze(lt, cw->plan);
+    store_result(lt, cw, 1);
+}
 
-    pthread_mutex_init(&pool->mutex, NULL);
-    pthread_cond_init(&pool->task_cond, NULL);
-    pthread_cond_init(&pool->batch_done_cond, NULL);
-    pool->shutdown = 0;
+void process_single_layout_analysis(json_object *layout_data, Record *rec) {
+    /* reuse the thread's layout instead of allocating one per request */
+    layout *lt = thread_layout(0);
+    int exact;
+    compiled_weights *cw = prepare_layout_analysis(layout_data, lt, rec, &exact);
+    if (!cw) {return;}
+    analyze_layout(lt, cw, exact);
+    record_response(rec, lt, &cw->weights);
+    release_weights(cw);
+}
 
-    for (int i = 0; i < pool->num_threads; i++) {
-        pthread_create(&pool->threads[i], NULL, &worker_thread, NULL);
+/* A response built piece by piece, grown as needed. */
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+static void buffer_reserve(Buffer *buf, size_t extra) {
+    if (buf->length + extra + 1 <= buf->capacity) {return;}
+    while (buf->length + extra + 1 > buf->capacity) {
+        buf->capacity = buf->capacity ? buf->capacity * 2 : RECORD_SIZE;
+    }
+    buf->data = realloc(buf->data, buf->capacity);
+    if (!buf->data) {
+        error("Failed to allocate memory for response.");
     }
 }
 
-void destroy_thread_pool() {
-    if (!pool) return;
+static void buffer_string(Buffer *buf, const char *str) {
+    size_t length = strlen(str);
+    buffer_reserve(buf, length);
+    memcpy(buf->data + buf->length, str, length + 1);
+    buf->length += length;
+}
 
-    pthread_mutex_lock(&pool->mutex);
-    pool->shutdown = 1;
-    pthread_cond_broadcast(&pool->task_cond);
-    pthread_mutex_unlock(&pool->mutex);
+static void buffer_response(Buffer *buf, layout *lt, CustomWeights *weights) {
+    buffer_reserve(buf, RECORD_SIZE);
+    size_t length = write_json_response(buf->data + buf->length,
+                                        buf->capacity - buf->length, lt, weights);
+    if (buf->length + length >= buf->capacity) {
+        buffer_reserve(buf, length);
+        write_json_response(buf->data + buf->length, buf->capacity - buf->length, lt, weights);
+    }
+    buf->length += length;
+}
 
-    for (int i = 0; i < pool->num_threads; i++) {
-        pthread_join(pool->threads[i], NULL);
+/*
+ * Scores a list of candidate swaps against one base layout. The base is
+ * analyzed once, then each candidate only re-sums the ngrams that touch the
+ * keys it moved. The response holds the base result and one result per
+ * candidate, in order; a malformed candidate gets an error in its place.
+ */
+static char *process_swap_analysis(json_object *request) {
+    json_object *j_layout_str, *j_weights, *j_swaps;
+    if (!json_object_object_get_ex(request, "layout", &j_layout_str) ||
+        !json_object_object_get_ex(request, "weights", &j_weights) ||
+        !json_object_object_get_ex(request, "swaps", &j_swaps) ||
+        !json_object_is_type(j_swaps, json_type_array)) {
+        return strdup("{\"error\": \"Invalid JSON payload: missing layout, weights or swaps.\"}");
     }
 
-    free(pool->threads);
-    pthread_mutex_destroy(&pool->mutex);
-    pthread_cond_destroy(&pool->task_cond);
-    pthread_cond_destroy(&pool->batch_done_cond);
-    free(pool);
-    pool = NULL;
-}
+    compiled_weights *cw = acquire_weights(j_weights);
+    if (!cw) {
+        return strdup("{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}");
+    }
 
-void process_single_layout_analysis(json_object *layout_data, char **response_data) {
-    json_object *j_layout_str, *j_weights;
-    if (!json_object_object_get_ex(layout_data, "layout", &j_layout_str) ||
-        !json_object_object_get_ex(layout_data, "weights", &j_weights)) {
-        *response_data = strdup("{\"error\": \"Invalid JSON payload: missing layout or weights.\"}");
-        return;
+    layout *base;
+    alloc_layout(&base);
+    if (!parse_layout_from_string(base, json_object_get_string(j_layout_str))) {
+        free_layout(base);
+        release_weights(cw);
+        return strdup("{\"error\": \"Invalid layout string.\"}");
     }
+    strcpy(base->name, "api_layout");
 
-    const char *layout_str = json_object_get_string(j_layout_str);
-    CustomWeights weights;
-    json_object *w;
-    json_object_object_get_ex(j_weights, "sfb", &w); weights.sfb = json_object_get_double(w);
-    json_object_object_get_ex(j_weights, "sfs", &w); weights.sfs = json_object_get_double(w);
-    json_object_object_get_ex(j_weights, "lsb", &w); weights.lsb = json_object_get_double(w);
-    json_object_object_get_ex(j_weights, "alt", &w); weights.alt = json_object_get_double(w);
-    json_object_object_get_ex(j_weights, "rolls", &w); weights.rolls = json_object_get_double(w);
+    cached_analyze(base, cw);
 
     layout *lt;
     alloc_layout(&lt);
-
-    if (!parse_layout_from_string(lt, layout_str)) {
-        *response_data = strdup("{\"error\": \"Invalid layout string.\"}");
-    } else {
-        strcpy(lt->name, "api_layout");
-        single_analyze(lt);
-        *response_data = build_json_response(lt, &weights);
+    strcpy(lt->name, "api_swap");
+
+    Buffer buf = {NULL, 0, 0};
+    buffer_string(&buf, "{\"base\":");
+    buffer_response(&buf, base, &cw->weights);
+    buffer_string(&buf, ",\"swaps\":[");
+
+    size_t count = json_object_array_length(j_swaps);
+    for (size_t i = 0; i < count; i++) {
+        if (i) {buffer_string(&buf, ",");}
+        memcpy(lt->matrix, base->matrix, sizeof(lt->matrix));
+        if (!apply_swaps(lt, json_object_array_get_idx(j_swaps, i))) {
+            buffer_string(&buf, "{\"error\": \"Invalid swaps: expected pairs of layout indices 0-29.\"}");
+            continue;
+        }
+        int positions[DIM1];
+        int changed = diff_layouts(lt, base, positions);
+        delta_analyze(lt, base, positions, changed, cw->plan);
+        buffer_response(&buf, lt, &cw->weights);
     }
+    buffer_string(&buf, "]}");
+
     free_layout(lt);
+    free_layout(base);
+    release_weights(cw);
+    return buf.data;
 }
 
-void *worker_thread(void *arg) {
-    (void)arg;
-    while (1) {
-        pthread_mutex_lock(&pool->mutex);
+/* Number of keys in a layout string, and of rows in a neighborhood. */
+#define LAYOUT_KEYS 30
 
-        while (pool->tasks_assigned >= pool->task_count && !pool->shutdown) {
-            pthread_cond_wait(&pool->task_cond, &pool->mutex);
-        }
+/*
+ * A neighborhood request, shared by the workers scoring its rows. Every
+ * worker reads the same analyzed base layout, plan and stat indexes, and
+ * writes the score deltas of its own swaps only.
+ */
+typedef struct {
+    compiled_weights *compiled;
+    layout *base;
+    float base_score;
+    float deltas[LAYOUT_KEYS][LAYOUT_KEYS];
+} Neighborhood;
+
+/*
+ * Parses and analyzes the base of a neighborhood request. Returns NULL and
+ * sets response to the error if the request is invalid.
+ */
+static Neighborhood *create_neighborhood(json_object *request, char **response) {
+    json_object *j_layout_str, *j_weights;
+    if (!json_object_object_get_ex(request, "layout", &j_layout_str) ||
+        !json_object_object_get_ex(request, "weights", &j_weights)) {
+        *response = strdup("{\"error\": \"Invalid JSON payload: missing layout or weights.\"}");
+        return NULL;
+    }
+
+    Neighborhood *nb = malloc(sizeof(Neighborhood));
+    if (!nb) {
+        error("Failed to allocate memory for neighborhood.");
+    }
+    nb->compiled = acquire_weights(j_weights);
+    if (!nb->compiled) {
+        free(nb);
+        *response = strdup("{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}");
+        return NULL;
+    }
+
+    alloc_layout(&nb->base);
+    if (!parse_layout_from_string(nb->base, json_object_get_string(j_layout_str))) {
+        free_layout(nb->base);
+        release_weights(nb->compiled);
+        free(nb);
+        *response = strdup("{\"error\": \"Invalid layout string.\"}");
+        return NULL;
+    }
+    strcpy(nb->base->name, "api_layout");
+
+    cached_analyze(nb->base, nb->compiled);
+    nb->base_score = weighted_score(nb->base, &nb->compiled->weights);
+    for (int a = 0; a < LAYOUT_KEYS; a++) {nb->deltas[a][a] = 0;}
+    return nb;
+}
+
+/* Scores the swaps of key a with every later key, run on the worker pool. */
+static void score_neighborhood_row(Neighborhood *nb, int a) {
+    layout *lt = thread_layout(0);
+    int positions[2] = {key_position(a), 0};
+    for (int b = a + 1; b < LAYOUT_KEYS; b++) {
+        memcpy(lt->matrix, nb->base->matrix, sizeof(lt->matrix));
+        swap_keys(lt, a, b);
+        positions[1] = key_position(b);
+        delta_analyze(lt, nb->base, positions, 2, nb->compiled->plan);
+        float delta = weighted_score(lt, &nb->compiled->weights) - nb->base_score;
+        nb->deltas[a][b] = delta;
+        nb->deltas[b][a] = delta;
+    }
+}
 
-        if (pool->shutdown) {
-            pthread_mutex_unlock(&pool->mutex);
-            break;
+/* Writes the base result and the delta matrix, then frees the request. */
+static char *finish_neighborhood(Neighborhood *nb) {
+    Buffer buf = {NULL, 0, 0};
+    buffer_string(&buf, "{\"base\":");
+    buffer_response(&buf, nb->base, &nb->compiled->weights);
+    buffer_string(&buf, ",\"deltas\":[");
+    for (int a = 0; a < LAYOUT_KEYS; a++) {
+        buffer_string(&buf, a ? ",[" : "[");
+        for (int b = 0; b < LAYOUT_KEYS; b++) {
+            char value[32];
+            snprintf(value, sizeof(value), "%s%.9g", b ? "," : "", nb->deltas[a][b]);
+            buffer_string(&buf, value);
         }
+        buffer_string(&buf, "]");
+    }
+    buffer_string(&buf, "]}");
+
+    free_layout(nb->base);
+    release_weights(nb->compiled);
+    free(nb);
+    return buf.data;
+}
+
+/*
+ * Writes the start result and a ranking of layouts, each with its layout
+ * string and result, leaving the closing brace to the caller. Each layout is
+ * analyzed afresh, so its reported values carry none of the float error of
+ * incremental scoring.
+ */
+static void buffer_ranking(Buffer *buf, layout *start, layout_node *ranking,
+                           compiled_weights *cw) {
+    buffer_string(buf, "{\"start\":");
+    buffer_response(buf, start, &cw->weights);
+    buffer_string(buf, ",\"layouts\":[");
+
+    layout *lt;
+    alloc_layout(&lt);
+    for (layout_node *node = ranking; node; node = node->next) {
+        memcpy(lt->matrix, node->matrix, sizeof(lt->matrix));
+        cached_analyze(lt, cw);
+
+        char layout_str[LAYOUT_STRING_SIZE];
+        write_layout_string(layout_str, lt);
+        json_object *j_layout_str = json_object_new_string(layout_str);
+        buffer_string(buf, node == ranking ? "{\"layout\":" : ",{\"layout\":");
+        buffer_string(buf, json_object_to_json_string_ext(j_layout_str,
+                      JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE));
+        json_object_put(j_layout_str);
+        buffer_string(buf, ",\"result\":");
+        buffer_response(buf, lt, &cw->weights);
+        buffer_string(buf, "}");
+    }
+    free_layout(lt);
+    buffer_string(buf, "]");
+}
+
+/* Writes the best layouts of a finished optimize run, then frees the run. */
+static char *finish_optimization(optimize_run *run) {
+    layout_node *ranking = merge_rankings(run);
+    long iterations = 0;
+    for (int c = 0; c < run->chains; c++) {iterations += run->states[c].iterations;}
+
+    Buffer buf = {NULL, 0, 0};
+    buffer_ranking(&buf, run->start, ranking, run->compiled);
+    char tail[64];
+    snprintf(tail, sizeof(tail), ",\"iterations\":%ld}", iterations);
+    buffer_string(&buf, tail);
+
+    free_ranking(ranking);
+    free_optimize_run(run);
+    return buf.data;
+}
 
-        AnalysisTask task = pool->tasks[pool->tasks_assigned];
-        pool->tasks_assigned++;
+/* Writes the best layouts of a finished search, then frees the search. */
+static char *finish_search(search_run *run) {
+    layout_node *ranking = search_results(run);
 
-        pthread_mutex_unlock(&pool->mutex);
+    Buffer buf = {NULL, 0, 0};
+    buffer_ranking(&buf, run->start, ranking, run->compiled);
+    char tail[64];
+    snprintf(tail, sizeof(tail), ",\"nodes\":%ld,\"complete\":%s}", atomic_load(&run->nodes),
+             atomic_load(&run->incomplete) ? "false" : "true");
+    buffer_string(&buf, tail);
 
-        process_single_layout_analysis(task.layout_data, task.response_data);
+    free_ranking(ranking);
+    free_search_run(run);
+    return buf.data;
+}
 
-        pthread_mutex_lock(&pool->mutex);
-        pool->tasks_completed++;
-        if (pool->tasks_completed >= pool->task_count) {
-            pthread_cond_signal(&pool->batch_done_cond);
+/* Writes the score matrix of a finished sweep, then frees the sweep. */
+static char *finish_sweep(sweep_run *run) {
+    Buffer buf = {NULL, 0, 0};
+    buffer_string(&buf, "{\"scores\":[");
+    for (size_t i = 0; i < run->count; i++) {
+        if (i) {buffer_string(&buf, ",");}
+        if (run->invalid[i]) {
+            buffer_string(&buf, "null");
+            continue;
+        }
+        /* a float takes at most 15 characters with %.9g */
+        buffer_reserve(&buf, (size_t)run->sets * 16 + 2);
+        buf.data[buf.length++] = '[';
+        for (int m = 0; m < run->sets; m++) {
+            buf.length += sprintf(buf.data + buf.length, "%s%.9g", m ? "," : "",
+                                  run->scores[i * run->sets + m]);
         }
-        pthread_mutex_unlock(&pool->mutex);
+        buffer_string(&buf, "]");
     }
-    return NULL;
+    buffer_string(&buf, "]}");
+
+    free_sweep_run(run);
+    return buf.data;
 }
 
-typedef struct {
+typedef struct RequestContext RequestContext;
+
+/* Handles a parsed request on the worker pool, ends with finish_request(). */
+typedef void (*Route)(RequestContext *rc);
+
+struct RequestContext {
     char *post_data;
     size_t post_data_size;
     char *response_data;
-    pthread_t thread_id;
-} RequestContext;
+    /* set once the request has been handed to the worker pool */
+    int dispatched;
+    int pretty;
+    struct MHD_Connection *connection;
+    json_object *parsed_json;
+    /* one record per batch element, slots carved from a single buffer */
+    char *record_buffer;
+    Record *records;
+    size_t batch_size;
+    /* the batch elements to analyze, identical elements are analyzed once */
+    size_t *unique;
+    size_t unique_count;
+    /* the neighborhood being scored, NULL for other requests */
+    Neighborhood *neighborhood;
+    /* the optimization being run, NULL for other requests */
+    optimize_run *optimization;
+    /* the search being run, NULL for other requests */
+    search_run *search;
+    /* the sweep being scored, NULL for other requests */
+    sweep_run *sweep;
+    /* handler of the requested URL, NULL if there is none */
+    Route route;
+    /* units of work done so far, out of total */
+    atomic_size_t completed;
+    atomic_size_t total;
+    /* nonzero for a job run without a connection, set to finished once done */
+    unsigned long job_id;
+    int finished;
+};
+
+/* Number of jobs kept in the store, finished jobs are evicted oldest first. */
+#define MAX_JOBS 256
 
-static void *analysis_thread(void *cls) {
-    RequestContext *rc = (RequestContext *)cls;
-    log_print('v', L"[Thread %p] Starting analysis.\n", (void*)pthread_self());
+/*
+ * The job store. A new job takes an empty slot, or else the slot of the
+ * oldest finished job, and is refused only while every slot holds a running
+ * job. The mutex also guards the records of running jobs, which are read for
+ * partial results.
+ */
+static RequestContext *jobs[MAX_JOBS];
+static unsigned long next_job_id = 1;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a slot for a new job, NULL if every job is running. Needs the jobs mutex. */
+static RequestContext **free_job_slot() {
+    RequestContext **oldest = NULL;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (!jobs[i]) {return &jobs[i];}
+        if (jobs[i]->finished && (!oldest || jobs[i]->job_id < (*oldest)->job_id)) {
+            oldest = &jobs[i];
+        }
+    }
+    return oldest;
+}
+
+/* Returns the stored job with an id, NULL if there is none. Needs the jobs mutex. */
+static RequestContext *find_job(unsigned long id) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] && jobs[i]->job_id == id) {return jobs[i];}
+    }
+    return NULL;
+}
 
-    json_object *parsed_json = json_tokener_parse(rc->post_data);
+/* Locks the job store if the request is a job, whose records may be polled. */
+static void lock_job(RequestContext *rc) {
+    if (rc->job_id) {pthread_mutex_lock(&jobs_mutex);}
+}
 
-    if (!parsed_json) {
-        log_print('v', L"[Thread %p] ERROR: Invalid JSON format.\n", (void*)pthread_self());
-        rc->response_data = strdup("{\"error\": \"Invalid JSON format.\"}");
-        return NULL;
+static void unlock_job(RequestContext *rc) {
+    if (rc->job_id) {pthread_mutex_unlock(&jobs_mutex);}
+}
+
+static void free_context(RequestContext *rc) {
+    free(rc->post_data);
+    free(rc->response_data);
+    free(rc);
+}
+
+/* Re-indents a JSON response, or returns it unchanged if it does not parse. */
+static char *pretty_response(char *response) {
+    json_object *j_response = json_tokener_parse(response);
+    if (j_response) {
+        free(response);
+        response = strdup(json_object_to_json_string_ext(j_response, JSON_C_TO_STRING_PRETTY));
+        json_object_put(j_response);
     }
+    return response;
+}
 
-    if (json_object_get_type(parsed_json) == json_type_array) {
-        size_t batch_size = json_object_array_length(parsed_json);
-        log_print('v', L"Detected batch request with %zu items.\n", batch_size);
+/*
+ * Releases the parsed request and wakes the suspended connection, or marks
+ * the job finished if there is none.
+ */
+static void finish_request(RequestContext *rc) {
+    json_object_put(rc->parsed_json);
+    rc->parsed_json = NULL;
 
-        pool->tasks = calloc(batch_size, sizeof(AnalysisTask));
-        char **responses = calloc(batch_size, sizeof(char*));
-        if (!pool->tasks || !responses) {
-            error("Failed to allocate memory for batch processing.");
+    /* compact output is the default, pretty printing costs a re-parse */
+    if (rc->pretty && rc->response_data) {
+        rc->response_data = pretty_response(rc->response_data);
+    }
+    log_print('v', L"[Thread %p] Analysis finished.\n", (void*)pthread_self());
+    atomic_store(&rc->completed, atomic_load(&rc->total));
+    if (rc->job_id) {
+        pthread_mutex_lock(&jobs_mutex);
+        rc->finished = 1;
+        pthread_mutex_unlock(&jobs_mutex);
+    } else {
+        MHD_resume_connection(rc->connection);
+    }
+}
+
+/*
+ * Analyzes one group of up to MULTI_LANES distinct elements of a batch
+ * request, run on the worker pool. Elements the result cache does not hold
+ * are analyzed side by side with the others that share their weights, apart
+ * from exact ones, which are summed one at a time. Each record is then copied
+ * to the identical elements after it.
+ */
+static void analyze_batch_group(void *arg, size_t index) {
+    RequestContext *rc = (RequestContext *)arg;
+    size_t first = index * MULTI_LANES;
+    int count = rc->unique_count - first < MULTI_LANES ? (int)(rc->unique_count - first) : MULTI_LANES;
+
+    layout *lts[MULTI_LANES];
+    compiled_weights *cws[MULTI_LANES];
+    /* nonzero while an element still needs its analysis */
+    int pending[MULTI_LANES];
+    int exact[MULTI_LANES];
+    for (int g = 0; g < count; g++) {
+        size_t i = rc->unique[first + g];
+        lts[g] = thread_layout(g);
+        cws[g] = prepare_layout_analysis(json_object_array_get_idx(rc->parsed_json, i),
+                                         lts[g], &rc->records[i], &exact[g]);
+        pending[g] = 0;
+        if (!cws[g]) {continue;}
+        if (exact[g]) {
+            analyze_layout(lts[g], cws[g], 1);
+        } else {
+            pending[g] = !restore_result(lts[g], cws[g], 0);
+        }
+    }
+
+    for (int g = 0; g < count; g++) {
+        if (!pending[g]) {continue;}
+        layout *group[MULTI_LANES];
+        int size = 0;
+        for (int h = g; h < count; h++) {
+            if (pending[h] && cws[h] == cws[g]) {
+                group[size++] = lts[h];
+                pending[h] = 0;
+            }
         }
+        multi_analyze(group, size, cws[g]->plan);
+        for (int k = 0; k < size; k++) {store_result(group[k], cws[g], 0);}
+    }
 
-        for (size_t i = 0; i < batch_size; i++) {
-            pool->tasks[i].layout_data = json_object_array_get_idx(parsed_json, i);
-            pool->tasks[i].response_data = &responses[i];
+    for (int g = 0; g < count; g++) {
+        size_t i = rc->unique[first + g];
+        if (cws[g]) {
+            record_response(&rc->records[i], lts[g], &cws[g]->weights);
+            release_weights(cws[g]);
+        }
+        atomic_store(&rc->records[i].ready, 1);
+        atomic_fetch_add(&rc->completed, 1);
+        for (size_t d = rc->records[i].duplicate; d; d = rc->records[d].duplicate) {
+            record_string(&rc->records[d], rc->records[i].data);
+            atomic_store(&rc->records[d].ready, 1);
+            atomic_fetch_add(&rc->completed, 1);
         }
+    }
+}
 
-        pthread_mutex_lock(&pool->mutex);
-        pool->task_count = batch_size;
-        pool->tasks_assigned = 0;
-        pool->tasks_completed = 0;
-        pthread_cond_broadcast(&pool->task_cond);
+/*
+ * Called by the worker that finished the last element of a batch, joins all
+ * records into the response array in a single pass.
+ */
+static void batch_done(void *arg) {
+    RequestContext *rc = (RequestContext *)arg;
+
+    size_t total = 2;
+    for (size_t i = 0; i < rc->batch_size; i++) {
+        total += rc->records[i].length + 1;
+    }
+
+    char *out = malloc(total + 1);
+    if (!out) {
+        error("Failed to allocate memory for batch response.");
+    }
+    size_t len = 0;
+    out[len++] = '[';
+    for (size_t i = 0; i < rc->batch_size; i++) {
+        if (i) {out[len++] = ',';}
+        memcpy(out + len, rc->records[i].data, rc->records[i].length);
+        len += rc->records[i].length;
+    }
+    out[len++] = ']';
+    out[len] = '\0';
+
+    lock_job(rc);
+    rc->response_data = out;
+    for (size_t i = 0; i < rc->batch_size; i++) {free_record(&rc->records[i]);}
+    free(rc->records);
+    free(rc->record_buffer);
+    free(rc->unique);
+    rc->records = NULL;
+    rc->record_buffer = NULL;
+    rc->unique = NULL;
+    unlock_job(rc);
+
+    finish_request(rc);
+}
 
-        while (pool->tasks_completed < batch_size) {
-            pthread_cond_wait(&pool->batch_done_cond, &pool->mutex);
+/*
+ * Links each element of a batch to the next element with the same text, and
+ * lists the first of each group of identical elements.
+ *
+ * Returns: The number of distinct elements written to unique.
+ */
+static size_t find_duplicates(json_object *batch, Record *records, size_t *unique) {
+    size_t batch_size = json_object_array_length(batch);
+    size_t capacity = 16;
+    while (capacity < 2 * batch_size) {capacity *= 2;}
+    /* open addressing, each slot holds the latest element of its group */
+    size_t *table = malloc(capacity * sizeof(size_t));
+    const char **texts = malloc(batch_size * sizeof(char *));
+    if (!table || (batch_size && !texts)) {
+        error("Failed to allocate memory for batch processing.");
+    }
+    memset(table, 0xFF, capacity * sizeof(size_t));
+
+    size_t count = 0;
+    for (size_t i = 0; i < batch_size; i++) {
+        texts[i] = json_object_to_json_string_ext(json_object_array_get_idx(batch, i),
+                                                  JSON_C_TO_STRING_PLAIN);
+        uint64_t hash = 0xCBF29CE484222325ULL;
+        for (const char *c = texts[i]; *c; c++) {hash = (hash ^ (unsigned char)*c) * 0x100000001B3ULL;}
+
+        size_t slot = hash & (capacity - 1);
+        while (table[slot] != SIZE_MAX && strcmp(texts[table[slot]], texts[i])) {
+            slot = (slot + 1) & (capacity - 1);
         }
-        pthread_mutex_unlock(&pool->mutex);
+        records[i].duplicate = 0;
+        if (table[slot] == SIZE_MAX) {
+            unique[count++] = i;
+        } else {
+            records[table[slot]].duplicate = i;
+        }
+        table[slot] = i;
+    }
+    free(table);
+    free(texts);
+    return count;
+}
+
+/*
+ * Route of the analysis endpoint. Single layouts are analyzed right here,
+ * batches become their own job so that no worker ever blocks waiting on
+ * another.
+ */
+static void route_analyze(RequestContext *rc) {
+    if (json_object_get_type(rc->parsed_json) == json_type_array) {
+        size_t batch_size = json_object_array_length(rc->parsed_json);
+        log_print('v', L"Detected batch request with %zu items.\n", batch_size);
 
-        json_object *j_response_array = json_object_new_array();
+        Record *records = malloc(batch_size * sizeof(Record));
+        char *record_buffer = malloc(batch_size * RECORD_SIZE);
+        size_t *unique = malloc(batch_size * sizeof(size_t));
+        if (batch_size && (!records || !record_buffer || !unique)) {
+            error("Failed to allocate memory for batch processing.");
+        }
         for (size_t i = 0; i < batch_size; i++) {
-            if (responses[i]) {
-                json_object *j_item_response = json_tokener_parse(responses[i]);
-                json_object_array_add(j_response_array, j_item_response);
-                free(responses[i]);
-            }
+            records[i].slot = record_buffer + i * RECORD_SIZE;
+            atomic_init(&records[i].ready, 0);
         }
+        size_t unique_count = find_duplicates(rc->parsed_json, records, unique);
+        log_print('v', L"Batch has %zu distinct items.\n", unique_count);
+
+        /* a job's records are published whole, they may be polled right away */
+        lock_job(rc);
+        rc->batch_size = batch_size;
+        rc->records = records;
+        rc->record_buffer = record_buffer;
+        rc->unique = unique;
+        rc->unique_count = unique_count;
+        atomic_store(&rc->total, batch_size);
+        unlock_job(rc);
+
+        /* the batch is its own job, other requests' jobs interleave with it */
+        submit_job(&analyze_batch_group, rc, (unique_count + MULTI_LANES - 1) / MULTI_LANES,
+                   &batch_done);
+    } else {
+        char slot[RECORD_SIZE];
+        Record rec = {slot, NULL, 0};
+        process_single_layout_analysis(rc->parsed_json, &rec);
+        rc->response_data = rec.data == slot ? strdup(slot) : rec.data;
+        finish_request(rc);
+    }
+}
 
-        rc->response_data = strdup(json_object_to_json_string_ext(j_response_array, JSON_C_TO_STRING_PRETTY));
-        json_object_put(j_response_array);
-        free(pool->tasks);
-        free(responses);
+/* Route of the swap endpoint. */
+static void route_swap(RequestContext *rc) {
+    rc->response_data = process_swap_analysis(rc->parsed_json);
+    finish_request(rc);
+}
 
-    } else {
-        process_single_layout_analysis(parsed_json, &rc->response_data);
+/*
+ * Scores two rows of a neighborhood request, run on the worker pool. Row a
+ * holds LAYOUT_KEYS - 1 - a swaps, so pairing the rows from both ends gives
+ * every index about the same work.
+ */
+static void analyze_neighborhood_rows(void *arg, size_t index) {
+    RequestContext *rc = (RequestContext *)arg;
+    int a = (int)index, b = LAYOUT_KEYS - 2 - a;
+    score_neighborhood_row(rc->neighborhood, a);
+    if (b != a) {score_neighborhood_row(rc->neighborhood, b);}
+    atomic_fetch_add(&rc->completed, 1);
+}
+
+/* Called by the worker that finished the last row of a neighborhood. */
+static void neighborhood_done(void *arg) {
+    RequestContext *rc = (RequestContext *)arg;
+    rc->response_data = finish_neighborhood(rc->neighborhood);
+    rc->neighborhood = NULL;
+    finish_request(rc);
+}
+
+/*
+ * Route of the neighborhood endpoint. The base is analyzed here, then its
+ * rows of swaps become their own job, like the elements of a batch.
+ */
+static void route_neighborhood(RequestContext *rc) {
+    rc->neighborhood = create_neighborhood(rc->parsed_json, &rc->response_data);
+    if (!rc->neighborhood) {
+        finish_request(rc);
+        return;
     }
+    /* the last key has no later key to swap with, leaving LAYOUT_KEYS - 1 rows */
+    atomic_store(&rc->total, LAYOUT_KEYS / 2);
+    submit_job(&analyze_neighborhood_rows, rc, LAYOUT_KEYS / 2, &neighborhood_done);
+}
 
-    json_object_put(parsed_json);
-    log_print('v', L"[Thread %p] Analysis finished.\n", (void*)pthread_self());
+/* Runs one time slice of a chain of an optimize request, run on the worker pool. */
+static void analyze_optimize_chain(void *arg, size_t index) {
+    RequestContext *rc = (RequestContext *)arg;
+    if (rc->optimization->states[index].finished) {return;}
+    if (anneal_chain(rc->optimization, (int)index)) {atomic_fetch_add(&rc->completed, 1);}
+}
+
+/*
+ * Called by the worker that finished the last slice of a round of an optimize
+ * request. Queues the next round behind the other jobs while chains are left.
+ */
+static void optimize_done(void *arg) {
+    RequestContext *rc = (RequestContext *)arg;
+    if (atomic_load(&rc->completed) < (size_t)rc->optimization->chains) {
+        submit_job(&analyze_optimize_chain, rc, rc->optimization->chains, &optimize_done);
+        return;
+    }
+    rc->response_data = finish_optimization(rc->optimization);
+    rc->optimization = NULL;
+    finish_request(rc);
+}
+
+/*
+ * Route of the optimize endpoint. Each chain is one index of a job that runs
+ * a short slice of every chain, and the job queues itself again until every
+ * chain's budget runs out, so other requests get the workers in between.
+ */
+static void route_optimize(RequestContext *rc) {
+    const char *message;
+    rc->optimization = create_optimize_run(rc->parsed_json, &message);
+    if (!rc->optimization) {
+        rc->response_data = strdup(message);
+        finish_request(rc);
+        return;
+    }
+    atomic_store(&rc->total, rc->optimization->chains);
+    submit_job(&analyze_optimize_chain, rc, rc->optimization->chains, &optimize_done);
+}
+
+/* Searches one time slice of a subtree of a search request, run on the worker pool. */
+static void analyze_search_subtree(void *arg, size_t index) {
+    RequestContext *rc = (RequestContext *)arg;
+    if (rc->search->finished[index]) {return;}
+    if (search_subtree(rc->search, index)) {atomic_fetch_add(&rc->completed, 1);}
+}
+
+/*
+ * Called by the worker that finished the last slice of a round of a search
+ * request. Queues the next round behind the other jobs while subtrees are left.
+ */
+static void search_done(void *arg) {
+    RequestContext *rc = (RequestContext *)arg;
+    if (atomic_load(&rc->completed) < search_subtrees(rc->search)) {
+        submit_job(&analyze_search_subtree, rc, search_subtrees(rc->search), &search_done);
+        return;
+    }
+    rc->response_data = finish_search(rc->search);
+    rc->search = NULL;
+    finish_request(rc);
+}
+
+/*
+ * Route of the search endpoint. The subtrees below each choice of the first
+ * two keys are the indices of one job, sharing the best layouts found so far
+ * for pruning. The job runs a short slice of every subtree and queues itself
+ * again until all of them are done or the time budget runs out.
+ */
+static void route_search(RequestContext *rc) {
+    const char *message;
+    rc->search = create_search_run(rc->parsed_json, &message);
+    if (!rc->search) {
+        rc->response_data = strdup(message);
+        finish_request(rc);
+        return;
+    }
+    atomic_store(&rc->total, search_subtrees(rc->search));
+    submit_job(&analyze_search_subtree, rc, search_subtrees(rc->search), &search_done);
+}
+
+/* Scores one block of layouts of a sweep request, run on the worker pool. */
+static void analyze_sweep_block(void *arg, size_t index) {
+    RequestContext *rc = (RequestContext *)arg;
+    sweep_block(rc->sweep, index);
+    atomic_fetch_add(&rc->completed, 1);
+}
+
+/* Called by the worker that finished the last block of a sweep request. */
+static void sweep_done(void *arg) {
+    RequestContext *rc = (RequestContext *)arg;
+    rc->response_data = finish_sweep(rc->sweep);
+    rc->sweep = NULL;
+    finish_request(rc);
+}
+
+/*
+ * Route of the sweep endpoint. Blocks of layouts are the indices of one job,
+ * each analyzed once and scored under every weight set.
+ */
+static void route_sweep(RequestContext *rc) {
+    const char *message;
+    rc->sweep = create_sweep_run(rc->parsed_json, &message);
+    if (!rc->sweep) {
+        rc->response_data = strdup(message);
+        finish_request(rc);
+        return;
+    }
+    atomic_store(&rc->total, sweep_blocks(rc->sweep));
+    submit_job(&analyze_sweep_block, rc, sweep_blocks(rc->sweep), &sweep_done);
+}
 
+/* The URLs the server answers, each with its route. */
+static const struct {
+    const char *url;
+    Route route;
+} routes[] = {
+    {"/", &route_analyze},
+    {"/swap", &route_swap},
+    {"/neighborhood", &route_neighborhood},
+    {"/optimize", &route_optimize},
+    {"/search", &route_search},
+    {"/sweep", &route_sweep},
+};
+
+static Route find_route(const char *url) {
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (strcmp(url, routes[i].url) == 0) {return routes[i].route;}
+    }
     return NULL;
 }
 
+/* Entry point of every request on the worker pool. */
+static void analyze_request(void *arg, size_t index) {
+    (void)index;
+    RequestContext *rc = (RequestContext *)arg;
+    log_print('v', L"[Thread %p] Starting analysis.\n", (void*)pthread_self());
+
+    /* routes that split their work raise the total */
+    atomic_store(&rc->total, 1);
+    rc->parsed_json = json_tokener_parse(rc->post_data);
+
+    if (!rc->parsed_json) {
+        log_print('v', L"[Thread %p] ERROR: Invalid JSON format.\n", (void*)pthread_self());
+        rc->response_data = strdup("{\"error\": \"Invalid JSON format.\"}");
+        finish_request(rc);
+        return;
+    }
+
+    rc->route(rc);
+}
+
+/* Queues a JSON response, mode tells MHD whether to free the page. */
+static enum MHD_Result queue_json(struct MHD_Connection *connection, unsigned int status,
+                                  const char *page, enum MHD_ResponseMemoryMode mode) {
+    struct MHD_Response *response = MHD_create_response_from_buffer(strlen(page), (void *)page, mode);
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+/*
+ * Stores the body of a POST /jobs request as a new job and queues it on the
+ * worker pool, answering with its id right away. The endpoint argument names
+ * the route that runs it.
+ */
+static enum MHD_Result queue_new_job(struct MHD_Connection *connection, RequestContext *rc) {
+    const char *endpoint = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "endpoint");
+    Route route = find_route(endpoint ? endpoint : "/");
+    if (!route) {
+        return queue_json(connection, MHD_HTTP_BAD_REQUEST,
+                          "{\"error\": \"Unknown endpoint\"}", MHD_RESPMEM_PERSISTENT);
+    }
+
+    RequestContext *job = calloc(1, sizeof(RequestContext));
+    if (!job) {
+        log_print('v', L"ERROR: Failed to allocate memory for job.\n");
+        return MHD_NO;
+    }
+    job->route = route;
+
+    pthread_mutex_lock(&jobs_mutex);
+    RequestContext **slot = free_job_slot();
+    if (!slot) {
+        pthread_mutex_unlock(&jobs_mutex);
+        free(job);
+        log_print('v', L"Job rejected: Store full.\n");
+        return queue_json(connection, MHD_HTTP_SERVICE_UNAVAILABLE,
+                          "{\"error\": \"Too many running jobs\"}", MHD_RESPMEM_PERSISTENT);
+    }
+    if (*slot) {free_context(*slot);}
+    *slot = job;
+    job->job_id = next_job_id++;
+    /* the job owns the body from here on */
+    job->post_data = rc->post_data;
+    job->post_data_size = rc->post_data_size;
+    rc->post_data = NULL;
+    pthread_mutex_unlock(&jobs_mutex);
+
+    log_print('v', L"Queued job %lu.\n", job->job_id);
+    char page[64];
+    snprintf(page, sizeof(page), "{\"id\":%lu}", job->job_id);
+    submit_job(&analyze_request, job, 1, NULL);
+    return queue_json(connection, MHD_HTTP_ACCEPTED, strdup(page), MHD_RESPMEM_MUST_FREE);
+}
+
+/*
+ * Answers GET /jobs/<id> with the job's status and progress. A finished job
+ * carries its result, a running batch the records completed so far, with
+ * null for the rest.
+ */
+static enum MHD_Result queue_job_status(struct MHD_Connection *connection, const char *id_str) {
+    char *end;
+    unsigned long id = strtoul(id_str, &end, 10);
+
+    pthread_mutex_lock(&jobs_mutex);
+    RequestContext *job = *id_str && !*end ? find_job(id) : NULL;
+    if (!job) {
+        pthread_mutex_unlock(&jobs_mutex);
+        return queue_json(connection, MHD_HTTP_NOT_FOUND,
+                          "{\"error\": \"Unknown job\"}", MHD_RESPMEM_PERSISTENT);
+    }
+
+    size_t total = atomic_load(&job->total);
+    char head[160];
+    snprintf(head, sizeof(head), "{\"id\":%lu,\"status\":\"%s\",\"completed\":%zu,\"total\":%zu",
+             id, job->finished ? "done" : total ? "running" : "queued",
+             atomic_load(&job->completed), total);
+    Buffer buf = {NULL, 0, 0};
+    buffer_string(&buf, head);
+    if (job->finished) {
+        buffer_string(&buf, ",\"result\":");
+        buffer_string(&buf, job->response_data);
+    } else if (job->records) {
+        buffer_string(&buf, ",\"result\":[");
+        for (size_t i = 0; i < job->batch_size; i++) {
+            if (i) {buffer_string(&buf, ",");}
+            buffer_string(&buf, atomic_load(&job->records[i].ready) ? job->records[i].data : "null");
+        }
+        buffer_string(&buf, "]");
+    }
+    buffer_string(&buf, "}");
+    pthread_mutex_unlock(&jobs_mutex);
+
+    const char *pretty = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "pretty");
+    if (pretty != NULL && strcmp(pretty, "0") != 0) {
+        buf.data = pretty_response(buf.data);
+    }
+    return queue_json(connection, MHD_HTTP_OK, buf.data, MHD_RESPMEM_MUST_FREE);
+}
+
+/* Answers GET /cache with the counters of the result and weights caches. */
+static enum MHD_Result queue_cache_counts(struct MHD_Connection *connection) {
+    long result_hits, result_misses, result_entries, result_capacity;
+    long weights_hits, weights_misses, weights_entries;
+    result_cache_counts(&result_hits, &result_misses, &result_entries, &result_capacity);
+    weights_cache_counts(&weights_hits, &weights_misses, &weights_entries);
+
+    char page[384];
+    snprintf(page, sizeof(page),
+             "{\"results\":{\"hits\":%ld,\"misses\":%ld,\"entries\":%ld,\"capacity\":%ld},"
+             "\"weights\":{\"hits\":%ld,\"misses\":%ld,\"entries\":%ld,\"capacity\":%d}}",
+             result_hits, result_misses, result_entries, result_capacity,
+             weights_hits, weights_misses, weights_entries, WEIGHTS_CACHE_SIZE);
+
+    const char *pretty = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "pretty");
+    char *response = strdup(page);
+    if (pretty != NULL && strcmp(pretty, "0") != 0) {
+        response = pretty_response(response);
+    }
+    return queue_json(connection, MHD_HTTP_OK, response, MHD_RESPMEM_MUST_FREE);
+}
+
+/* Frees every stored job, once the worker pool has finished them all. */
+static void free_jobs() {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i]) {free_context(jobs[i]);}
+        jobs[i] = NULL;
+    }
+}
+
 static enum MHD_Result request_handler(void *cls, struct MHD_Connection *connection,
                                      const char *url, const char *method,
                                      const char *version, const char *upload_data,
@@ -242,6 +1062,7 @@ static enum MHD_Result request_handler(void *cls, struct MHD_Connection *connect
             return MHD_NO;
         }
         *con_cls = (void *)rc;
+        rc->route = find_route(url);
 
         const union MHD_ConnectionInfo *ci = MHD_get_connection_info(connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
         struct sockaddr_in *addr = (struct sockaddr_in *)ci->client_addr;
@@ -256,13 +1077,28 @@ static enum MHD_Result request_handler(void *cls, struct MHD_Connection *connect
 
     RequestContext *rc = *con_cls;
 
+    /* job status and cache counters are the only things read with GET */
+    int cache = strcmp(url, "/cache") == 0;
+    if (cache || strncmp(url, "/jobs/", 6) == 0) {
+        if (strcmp(method, "GET") != 0) {
+            log_print('v', L"Request rejected: Not a GET request.\n");
+            return queue_json(connection, MHD_HTTP_METHOD_NOT_ALLOWED,
+                              "{\"error\": \"GET requests only\"}", MHD_RESPMEM_PERSISTENT);
+        }
+        return cache ? queue_cache_counts(connection) : queue_job_status(connection, url + 6);
+    }
+
+    int new_job = strcmp(url, "/jobs") == 0;
+    if (rc->route == NULL && !new_job) {
+        log_print('v', L"Request rejected: Unknown URL.\n");
+        return queue_json(connection, MHD_HTTP_NOT_FOUND,
+                          "{\"error\": \"Not found\"}", MHD_RESPMEM_PERSISTENT);
+    }
+
     if (strcmp(method, "POST") != 0) {
         log_print('v', L"Request rejected: Not a POST request.\n");
-        const char *page = "{\"error\": \"POST requests only\"}";
-        struct MHD_Response *response = MHD_create_response_from_buffer(strlen(page), (void *)page, MHD_RESPMEM_PERSISTENT);
-        int ret = MHD_queue_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, response);
-        MHD_destroy_response(response);
-        return ret;
+        return queue_json(connection, MHD_HTTP_METHOD_NOT_ALLOWED,
+                          "{\"error\": \"POST requests only\"}", MHD_RESPMEM_PERSISTENT);
     }
 
     if (*upload_data_size != 0) {
@@ -280,18 +1116,31 @@ static enum MHD_Result request_handler(void *cls, struct MHD_Connection *connect
 
     if (rc->post_data == NULL) {
         log_print('v', L"ERROR: POST request received with no body.\n");
-        const char *page = "{\"error\": \"Empty POST body\"}";
-        struct MHD_Response *response = MHD_create_response_from_buffer(strlen(page), (void *)page, MHD_RESPMEM_PERSISTENT);
-        int ret = MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, response);
-        MHD_destroy_response(response);
-        return ret;
+        return queue_json(connection, MHD_HTTP_BAD_REQUEST,
+                          "{\"error\": \"Empty POST body\"}", MHD_RESPMEM_PERSISTENT);
+    }
+
+    if (new_job) {
+        return queue_new_job(connection, rc);
     }
 
-    log_print('v', L"POST data reception complete. Spawning analysis thread...\n");
-    pthread_create(&rc->thread_id, NULL, &analysis_thread, rc);
-    pthread_join(rc->thread_id, NULL);
+    if (!rc->dispatched) {
+        /*
+         * Hand the request to the worker pool and park the connection, the
+         * worker resumes it once the response is ready and this handler runs
+         * again. Suspend first so the resume can never come before it.
+         */
+        log_print('v', L"POST data reception complete. Dispatching to workers...\n");
+        rc->dispatched = 1;
+        rc->connection = connection;
+        const char *pretty = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "pretty");
+        rc->pretty = pretty != NULL && strcmp(pretty, "0") != 0;
+        MHD_suspend_connection(connection);
+        submit_job(&analyze_request, rc, 1, NULL);
+        return MHD_YES;
+    }
 
-    log_print('v', L"Thread finished. Sending response to client.\n");
+    log_print('v', L"Analysis finished. Sending response to client.\n");
 
     struct MHD_Response *response = MHD_create_response_from_buffer(
         strlen(rc->response_data), (void *)rc->response_data, MHD_RESPMEM_MUST_FREE);
@@ -312,13 +1161,7 @@ void request_completed(void *cls, struct MHD_Connection *connection,
 
     if (rc == NULL) return;
 
-    if (rc->post_data) {
-        free(rc->post_data);
-    }
-    if (rc->response_data) {
-        free(rc->response_data);
-    }
-    free(rc);
+    free_context(rc);
     *con_cls = NULL;
     log_print('v', L"Request context cleaned up.\n");
 }
@@ -332,9 +1175,15 @@ void start_server() {
 
     create_thread_pool();
 
+    /*
+     * A pool of polling threads (epoll where available) only handles I/O,
+     * the analysis itself runs on the worker pool while the connection is
+     * suspended.
+     */
     struct MHD_Daemon *daemon = MHD_start_daemon(
-        MHD_USE_SELECT_INTERNALLY, PORT, NULL, NULL,
+        MHD_USE_AUTO_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME, PORT, NULL, NULL,
         &request_handler, NULL,
+        MHD_OPTION_THREAD_POOL_SIZE, (unsigned int)pool_size(),
         MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
         MHD_OPTION_END
     );
@@ -352,7 +1201,12 @@ void start_server() {
 
     log_print('q', L"\nShutdown signal received. Stopping server...\n");
 
-    MHD_stop_daemon(daemon);
+    /* stop accepting, let in-flight requests resume, then close everything */
+    MHD_quiesce_daemon(daemon);
     destroy_thread_pool();
+    MHD_stop_daemon(daemon);
+    free_jobs();
+    free_weights_cache();
+    free_result_cache();
     log_print('q', L"Server stopped.\n");
 }
@@ -0,0 +1,309 @@
+/*
+ * optimize.c - Layout optimization.
+ *
+ * Implements multi-threaded simulated annealing over key swaps, scored
+ * incrementally with delta_analyze().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "optimize.h"
+#include "analyze.h"
+#include "api_util.h"
+#include "util.h"
+#include "pool.h"
+#include "result_cache.h"
+
+/* Iterations between checks of the clock and updates of the temperature. */
+#define SCHEDULE_INTERVAL 256
+
+/* Accepted swaps between full analyses, which clear accumulated float error. */
+#define RESYNC_INTERVAL 4096
+
+/* Returns a monotonic time in seconds. */
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Reads an optional number from a request object.
+ * Parameters:
+ *   request: The request object.
+ *   key: The key of the number.
+ *   min, max: The accepted range.
+ *   value: Set to the number if present.
+ * Returns: 0 if the number is present but invalid, 1 if present, 2 if absent.
+ */
+static int read_number(json_object *request, const char *key, double min, double max, double *value)
+{
+    json_object *j_value;
+    if (!json_object_object_get_ex(request, key, &j_value)) {return 2;}
+    if (!json_object_is_type(j_value, json_type_int) &&
+        !json_object_is_type(j_value, json_type_double)) {return 0;}
+    *value = json_object_get_double(j_value);
+    return *value >= min && *value <= max;
+}
+
+/*
+ * Parses an optimize request and analyzes its start layout. The time budget
+ * of each chain starts counting with its first slice.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+optimize_run *create_optimize_run(json_object *request, const char **message)
+{
+    json_object *j_layout_str, *j_weights, *j_pinned;
+    if (!json_object_object_get_ex(request, "layout", &j_layout_str) ||
+        !json_object_object_get_ex(request, "weights", &j_weights)) {
+        *message = "{\"error\": \"Invalid JSON payload: missing layout or weights.\"}";
+        return NULL;
+    }
+
+    optimize_run *run = calloc(1, sizeof(optimize_run));
+    if (!run) {error("Failed to allocate memory for optimize run.");}
+
+    run->compiled = acquire_weights(j_weights);
+    if (!run->compiled) {
+        free(run);
+        *message = "{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}";
+        return NULL;
+    }
+
+    if (json_object_object_get_ex(request, "pinned", &j_pinned)) {
+        int valid = json_object_is_type(j_pinned, json_type_array);
+        size_t length = valid ? json_object_array_length(j_pinned) : 0;
+        for (size_t i = 0; i < length && valid; i++) {
+            json_object *j_index = json_object_array_get_idx(j_pinned, i);
+            int index = json_object_get_int(j_index);
+            valid = json_object_is_type(j_index, json_type_int) && index >= 0 && index < 30;
+            if (valid) {run->pinned[index] = 1;}
+        }
+        if (!valid) {
+            release_weights(run->compiled);
+            free(run);
+            *message = "{\"error\": \"Invalid pinned keys: expected layout indices 0-29.\"}";
+            return NULL;
+        }
+    }
+
+    /* only an iteration budget runs to the time limit, only a time budget runs unbounded */
+    double iterations = 100000, seconds = MAX_OPTIMIZE_SECONDS;
+    /* leave half the workers to other requests by default */
+    double chains = pool_size() > 1 ? pool_size() / 2 : 1, top = 10, seed = (double)time(NULL);
+    double start_temperature = 1, end_temperature = 0.001;
+    int given_iterations = read_number(request, "iterations", 1, 1e9, &iterations);
+    int given_seconds = read_number(request, "time", 0, MAX_OPTIMIZE_SECONDS, &seconds);
+    if (given_seconds == 1 && given_iterations == 2) {iterations = 1e18;}
+    if (!given_iterations || !given_seconds ||
+        !read_number(request, "chains", 1, MAX_CHAINS, &chains) ||
+        !read_number(request, "top", 1, MAX_TOP, &top) ||
+        !read_number(request, "seed", 0, 9007199254740992.0, &seed) ||
+        !read_number(request, "start_temperature", 1e-9, 1e9, &start_temperature) ||
+        !read_number(request, "end_temperature", 1e-9, start_temperature, &end_temperature)) {
+        release_weights(run->compiled);
+        free(run);
+        *message = "{\"error\": \"Invalid optimize options.\"}";
+        return NULL;
+    }
+
+    alloc_layout(&run->start);
+    if (!parse_layout_from_string(run->start, json_object_get_string(j_layout_str))) {
+        free_layout(run->start);
+        release_weights(run->compiled);
+        free(run);
+        *message = "{\"error\": \"Invalid layout string.\"}";
+        return NULL;
+    }
+    strcpy(run->start->name, "api_layout");
+
+    run->iterations = (long)iterations;
+    /* without a time budget the limit only caps the run, cooling follows the iterations */
+    run->seconds = given_seconds == 1 ? seconds : 0;
+    run->start_temperature = start_temperature;
+    run->end_temperature = end_temperature;
+    run->seed = (uint64_t)seed;
+    run->top = (int)top;
+    run->chains = (int)chains;
+    run->states = calloc(run->chains, sizeof(anneal_state));
+    if (!run->states) {error("Failed to allocate memory for optimize run.");}
+
+    cached_analyze(run->start, run->compiled);
+    return run;
+}
+
+/* Returns the score of the last layout in a ranking, which must not be empty. */
+static float worst_score(layout_node *head)
+{
+    while (head->next) {head = head->next;}
+    return head->score;
+}
+
+/* Sets up a chain at the start layout, with its own generator and deadline. */
+static void start_chain(optimize_run *run, int chain, anneal_state *st)
+{
+    /* every chain gets its own generator, seeded apart from the others */
+    st->generator = (run->seed + 1) * 0x9E3779B97F4A7C15ULL + (uint64_t)chain * 0xD1B54A32D192ED03ULL;
+    if (!st->generator) {st->generator = 1;}
+
+    alloc_layout(&st->current);
+    alloc_layout(&st->candidate);
+    copy(st->current, run->start);
+    copy(st->candidate, run->start);
+
+    st->score = weighted_score(st->current, &run->compiled->weights);
+    rank_layout(&st->best, &st->ranked, run->top, st->current->matrix, st->score);
+    st->worst = st->score;
+    st->temperature = run->start_temperature;
+    st->deadline = now_seconds() + (run->seconds > 0 ? run->seconds : MAX_OPTIMIZE_SECONDS);
+}
+
+/*
+ * Runs the next time slice of an annealing chain, at most ANNEAL_SLICE_SECONDS
+ * long. Safe to call for different chains of the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   chain: The index of the chain, from 0 to run->chains - 1.
+ *
+ * Returns: 1 if the chain has used up its budget, 0 if it needs another slice.
+ */
+int anneal_chain(optimize_run *run, int chain)
+{
+    anneal_state *st = &run->states[chain];
+    if (st->finished) {return 1;}
+    if (!st->current) {start_chain(run, chain, st);}
+
+    int keys[30], free_keys = 0;
+    for (int i = 0; i < 30; i++) {
+        if (!run->pinned[i]) {keys[free_keys++] = i;}
+    }
+
+    double slice_end = now_seconds() + ANNEAL_SLICE_SECONDS;
+    layout *current = st->current, *candidate = st->candidate;
+    float score = st->score;
+    long i = st->iterations;
+    int out_of_time = 0;
+    for (; free_keys >= 2 && i < run->iterations; i++)
+    {
+        if (i % SCHEDULE_INTERVAL == 0)
+        {
+            double now = now_seconds();
+            double remaining = st->deadline - now;
+            if (remaining <= 0) {
+                out_of_time = 1;
+                break;
+            }
+            /* yield the worker, the chain picks up here in its next slice */
+            if (now >= slice_end && i > st->iterations) {break;}
+            /* cool geometrically along whichever budget is further used up */
+            double progress = (double)i / run->iterations;
+            if (run->seconds > 0 && 1 - remaining / run->seconds > progress) {
+                progress = 1 - remaining / run->seconds;
+            }
+            st->temperature = run->start_temperature *
+                powf(run->end_temperature / run->start_temperature, (float)progress);
+        }
+
+        int a = random_int(&st->generator, free_keys);
+        int b = random_int(&st->generator, free_keys - 1);
+        if (b >= a) {b++;}
+        a = keys[a];
+        b = keys[b];
+
+        memcpy(candidate->matrix, current->matrix, sizeof(current->matrix));
+        swap_keys(candidate, a, b);
+        int positions[2] = {key_position(a), key_position(b)};
+        delta_analyze(candidate, current, positions, 2, run->compiled->plan);
+        float next = weighted_score(candidate, &run->compiled->weights);
+
+        if (next < score && random_float(&st->generator) >= expf((next - score) / st->temperature)) {continue;}
+
+        layout *swap = current;
+        current = candidate;
+        candidate = swap;
+        score = next;
+        if (++st->accepted % RESYNC_INTERVAL == 0)
+        {
+            single_analyze(current, run->compiled->plan);
+            score = weighted_score(current, &run->compiled->weights);
+        }
+        if (st->ranked < run->top || score > st->worst)
+        {
+            rank_layout(&st->best, &st->ranked, run->top, current->matrix, score);
+            st->worst = worst_score(st->best);
+        }
+    }
+
+    st->current = current;
+    st->candidate = candidate;
+    st->score = score;
+    st->iterations = i;
+    if (out_of_time || free_keys < 2 || i >= run->iterations)
+    {
+        st->finished = 1;
+        free_layout(st->current);
+        free_layout(st->candidate);
+        st->current = st->candidate = NULL;
+    }
+    return st->finished;
+}
+
+/*
+ * Merges the rankings of all chains into the run's best distinct layouts,
+ * best first by their exact scores. The chain rankings are consumed.
+ *
+ * Parameters:
+ *   run: The run, after all of its chains have finished.
+ *
+ * Returns: The merged ranking, to be freed with free_ranking().
+ */
+layout_node *merge_rankings(optimize_run *run)
+{
+    layout_node *merged = NULL;
+    int length = 0;
+    layout *lt;
+    alloc_layout(&lt);
+    for (int c = 0; c < run->chains; c++)
+    {
+        /* rank by exact scores, chains only know theirs up to float error */
+        for (layout_node *node = run->states[c].best; node; node = node->next) {
+            memcpy(lt->matrix, node->matrix, sizeof(lt->matrix));
+            rank_layout(&merged, &length, run->top, node->matrix, tensor_score(run->compiled->tensors, lt));
+        }
+        free_ranking(run->states[c].best);
+        run->states[c].best = NULL;
+    }
+    free_layout(lt);
+    return merged;
+}
+
+/*
+ * Frees an optimize run and its start layout, and releases its weights.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_optimize_run(optimize_run *run)
+{
+    for (int c = 0; c < run->chains; c++)
+    {
+        anneal_state *st = &run->states[c];
+        free_ranking(st->best);
+        if (st->current) {free_layout(st->current);}
+        if (st->candidate) {free_layout(st->candidate);}
+    }
+    free(run->states);
+    free_layout(run->start);
+    release_weights(run->compiled);
+    free(run);
+}
@@ -0,0 +1,239 @@
+/*
+ * pool.c - Shared worker pool.
+ *
+ * Every unit of parallel work is a job with its own counters. Jobs wait in a
+ * single round-robin queue and workers claim small chunks of indices from the
+ * job at the head, moving it to the back afterwards, so concurrent requests
+ * interleave across all cores instead of racing on shared state.
+ */
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "util.h"
+
+/* Upper bound on the indices claimed at once, keeps large jobs interleaved. */
+#define MAX_CHUNK 64
+
+typedef struct job {
+    void (*run)(void *arg, size_t index);
+    void (*done)(void *arg);
+    void *arg;
+    size_t count;
+    size_t chunk;
+    size_t next;                /* guarded by the pool mutex */
+    atomic_size_t completed;
+    /* only used by run_job() to wake the submitting thread */
+    int finished;
+    /* set by submit_job(), the pool frees the job once it is done */
+    int detached;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct job *queue_next;
+} job;
+
+typedef struct {
+    pthread_t *threads;
+    int num_threads;
+    job *head;
+    job *tail;
+    int shutdown;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_cond;
+} ThreadPool;
+
+static ThreadPool *pool = NULL;
+
+/* Marks a job complete, waking its owner or handing it to its callback. */
+static void finish_job(job *j)
+{
+    if (j->detached) {
+        if (j->done) {j->done(j->arg);}
+        pthread_mutex_destroy(&j->mutex);
+        pthread_cond_destroy(&j->cond);
+        free(j);
+        return;
+    }
+    pthread_mutex_lock(&j->mutex);
+    j->finished = 1;
+    pthread_cond_signal(&j->cond);
+    pthread_mutex_unlock(&j->mutex);
+}
+
+static void *worker_thread(void *arg)
+{
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->head == NULL && !pool->shutdown) {
+            pthread_cond_wait(&pool->job_cond, &pool->mutex);
+        }
+        /* drain the queue before honouring a shutdown */
+        if (pool->head == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        job *j = pool->head;
+        size_t start = j->next;
+        size_t end = start + j->chunk < j->count ? start + j->chunk : j->count;
+        j->next = end;
+
+        /* drop exhausted jobs, otherwise rotate so other jobs get a turn */
+        pool->head = j->queue_next;
+        if (pool->head == NULL) {pool->tail = NULL;}
+        if (end < j->count) {
+            j->queue_next = NULL;
+            if (pool->tail) {pool->tail->queue_next = j;}
+            else {pool->head = j;}
+            pool->tail = j;
+        }
+        pthread_mutex_unlock(&pool->mutex);
+
+        size_t count = j->count;
+        for (size_t i = start; i < end; i++) {
+            j->run(j->arg, i);
+        }
+
+        /* the job may be freed by its owner as soon as the last chunk lands */
+        if (atomic_fetch_add(&j->completed, end - start) + (end - start) == count) {
+            finish_job(j);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Starts the shared worker pool, one thread per online processor. Does nothing
+ * if the pool is already running.
+ */
+void create_thread_pool()
+{
+    if (pool) return;
+
+    pool = calloc(1, sizeof(ThreadPool));
+    if (!pool) {
+        error("Failed to allocate memory for thread pool.");
+    }
+
+    pool->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (pool->num_threads < 1) {pool->num_threads = 1;}
+    pool->threads = calloc(pool->num_threads, sizeof(pthread_t));
+    if (!pool->threads) {
+        error("Failed to allocate memory for threads.");
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->job_cond, NULL);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_create(&pool->threads[i], NULL, &worker_thread, NULL);
+    }
+}
+
+/*
+ * Stops the worker pool. Jobs already queued are finished first, then all
+ * worker threads are joined.
+ */
+void destroy_thread_pool()
+{
+    if (!pool) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->job_cond);
+    free(pool);
+    pool = NULL;
+}
+
+/* Returns the number of worker threads in the pool. */
+int pool_size()
+{
+    return pool ? pool->num_threads : 1;
+}
+
+/* Allocates a job and appends it to the queue. */
+static job *enqueue_job(void (*run)(void *arg, size_t index), void *arg,
+    size_t count, void (*done)(void *arg), int detached)
+{
+    job *j = calloc(1, sizeof(job));
+    if (!j) {
+        error("Failed to allocate memory for job.");
+    }
+    j->run = run;
+    j->done = done;
+    j->detached = detached;
+    j->arg = arg;
+    j->count = count;
+    /* aim for several chunks per worker so load stays balanced */
+    j->chunk = count / (pool->num_threads * 8);
+    if (j->chunk < 1) {j->chunk = 1;}
+    if (j->chunk > MAX_CHUNK) {j->chunk = MAX_CHUNK;}
+    atomic_init(&j->completed, 0);
+    pthread_mutex_init(&j->mutex, NULL);
+    pthread_cond_init(&j->cond, NULL);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->tail) {pool->tail->queue_next = j;}
+    else {pool->head = j;}
+    pool->tail = j;
+    pthread_cond_broadcast(&pool->job_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return j;
+}
+
+/*
+ * Runs a job on the worker pool and blocks until it is done. The job calls
+ * run(arg, i) once for every i in [0, count), in chunks spread over all
+ * workers and interleaved with any other jobs in the queue.
+ * Must not be called from inside a worker thread.
+ */
+void run_job(void (*run)(void *arg, size_t index), void *arg, size_t count)
+{
+    if (count == 0) return;
+    if (!pool) {
+        for (size_t i = 0; i < count; i++) {run(arg, i);}
+        return;
+    }
+
+    job *j = enqueue_job(run, arg, count, NULL, 0);
+
+    pthread_mutex_lock(&j->mutex);
+    while (!j->finished) {
+        pthread_cond_wait(&j->cond, &j->mutex);
+    }
+    pthread_mutex_unlock(&j->mutex);
+
+    pthread_mutex_destroy(&j->mutex);
+    pthread_cond_destroy(&j->cond);
+    free(j);
+}
+
+/*
+ * Queues a job on the worker pool without waiting for it. Once run(arg, i)
+ * has returned for every i in [0, count), done(arg) is called on the worker
+ * that finished last. Safe to call from inside a worker thread.
+ */
+void submit_job(void (*run)(void *arg, size_t index), void *arg, size_t count,
+    void (*done)(void *arg))
+{
+    /* without a pool (e.g. during shutdown) the work runs right here */
+    if (count == 0 || !pool) {
+        for (size_t i = 0; i < count; i++) {run(arg, i);}
+        if (done) {done(arg);}
+        return;
+    }
+    enqueue_job(run, arg, count, done, 1);
+}
@@ -0,0 +1,261 @@
+/*
+ * result_cache.c - Layout result cache.
+ *
+ * Implements a sharded LRU cache of the weighted stat values of analyzed
+ * layouts. A result is keyed by the layout's key grid and the compilation of
+ * its weights; the corpus is fixed for the life of the server, so results
+ * never outlive it. Each shard has its own lock, so lookups of different
+ * layouts rarely wait on each other. The cache keeps result_cache_size
+ * results in all, split evenly over the shards.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "result_cache.h"
+#include "analyze.h"
+#include "api_util.h"
+#include "util.h"
+
+/* The stat values of one analyzed layout, in the order of its weights. */
+typedef struct result_entry {
+    uint64_t hash;
+    uint64_t weights_id;
+    /* the key grid, row by row, with 255 for empty keys */
+    unsigned char grid[dim1];
+    struct result_entry *chain;
+    struct result_entry *newer;
+    struct result_entry *older;
+    int length;
+    float values[];
+} result_entry;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    /* a power of two at least as many as the results kept, indexed by hash */
+    result_entry **buckets;
+    /* the cached results from most to least recently used */
+    result_entry *newest;
+    result_entry *oldest;
+    long count;
+    long hits;
+    long misses;
+} result_shard;
+
+static result_shard shards[RESULT_CACHE_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+/* Results kept per shard before the least recently used is dropped, and its bucket mask. */
+static long shard_size;
+static size_t bucket_mask;
+
+static void init_shards()
+{
+    shard_size = (result_cache_size + RESULT_CACHE_SHARDS - 1) / RESULT_CACHE_SHARDS;
+    size_t buckets = 1;
+    while (buckets < (size_t)shard_size) {buckets *= 2;}
+    bucket_mask = buckets - 1;
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++)
+    {
+        pthread_mutex_init(&shards[s].mutex, NULL);
+        shards[s].buckets = calloc(buckets, sizeof(result_entry *));
+        if (!shards[s].buckets) {error("Failed to allocate memory for result cache.");}
+    }
+}
+
+/* Returns the cached result of a key in a shard, NULL if there is none. Needs the shard's lock. */
+static result_entry *find_entry(result_shard *shard, uint64_t hash, uint64_t weights_id,
+                                const unsigned char *grid)
+{
+    for (result_entry *e = shard->buckets[hash & bucket_mask]; e; e = e->chain)
+    {
+        if (e->hash == hash && e->weights_id == weights_id && !memcmp(e->grid, grid, DIM1)) {return e;}
+    }
+    return NULL;
+}
+
+/* Writes the key grid of a layout and returns its hash with the weights' id. */
+static uint64_t grid_hash(layout *lt, uint64_t weights_id, unsigned char *grid)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL ^ weights_id * 0x9E3779B97F4A7C15ULL;
+    for (int p = 0; p < DIM1; p++)
+    {
+        int ch = lt->matrix[p / COL][p % COL];
+        grid[p] = ch != -1 ? ch : 255;
+        hash = (hash ^ grid[p]) * 0x100000001B3ULL;
+    }
+    /* FNV mixes its high bits poorly, fold them before picking shards by them */
+    return hash ^ hash >> 29;
+}
+
+static void unlink_recency(result_shard *shard, result_entry *e)
+{
+    if (e->newer) {e->newer->older = e->older;} else {shard->newest = e->older;}
+    if (e->older) {e->older->newer = e->newer;} else {shard->oldest = e->newer;}
+    e->newer = e->older = NULL;
+}
+
+static void push_newest(result_shard *shard, result_entry *e)
+{
+    e->older = shard->newest;
+    if (shard->newest) {shard->newest->newer = e;} else {shard->oldest = e;}
+    shard->newest = e;
+}
+
+/* Removes the least recently used result of a shard and returns it. */
+static result_entry *evict_oldest(result_shard *shard)
+{
+    result_entry *e = shard->oldest;
+    unlink_recency(shard, e);
+    result_entry **link = &shard->buckets[e->hash & bucket_mask];
+    while (*link != e) {link = &(*link)->chain;}
+    *link = e->chain;
+    shard->count--;
+    return e;
+}
+
+/*
+ * Restores the weighted stats of a layout from an earlier analysis of the
+ * same layout with the same compiled weights, if the cache holds one. Counts
+ * a hit or a miss. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The layout.
+ *   cw: The compiled weights.
+ *   exact: Nonzero for the results of exact_analyze(), which are kept apart.
+ *
+ * Returns: 1 if the stats were restored, 0 if the layout must be analyzed.
+ */
+int restore_result(layout *lt, compiled_weights *cw, int exact)
+{
+    pthread_once(&shards_once, &init_shards);
+    unsigned char grid[dim1];
+    uint64_t weights_id = cw->id << 1 | (exact != 0);
+    uint64_t hash = grid_hash(lt, weights_id, grid);
+    result_shard *shard = &shards[hash >> 60 & (RESULT_CACHE_SHARDS - 1)];
+    CustomWeights *weights = &cw->weights;
+
+    pthread_mutex_lock(&shard->mutex);
+    result_entry *e = find_entry(shard, hash, weights_id, grid);
+    if (e)
+    {
+        for (int i = 0; i < e->length; i++) {
+            set_stat_value(lt, weights->types[i], weights->indices[i], e->values[i]);
+        }
+        unlink_recency(shard, e);
+        push_newest(shard, e);
+        shard->hits++;
+        pthread_mutex_unlock(&shard->mutex);
+        return 1;
+    }
+    shard->misses++;
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+}
+
+/*
+ * Caches the weighted stats of a layout just analyzed with the plan of some
+ * compiled weights. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The analyzed layout.
+ *   cw: The compiled weights.
+ *   exact: Nonzero if the layout was analyzed with exact_analyze().
+ */
+void store_result(layout *lt, compiled_weights *cw, int exact)
+{
+    pthread_once(&shards_once, &init_shards);
+    unsigned char grid[dim1];
+    uint64_t weights_id = cw->id << 1 | (exact != 0);
+    uint64_t hash = grid_hash(lt, weights_id, grid);
+    result_shard *shard = &shards[hash >> 60 & (RESULT_CACHE_SHARDS - 1)];
+    CustomWeights *weights = &cw->weights;
+
+    result_entry *e = malloc(sizeof(result_entry) + weights->length * sizeof(float));
+    if (!e) {error("Failed to allocate memory for result cache.");}
+    e->hash = hash;
+    e->weights_id = weights_id;
+    memcpy(e->grid, grid, DIM1);
+    e->newer = e->older = NULL;
+    e->length = weights->length;
+    for (int i = 0; i < e->length; i++) {
+        e->values[i] = stat_value(lt, weights->types[i], weights->indices[i]);
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    /* a racing analysis of the same layout may have stored it already, keep that one */
+    result_entry *evicted = find_entry(shard, hash, weights_id, grid);
+    if (evicted)
+    {
+        unlink_recency(shard, evicted);
+        push_newest(shard, evicted);
+        evicted = e;
+    }
+    else
+    {
+        result_entry **bucket = &shard->buckets[hash & bucket_mask];
+        e->chain = *bucket;
+        *bucket = e;
+        push_newest(shard, e);
+        if (++shard->count > shard_size) {evicted = evict_oldest(shard);}
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    free(evicted);
+}
+
+/*
+ * Analyzes a layout for the stats of a weight set, or restores those stats
+ * from an earlier analysis of the same layout with the same compiled weights.
+ * Only the weighted stats of the layout are valid afterwards, as after
+ * single_analyze() with the weights' plan. Safe to call from any thread.
+ *
+ * Parameters:
+ *   lt: The layout to analyze.
+ *   cw: The compiled weights.
+ */
+void cached_analyze(layout *lt, compiled_weights *cw)
+{
+    /* analyze without any lock held */
+    if (restore_result(lt, cw, 0)) {return;}
+    single_analyze(lt, cw->plan);
+    store_result(lt, cw, 0);
+}
+
+/*
+ * Reads the counters of the cache.
+ *
+ * Parameters:
+ *   hits, misses: Set to the analyses restored from the cache and those that
+ *                 ran, since the server started.
+ *   entries: Set to the number of results cached.
+ *   capacity: Set to the number of results the cache keeps at most.
+ */
+void result_cache_counts(long *hits, long *misses, long *entries, long *capacity)
+{
+    pthread_once(&shards_once, &init_shards);
+    *capacity = shard_size * RESULT_CACHE_SHARDS;
+    *hits = *misses = *entries = 0;
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++)
+    {
+        pthread_mutex_lock(&shards[s].mutex);
+        *hits += shards[s].hits;
+        *misses += shards[s].misses;
+        *entries += shards[s].count;
+        pthread_mutex_unlock(&shards[s].mutex);
+    }
+}
+
+/* Frees every cached result. */
+void free_result_cache()
+{
+    pthread_once(&shards_once, &init_shards);
+    for (int s = 0; s < RESULT_CACHE_SHARDS; s++)
+    {
+        pthread_mutex_lock(&shards[s].mutex);
+        while (shards[s].oldest) {free(evict_oldest(&shards[s]));}
+        free(shards[s].buckets);
+        shards[s].buckets = NULL;
+        pthread_mutex_unlock(&shards[s].mutex);
+    }
+}
@@ -0,0 +1,669 @@
+/*
+ * search.c - Exhaustive placement search.
+ *
+ * Implements a parallel branch-and-bound search over the placements of a few
+ * free keys, scoring partial placements incrementally from the linear_*
+ * frequency tables.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "search.h"
+#include "analyze.h"
+#include "api_util.h"
+#include "util.h"
+#include "stats.h"
+#include "result_cache.h"
+
+/* Shorthand for the table dimensions, which all use the maximum key count. */
+#define K MAX_SEARCH_KEYS
+
+/*
+ * Relative slack on the pruning threshold. Incremental scores sum the same
+ * terms as tensor_score() in another order, so a placement within float error
+ * of the top layouts is kept and decided by its exact score.
+ */
+#define SEARCH_SLACK 1e-5f
+
+/* Placements tried between checks of the clock. */
+#define CLOCK_INTERVAL 1024
+
+/* Returns a monotonic time in seconds. */
+static double now_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * A weighted stat member that touches free keys. Its score is weight *
+ * table[offset + sum of stride[j] * character at depth[j]], where offset
+ * already holds the pinned characters of the member, depths are ascending,
+ * and a key the member touches twice has its strides summed.
+ */
+typedef struct search_term {
+    float weight;
+    const float *table;
+    int offset;
+    int free;
+    int depth[4];
+    int stride[4];
+} search_term;
+
+/* State of building the scoring tables of a run, see collect_members(). */
+typedef struct {
+    /* search depth of each flat key position, -1 if the key is pinned */
+    int depth_of[dim1];
+    /* character on each flat key position of the start layout */
+    int chars[dim1];
+    /* first pass: how many members touch each depth */
+    int touches[K];
+    /* second pass: set once the tables are being filled */
+    int filling;
+    /* members touching three or more free keys, unsorted */
+    search_term *terms;
+    int length;
+    int capacity;
+} term_builder;
+
+/* Returns the score of a term with the character slots given per depth. */
+static float term_score(search_run *run, const search_term *term, const int *slot)
+{
+    int index = term->offset;
+    for (int j = 0; j < term->free; j++) {index += term->stride[j] * run->chars[slot[term->depth[j]]];}
+    return term->weight * term->table[index];
+}
+
+/* Returns the upper bound of a term's score over any characters of the run. */
+static float term_bound(search_run *run, const search_term *term)
+{
+    /* characters may repeat here, a superset of the placements keeps it admissible */
+    float best = -INFINITY;
+    int slot[K] = {0};
+    for (;;)
+    {
+        float score = term_score(run, term, slot);
+        if (score > best) {best = score;}
+
+        int j = 0;
+        while (j < term->free && ++slot[term->depth[j]] == run->keys) {slot[term->depth[j++]] = 0;}
+        if (j == term->free) {return best;}
+    }
+}
+
+/*
+ * Adds one weighted member to the run: to the constant if it touches no free
+ * key, otherwise to the touch counts on the first pass, and to the unary or
+ * pair tables or the terms on the second.
+ */
+static void add_member(search_run *run, term_builder *b, float weight, const float *table,
+                       const unsigned char *pos, int n)
+{
+    search_term term = {weight, table, 0, 0, {0}, {0}};
+    int stride = 1;
+    for (int j = n - 1; j >= 0; j--, stride *= LANG_LENGTH)
+    {
+        int depth = b->depth_of[pos[j]];
+        if (depth < 0) {
+            term.offset += stride * b->chars[pos[j]];
+            continue;
+        }
+        int k = 0;
+        while (k < term.free && term.depth[k] < depth) {k++;}
+        if (k == term.free || term.depth[k] != depth) {
+            memmove(&term.depth[k + 1], &term.depth[k], (term.free - k) * sizeof(int));
+            memmove(&term.stride[k + 1], &term.stride[k], (term.free - k) * sizeof(int));
+            term.depth[k] = depth;
+            term.stride[k] = 0;
+            term.free++;
+        }
+        term.stride[k] += stride;
+    }
+
+    if (!term.free) {
+        if (b->filling) {run->constant += weight * table[term.offset];}
+        return;
+    }
+    if (!b->filling) {
+        for (int j = 0; j < term.free; j++) {b->touches[term.depth[j]]++;}
+        return;
+    }
+
+    int slot[K] = {0};
+    if (term.free == 1)
+    {
+        int d = term.depth[0];
+        for (slot[d] = 0; slot[d] < run->keys; slot[d]++) {
+            run->unary[d][slot[d]] += term_score(run, &term, slot);
+        }
+    }
+    else if (term.free == 2)
+    {
+        int d = term.depth[0], e = term.depth[1];
+        for (slot[d] = 0; slot[d] < run->keys; slot[d]++) {
+            for (slot[e] = 0; slot[e] < run->keys; slot[e]++) {
+                run->pair[((d * K + e) * K + slot[d]) * K + slot[e]] += term_score(run, &term, slot);
+            }
+        }
+    }
+    else
+    {
+        if (b->length == b->capacity) {
+            b->capacity = b->capacity ? b->capacity * 2 : 1024;
+            b->terms = realloc(b->terms, b->capacity * sizeof(search_term));
+            if (!b->terms) {error("Failed to allocate memory for search terms.");}
+        }
+        b->terms[b->length++] = term;
+    }
+}
+
+/* Passes every weighted position tuple of the compiled weights to add_member(). */
+static void collect_members(search_run *run, term_builder *b)
+{
+    weight_tensors *t = run->compiled->tensors;
+    for (int p = 0; p < DIM1; p++)
+    {
+        unsigned char pos = p;
+        if (t->mono[p] != 0) {add_member(run, b, t->mono[p], linear_mono, &pos, 1);}
+    }
+    for (int i = 0; i < t->pair_length; i++) {
+        add_member(run, b, t->pairs[i].weight, t->pairs[i].table, t->pairs[i].pos, 2);
+    }
+    for (int i = 0; i < t->triple_length; i++) {
+        add_member(run, b, t->triples[i].weight, t->triples[i].table, t->triples[i].pos, 3);
+    }
+    for (int i = 0; i < t->quad_length; i++) {
+        add_member(run, b, t->quads[i].weight, t->quads[i].table, t->quads[i].pos, 4);
+    }
+}
+
+/*
+ * Orders the free keys, most touched first so that members complete early,
+ * then fills the scoring tables, sorts the remaining terms by the depth that
+ * leaves them one free key, and sums the static bounds left after each depth.
+ */
+static void prepare_terms(search_run *run)
+{
+    term_builder *b = calloc(1, sizeof(term_builder));
+    if (!b) {error("Failed to allocate memory for search terms.");}
+    for (int p = 0; p < DIM1; p++)
+    {
+        b->depth_of[p] = -1;
+        int ch = run->start->matrix[p / COL][p % COL];
+        b->chars[p] = ch != -1 ? ch : 0;
+    }
+
+    for (int d = 0; d < run->keys; d++) {b->depth_of[key_position(run->index[d])] = d;}
+    collect_members(run, b);
+    for (int d = 1; d < run->keys; d++)
+    {
+        for (int e = d; e > 0 && b->touches[e] > b->touches[e - 1]; e--)
+        {
+            int t = b->touches[e]; b->touches[e] = b->touches[e - 1]; b->touches[e - 1] = t;
+            t = run->index[e]; run->index[e] = run->index[e - 1]; run->index[e - 1] = t;
+        }
+    }
+    for (int d = 0; d < run->keys; d++)
+    {
+        b->depth_of[key_position(run->index[d])] = d;
+        run->chars[d] = b->chars[key_position(run->index[d])];
+    }
+
+    run->pair = calloc(K * K * K * K, sizeof(float));
+    if (!run->pair) {error("Failed to allocate memory for search terms.");}
+    b->filling = 1;
+    collect_members(run, b);
+
+    /* pairs between keys that are both still free only count at their best */
+    float bound[K] = {0};
+    for (int d = 0; d < run->keys; d++)
+    {
+        for (int e = d + 1; e < run->keys; e++)
+        {
+            const float *table = run->pair + (d * K + e) * K * K;
+            float best = -INFINITY;
+            for (int c = 0; c < run->keys; c++) {
+                for (int x = 0; x < run->keys; x++) {
+                    if (c != x && table[c * K + x] > best) {best = table[c * K + x];}
+                }
+            }
+            run->pair_max[d][e] = best;
+        }
+    }
+
+    /* counting sort of the terms by the depth that leaves one of their keys free */
+    int count[K + 1] = {0};
+    for (int t = 0; t < b->length; t++) {count[b->terms[t].depth[b->terms[t].free - 2] + 1]++;}
+    for (int d = 0; d < run->keys; d++) {count[d + 1] += count[d];}
+    memcpy(run->term_start, count, sizeof(run->term_start));
+
+    run->terms = malloc((b->length + 1) * sizeof(search_term));
+    if (!run->terms) {error("Failed to allocate memory for search terms.");}
+    for (int t = 0; t < b->length; t++)
+    {
+        int d = b->terms[t].depth[b->terms[t].free - 2];
+        run->terms[count[d]++] = b->terms[t];
+        bound[d] += term_bound(run, &b->terms[t]);
+    }
+
+    /* after depth d: the terms down to one free key deeper, and the pairs of deeper keys */
+    for (int d = run->keys - 1; d >= 0; d--)
+    {
+        if (d + 1 == run->keys) {continue;}
+        run->rest[d] = run->rest[d + 1] + bound[d + 1];
+        for (int f = d + 2; f < run->keys; f++) {run->rest[d] += run->pair_max[d + 1][f];}
+    }
+
+    free(b->terms);
+    free(b);
+}
+
+/*
+ * Parses a search request, analyzes its start layout and prepares the scoring
+ * terms and bounds of the free keys.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+search_run *create_search_run(json_object *request, const char **message)
+{
+    json_object *j_layout_str, *j_weights, *j_free, *j_top, *j_time;
+    if (!json_object_object_get_ex(request, "layout", &j_layout_str) ||
+        !json_object_object_get_ex(request, "weights", &j_weights) ||
+        !json_object_object_get_ex(request, "free", &j_free)) {
+        *message = "{\"error\": \"Invalid JSON payload: missing layout, weights or free.\"}";
+        return NULL;
+    }
+
+    search_run *run = calloc(1, sizeof(search_run));
+    if (!run) {error("Failed to allocate memory for search run.");}
+
+    run->compiled = acquire_weights(j_weights);
+    if (!run->compiled) {
+        free(run);
+        *message = "{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}";
+        return NULL;
+    }
+
+    int valid = json_object_is_type(j_free, json_type_array);
+    size_t length = valid ? json_object_array_length(j_free) : 0;
+    valid = valid && length >= 2 && length <= MAX_SEARCH_KEYS;
+    int seen[30] = {0};
+    for (size_t i = 0; i < length && valid; i++)
+    {
+        json_object *j_index = json_object_array_get_idx(j_free, i);
+        int index = json_object_get_int(j_index);
+        valid = json_object_is_type(j_index, json_type_int) && index >= 0 && index < 30 && !seen[index];
+        if (valid) {
+            seen[index] = 1;
+            run->index[run->keys++] = index;
+        }
+    }
+    if (!valid) {
+        release_weights(run->compiled);
+        free(run);
+        *message = "{\"error\": \"Invalid free keys: expected 2 to 12 distinct layout indices 0-29.\"}";
+        return NULL;
+    }
+
+    run->top = 10;
+    if (json_object_object_get_ex(request, "top", &j_top))
+    {
+        run->top = json_object_get_int(j_top);
+        if (!json_object_is_type(j_top, json_type_int) || run->top < 1 || run->top > MAX_SEARCH_TOP) {
+            release_weights(run->compiled);
+            free(run);
+            *message = "{\"error\": \"Invalid top: expected 1 to 100.\"}";
+            return NULL;
+        }
+    }
+
+    run->seconds = DEFAULT_SEARCH_SECONDS;
+    if (json_object_object_get_ex(request, "time", &j_time))
+    {
+        run->seconds = json_object_get_double(j_time);
+        if ((!json_object_is_type(j_time, json_type_int) && !json_object_is_type(j_time, json_type_double)) ||
+            !(run->seconds > 0 && run->seconds <= MAX_SEARCH_SECONDS)) {
+            release_weights(run->compiled);
+            free(run);
+            *message = "{\"error\": \"Invalid time: expected more than 0 and at most 600 seconds.\"}";
+            return NULL;
+        }
+    }
+
+    alloc_layout(&run->start);
+    if (!parse_layout_from_string(run->start, json_object_get_string(j_layout_str))) {
+        free_layout(run->start);
+        release_weights(run->compiled);
+        free(run);
+        *message = "{\"error\": \"Invalid layout string.\"}";
+        return NULL;
+    }
+    strcpy(run->start->name, "api_layout");
+
+    cached_analyze(run->start, run->compiled);
+    prepare_terms(run);
+    pthread_mutex_init(&run->mutex, NULL);
+    atomic_init(&run->threshold, -INFINITY);
+    atomic_init(&run->nodes, 0);
+    atomic_init(&run->deadline, 0);
+    atomic_init(&run->incomplete, 0);
+    run->subtrees = calloc(search_subtrees(run), sizeof(struct subtree_search *));
+    run->finished = calloc(search_subtrees(run), 1);
+    if (!run->subtrees || !run->finished) {error("Failed to allocate memory for search run.");}
+    return run;
+}
+
+/*
+ * Returns the number of subtrees of a search, one per choice of characters
+ * on the first two free keys.
+ */
+size_t search_subtrees(search_run *run)
+{
+    return (size_t)run->keys * (run->keys - 1);
+}
+
+/* State of the search of one subtree, kept between its slices. */
+typedef struct subtree_search {
+    search_run *run;
+    /* character slot placed at each depth, and the slots in use */
+    int slot[K];
+    int used;
+    /* the depth being placed, the next slot to try and the score so far at each depth */
+    int depth;
+    int next[K];
+    float score[K];
+    /*
+     * partial[d][e][c]: the score of depth e holding slot c with the members
+     * it shares with depths 0 to d - 1 as placed, kept for every e >= d.
+     */
+    float partial[K + 1][K][K];
+    layout_node *best;
+    int ranked;
+    /* the score to beat, less the slack */
+    float threshold;
+    long nodes;
+    /* scratch layout for exact scores of complete placements */
+    layout *lt;
+} subtree_search;
+
+/* Returns the run's deadline, starting its time budget on the first call. */
+static double search_deadline(search_run *run)
+{
+    double deadline = atomic_load(&run->deadline);
+    if (deadline == 0)
+    {
+        double mine = now_seconds() + run->seconds;
+        /* the first subtree to start wins, the others take its deadline */
+        if (atomic_compare_exchange_strong(&run->deadline, &deadline, mine)) {deadline = mine;}
+    }
+    return deadline;
+}
+
+/* Raises a subtree's threshold to a score of its top layouts or the run's. */
+static void raise_threshold(subtree_search *s, float score)
+{
+    score -= SEARCH_SLACK * (fabsf(score) + 1);
+    if (score > s->threshold) {s->threshold = score;}
+}
+
+/*
+ * Places slot c on depth d: returns the score it adds and fills partial[d + 1]
+ * for the deeper keys, including the terms left with one free key.
+ */
+static float place(subtree_search *s, int d, int c)
+{
+    search_run *run = s->run;
+    s->slot[d] = c;
+    for (int e = d + 1; e < run->keys; e++)
+    {
+        const float *pair = run->pair + ((d * K + e) * K + c) * K;
+        for (int x = 0; x < run->keys; x++) {s->partial[d + 1][e][x] = s->partial[d][e][x] + pair[x];}
+    }
+    for (int t = run->term_start[d]; t < run->term_start[d + 1]; t++)
+    {
+        const search_term *term = &run->terms[t];
+        int last = term->free - 1, e = term->depth[last];
+        const float *table = term->table + term->offset;
+        for (int j = 0; j < last; j++) {table += term->stride[j] * run->chars[s->slot[term->depth[j]]];}
+        for (int x = 0; x < run->keys; x++) {
+            s->partial[d + 1][e][x] += term->weight * table[term->stride[last] * run->chars[x]];
+        }
+    }
+    return s->partial[d][d][c];
+}
+
+/* Returns the best case of the keys deeper than d, over the slots still free. */
+static float bound(subtree_search *s, int d)
+{
+    search_run *run = s->run;
+    float total = run->rest[d];
+    for (int e = d + 1; e < run->keys; e++)
+    {
+        float best = -INFINITY;
+        for (int x = 0; x < run->keys; x++) {
+            if (!(s->used & (1 << x)) && s->partial[d + 1][e][x] > best) {best = s->partial[d + 1][e][x];}
+        }
+        total += best;
+    }
+    return total;
+}
+
+/* Ranks a complete placement among the subtree's top layouts by its exact score. */
+static void rank_placement(subtree_search *s)
+{
+    search_run *run = s->run;
+    memcpy(s->lt->matrix, run->start->matrix, sizeof(s->lt->matrix));
+    for (int d = 0; d < run->keys; d++)
+    {
+        int p = key_position(run->index[d]);
+        s->lt->matrix[p / COL][p % COL] = run->chars[s->slot[d]];
+    }
+    rank_layout(&s->best, &s->ranked, run->top, s->lt->matrix, tensor_score(run->compiled->tensors, s->lt));
+    if (s->ranked == run->top)
+    {
+        layout_node *node = s->best;
+        while (node->next) {node = node->next;}
+        raise_threshold(s, node->score);
+    }
+}
+
+/*
+ * Places every free slot on the depths from s->depth on, depth first, until
+ * the subtree is exhausted or the clock passes slice_end. The stack of slots
+ * lives in s, so a later call picks up where this one stopped.
+ *
+ * Returns: 1 if the subtree is exhausted, 0 if it stopped for the clock.
+ */
+static int search_depths(subtree_search *s, double slice_end)
+{
+    search_run *run = s->run;
+    int d = s->depth;
+    long checked = 0;
+    while (d >= 2)
+    {
+        if (++checked % CLOCK_INTERVAL == 0 && now_seconds() >= slice_end)
+        {
+            s->depth = d;
+            return 0;
+        }
+
+        int c = s->next[d]++;
+        if (c == run->keys)
+        {
+            /* every slot was tried here, free the one placed on the depth above */
+            if (--d >= 2) {s->used &= ~(1 << s->slot[d]);}
+            continue;
+        }
+        if (s->used & (1 << c)) {continue;}
+        s->nodes++;
+        float next = s->score[d] + place(s, d, c);
+        if (d == run->keys - 1)
+        {
+            if (next > s->threshold) {rank_placement(s);}
+            continue;
+        }
+
+        /* the best case of everything left must beat the top layouts so far */
+        raise_threshold(s, atomic_load_explicit(&run->threshold, memory_order_relaxed));
+        s->used |= 1 << c;
+        if (next + bound(s, d) > s->threshold)
+        {
+            d++;
+            s->score[d] = next;
+            s->next[d] = 0;
+        }
+        else
+        {
+            s->used &= ~(1 << c);
+        }
+    }
+    s->depth = d;
+    return 1;
+}
+
+/* Starts the search of a subtree by placing its first two keys. */
+static subtree_search *start_subtree(search_run *run, size_t subtree)
+{
+    subtree_search *s = malloc(sizeof(subtree_search));
+    if (!s) {error("Failed to allocate memory for search.");}
+    s->run = run;
+    s->best = NULL;
+    s->ranked = 0;
+    s->threshold = -INFINITY;
+    raise_threshold(s, atomic_load(&run->threshold));
+    alloc_layout(&s->lt);
+    memcpy(s->partial[0], run->unary, sizeof(run->unary));
+
+    int a = subtree / (run->keys - 1), b = subtree % (run->keys - 1);
+    if (b >= a) {b++;}
+    s->used = (1 << a) | (1 << b);
+    s->nodes = 2;
+    float score = run->constant + place(s, 0, a) + place(s, 1, b);
+    /* nothing is left to place below depth 2 unless the first keys can still win */
+    s->depth = 1;
+    if (run->keys == 2) {
+        rank_placement(s);
+    } else if (score + bound(s, 1) > s->threshold) {
+        s->depth = 2;
+        s->score[2] = score;
+        s->next[2] = 0;
+    }
+    return s;
+}
+
+/* Merges a subtree's best layouts so far into the run's, raising its threshold. */
+static void share_best(search_run *run, subtree_search *s)
+{
+    pthread_mutex_lock(&run->mutex);
+    for (layout_node *node = s->best; node; node = node->next) {
+        rank_layout(&run->best, &run->ranked, run->top, node->matrix, node->score);
+    }
+    if (run->ranked == run->top)
+    {
+        layout_node *node = run->best;
+        while (node->next) {node = node->next;}
+        atomic_store(&run->threshold, node->score);
+    }
+    pthread_mutex_unlock(&run->mutex);
+}
+
+/* Merges a finished subtree's best layouts into the run's and frees it. */
+static void finish_subtree(search_run *run, subtree_search *s)
+{
+    share_best(run, s);
+    free_ranking(s->best);
+    free_layout(s->lt);
+    free(s);
+}
+
+/*
+ * Searches the next time slice of a subtree, at most SEARCH_SLICE_SECONDS
+ * long. Once the subtree is exhausted or the run is out of time, its best
+ * layouts are merged into the run's. Safe to call for different subtrees of
+ * the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   subtree: The index of the subtree, below search_subtrees(run).
+ *
+ * Returns: 1 if the subtree is done, 0 if it needs another slice.
+ */
+int search_subtree(search_run *run, size_t subtree)
+{
+    if (run->finished[subtree]) {return 1;}
+    double now = now_seconds();
+    double deadline = search_deadline(run);
+    subtree_search *s = run->subtrees[subtree];
+
+    int done = now >= deadline;
+    if (!done)
+    {
+        if (!s) {s = run->subtrees[subtree] = start_subtree(run, subtree);}
+        double slice_end = now + SEARCH_SLICE_SECONDS;
+        done = search_depths(s, slice_end < deadline ? slice_end : deadline);
+        if (!done && now_seconds() >= deadline) {done = 1;}
+        atomic_fetch_add(&run->nodes, s->nodes);
+        s->nodes = 0;
+    }
+    if (!done)
+    {
+        /* the other subtrees prune with these layouts before this one is done */
+        share_best(run, s);
+        return 0;
+    }
+
+    /* a subtree cut short by the deadline leaves the search incomplete */
+    if (!s || s->depth >= 2) {atomic_store(&run->incomplete, 1);}
+    if (s) {finish_subtree(run, s);}
+    run->subtrees[subtree] = NULL;
+    run->finished[subtree] = 1;
+    return 1;
+}
+
+/*
+ * Returns the run's best layouts, best first by their exact scores. The run
+ * gives up the ranking.
+ *
+ * Parameters:
+ *   run: The run, after all of its subtrees have been searched.
+ *
+ * Returns: The ranking, to be freed with free_ranking().
+ */
+layout_node *search_results(search_run *run)
+{
+    /* complete placements were ranked by their exact scores already */
+    layout_node *ranking = run->best;
+    run->best = NULL;
+    run->ranked = 0;
+    return ranking;
+}
+
+/*
+ * Frees a search run and its start layout, and releases its weights.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_search_run(search_run *run)
+{
+    for (size_t i = 0; i < search_subtrees(run); i++) {
+        if (run->subtrees[i]) {finish_subtree(run, run->subtrees[i]);}
+    }
+    free(run->subtrees);
+    free(run->finished);
+    free_ranking(run->best);
+    free(run->terms);
+    free(run->pair);
+    free_layout(run->start);
+    release_weights(run->compiled);
+    pthread_mutex_destroy(&run->mutex);
+    free(run);
+}
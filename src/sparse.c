@@ -0,0 +1,261 @@
+/*
+ * sparse.c - Sparse corpus ngrams.
+ *
+ * Implements the inverted evaluation of trigram and quadgram stats: instead of
+ * summing the frequencies placed on every member of every stat, walk the
+ * ngrams the corpus actually holds, find the tuple of key positions each lands
+ * on, and add it to the stats that tuple belongs to. The cost depends on the
+ * corpus alone, however many stats are enabled.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sparse.h"
+#include "util.h"
+#include "io.h"
+
+sparse_ngrams *sparse_tri = NULL;
+sparse_ngrams *sparse_quad = NULL;
+
+/* Most distinct stat sets a tuple_set entry can name. */
+#define MAX_SETS 65535
+
+/* Frequencies of the ngrams being sorted, for compare_ngrams(). */
+static const float *sort_freqs;
+
+/* Orders ngram indices by decreasing frequency. */
+static int compare_ngrams(const void *a, const void *b)
+{
+    float fa = sort_freqs[*(const uint32_t *)a], fb = sort_freqs[*(const uint32_t *)b];
+    return (fa < fb) - (fa > fb);
+}
+
+/* Returns the 64-bit FNV-1a hash of a stat set. */
+static uint64_t hash_set(const uint64_t *bits, int words)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (int w = 0; w < words; w++) {hash = (hash ^ bits[w]) * 0x100000001B3ULL;}
+    return hash ^ hash >> 29;
+}
+
+/*
+ * Builds the sparse ngrams of one width.
+ *
+ * Parameters:
+ *   linear: The normalized frequencies of that width.
+ *   width: 3 or 4.
+ *   stat_count: The number of stats of that width.
+ *   pos: The members of each stat, width positions each, NULL if it is skipped.
+ *   lengths: The number of members of each stat.
+ *
+ * Returns: The sparse ngrams, or NULL if no stat is enabled or the stats have
+ *          too many distinct sets.
+ */
+static sparse_ngrams *build_width(const float *linear, int width, int stat_count,
+    const unsigned char *const *pos, const int *lengths)
+{
+    size_t size = 1, tuples = 1;
+    for (int k = 0; k < width; k++) {size *= LANG_LENGTH; tuples *= DIM1;}
+
+    /* only the enabled stats get a bit in the sets */
+    int *bit_of_stat = malloc((stat_count + 1) * sizeof(int));
+    int *stat_of_bit = malloc((stat_count + 1) * sizeof(int));
+    if (!bit_of_stat || !stat_of_bit) {error("failed to malloc sparse ngrams");}
+    int enabled = 0;
+    for (int s = 0; s < stat_count; s++)
+    {
+        bit_of_stat[s] = pos[s] ? enabled : -1;
+        if (pos[s]) {stat_of_bit[enabled++] = s;}
+    }
+    if (enabled == 0) {
+        free(bit_of_stat);
+        free(stat_of_bit);
+        return NULL;
+    }
+    int words = (enabled + 63) / 64;
+
+    /* the stat set of every tuple, then each distinct set numbered once */
+    uint64_t *bits = calloc(tuples * words, sizeof(uint64_t));
+    if (!bits) {error("failed to malloc sparse ngrams");}
+    for (int s = 0; s < stat_count; s++)
+    {
+        int b = bit_of_stat[s];
+        if (b < 0) {continue;}
+        for (int m = 0; m < lengths[s]; m++)
+        {
+            size_t t = 0;
+            for (int k = 0; k < width; k++) {t = t * DIM1 + pos[s][m * width + k];}
+            bits[t * words + b / 64] |= 1ULL << (b % 64);
+        }
+    }
+
+    sparse_ngrams *sp = calloc(1, sizeof(sparse_ngrams));
+    if (!sp) {error("failed to malloc sparse ngrams");}
+    sp->width = width;
+    sp->words = words;
+    sp->bit_of_stat = bit_of_stat;
+    sp->stat_of_bit = stat_of_bit;
+    sp->tuple_set = calloc(tuples, sizeof(uint16_t));
+    sp->sets = calloc((size_t)(MAX_SETS + 1) * words, sizeof(uint64_t));
+    /* open addressing over set ids, 0 marks a free slot as set 0 is empty */
+    size_t capacity = 2 * (MAX_SETS + 1);
+    uint16_t *table = calloc(capacity, sizeof(uint16_t));
+    if (!sp->tuple_set || !sp->sets || !table) {error("failed to malloc sparse ngrams");}
+    sp->set_count = 1;
+    for (size_t t = 0; t < tuples; t++)
+    {
+        const uint64_t *set = bits + t * words;
+        int empty = 1;
+        for (int w = 0; w < words; w++) {empty &= !set[w];}
+        if (empty) {continue;}
+
+        size_t slot = hash_set(set, words) & (capacity - 1);
+        while (table[slot] && memcmp(sp->sets + (size_t)table[slot] * words, set, words * sizeof(uint64_t))) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        if (!table[slot])
+        {
+            if (sp->set_count > MAX_SETS) {
+                log_print('v',L"too many distinct stat sets, keeping member sums... ");
+                free(table);
+                free(bits);
+                free(sp->tuple_set);
+                free(sp->sets);
+                free(sp->bit_of_stat);
+                free(sp->stat_of_bit);
+                free(sp);
+                return NULL;
+            }
+            table[slot] = (uint16_t)sp->set_count;
+            memcpy(sp->sets + (size_t)sp->set_count * words, set, words * sizeof(uint64_t));
+            sp->set_count++;
+        }
+        sp->tuple_set[t] = table[slot];
+    }
+    free(table);
+    free(bits);
+    sp->sets = realloc(sp->sets, (size_t)sp->set_count * words * sizeof(uint64_t));
+
+    /* the nonzero ngrams, most frequent first */
+    uint32_t *order = malloc(size * sizeof(uint32_t));
+    if (!order) {error("failed to malloc sparse ngrams");}
+    for (size_t i = 0; i < size; i++) {
+        if (linear[i] > 0) {order[sp->length++] = (uint32_t)i;}
+    }
+    sort_freqs = linear;
+    qsort(order, sp->length, sizeof(uint32_t), &compare_ngrams);
+
+    sp->chars = malloc(sp->length * sizeof(uint32_t));
+    sp->freqs = malloc(sp->length * sizeof(float));
+    if (sp->length && (!sp->chars || !sp->freqs)) {error("failed to malloc sparse ngrams");}
+    for (size_t n = 0; n < sp->length; n++)
+    {
+        /* unpack the linear index, character k of the ngram into byte k */
+        uint32_t i = order[n], packed = 0;
+        for (int k = width - 1; k >= 0; k--) {
+            packed |= (i % LANG_LENGTH) << (8 * k);
+            i /= LANG_LENGTH;
+        }
+        sp->chars[n] = packed;
+        sp->freqs[n] = linear[order[n]];
+    }
+    free(order);
+    return sp;
+}
+
+/*
+ * Builds the sparse trigrams and quadgrams from the normalized corpus and the
+ * enabled stats, which must both be loaded.
+ */
+void build_sparse_ngrams()
+{
+    const unsigned char **pos = malloc((TRI_LENGTH + QUAD_LENGTH + 1) * sizeof(unsigned char *));
+    int *lengths = malloc((TRI_LENGTH + QUAD_LENGTH + 1) * sizeof(int));
+    if (!pos || !lengths) {error("failed to malloc sparse ngrams");}
+
+    for (int i = 0; i < TRI_LENGTH; i++) {
+        pos[i] = stats_tri[i].skip ? NULL : stats_tri[i].pos[0];
+        lengths[i] = stats_tri[i].length;
+    }
+    sparse_tri = build_width(linear_tri, 3, TRI_LENGTH, pos, lengths);
+
+    for (int i = 0; i < QUAD_LENGTH; i++) {
+        pos[i] = stats_quad[i].skip ? NULL : stats_quad[i].pos[0];
+        lengths[i] = stats_quad[i].length;
+    }
+    sparse_quad = build_width(linear_quad, 4, QUAD_LENGTH, pos, lengths);
+
+    free(pos);
+    free(lengths);
+}
+
+/*
+ * Scores stats of one width by walking the nonzero ngrams of the corpus.
+ *
+ * Parameters:
+ *   sp: The sparse ngrams of the stats' width.
+ *   where: The flat key position of each character, -1 if not on the layout.
+ *          No character may be on the layout twice.
+ *   stats: The indices of the stats to score, all enabled.
+ *   count: The number of stats to score.
+ *   scores: The layout's scores of that width, indexed like the stats.
+ */
+void sparse_analyze(const sparse_ngrams *sp, const int where[], const int *stats,
+    int count, float *scores)
+{
+    int words = sp->words;
+    uint64_t wanted[words];
+    memset(wanted, 0, sizeof(wanted));
+    for (int s = 0; s < count; s++)
+    {
+        int b = sp->bit_of_stat[stats[s]];
+        wanted[b / 64] |= 1ULL << (b % 64);
+        scores[stats[s]] = 0;
+    }
+
+    for (size_t n = 0; n < sp->length; n++)
+    {
+        uint32_t packed = sp->chars[n];
+        size_t t = 0;
+        int k;
+        for (k = 0; k < sp->width; k++)
+        {
+            int p = where[packed >> (8 * k) & 0xFF];
+            if (p < 0) {break;}
+            t = t * DIM1 + p;
+        }
+        if (k < sp->width) {continue;}
+
+        int set = sp->tuple_set[t];
+        if (!set) {continue;}
+        const uint64_t *bits = sp->sets + (size_t)set * words;
+        for (int w = 0; w < words; w++)
+        {
+            uint64_t hit = bits[w] & wanted[w];
+            while (hit)
+            {
+                scores[sp->stat_of_bit[w * 64 + __builtin_ctzll(hit)]] += sp->freqs[n];
+                hit &= hit - 1;
+            }
+        }
+    }
+}
+
+/* Frees the sparse trigrams and quadgrams. */
+void free_sparse_ngrams()
+{
+    sparse_ngrams *all[2] = {sparse_tri, sparse_quad};
+    for (int i = 0; i < 2; i++)
+    {
+        if (!all[i]) {continue;}
+        free(all[i]->chars);
+        free(all[i]->freqs);
+        free(all[i]->tuple_set);
+        free(all[i]->sets);
+        free(all[i]->bit_of_stat);
+        free(all[i]->stat_of_bit);
+        free(all[i]);
+    }
+    sparse_tri = sparse_quad = NULL;
+}
@@ -7,6 +7,8 @@
  */
 
 
+#include <stdlib.h>
+
 #include "stats.h"
 #include "mono.h"
 #include "bi.h"
@@ -16,50 +18,98 @@
 #include "meta.h"
 
 #include "io.h"
+#include "stats_util.h"
+#include "global.h"
+
+/*
+ * Builds the reverse index by key position of every stat that is not skipped,
+ * used to update a layout's stats after only some of its keys changed, and the
+ * position pair bitmasks of bigram and skipgram stats.
+ */
+static void index_stats()
+{
+    for (int i = 0; i < MONO_LENGTH; i++) {
+        stats_mono[i].by_pos = stats_mono[i].skip ? NULL
+            : build_stat_index(stats_mono[i].pos, 1, stats_mono[i].length); /* stats_util.c */
+    }
+    for (int i = 0; i < BI_LENGTH; i++) {
+        stats_bi[i].by_pos = stats_bi[i].skip ? NULL
+            : build_stat_index(stats_bi[i].pos[0], 2, stats_bi[i].length);
+        stats_bi[i].pair_mask = stats_bi[i].skip ? NULL
+            : build_pair_mask(stats_bi[i].pos, stats_bi[i].length);
+    }
+    for (int i = 0; i < TRI_LENGTH; i++) {
+        stats_tri[i].by_pos = stats_tri[i].skip ? NULL
+            : build_stat_index(stats_tri[i].pos[0], 3, stats_tri[i].length);
+    }
+    for (int i = 0; i < QUAD_LENGTH; i++) {
+        stats_quad[i].by_pos = stats_quad[i].skip ? NULL
+            : build_stat_index(stats_quad[i].pos[0], 4, stats_quad[i].length);
+    }
+    for (int i = 0; i < SKIP_LENGTH; i++) {
+        stats_skip[i].by_pos = stats_skip[i].skip ? NULL
+            : build_stat_index(stats_skip[i].pos[0], 2, stats_skip[i].length);
+        stats_skip[i].pair_mask = stats_skip[i].skip ? NULL
+            : build_pair_mask(stats_skip[i].pos, stats_skip[i].length);
+    }
+}
+
+/*
+ * Frees the reverse indexes and pair masks built by index_stats().
+ */
+static void free_stat_indexes()
+{
+    for (int i = 0; i < MONO_LENGTH; i++) {free(stats_mono[i].by_pos);}
+    for (int i = 0; i < BI_LENGTH; i++) {free(stats_bi[i].by_pos); free(stats_bi[i].pair_mask);}
+    for (int i = 0; i < TRI_LENGTH; i++) {free(stats_tri[i].by_pos);}
+    for (int i = 0; i < QUAD_LENGTH; i++) {free(stats_quad[i].by_pos);}
+    for (int i = 0; i < SKIP_LENGTH; i++) {free(stats_skip[i].by_pos); free(stats_skip[i].pair_mask);}
+}
 
 /*
  * Initializes all statistic data structures. This involves
  * initializing arrays for each type of n-gram statistic as well as
  * meta-statistics. The function delegates the initialization of each statistic
- * type to its respective module.
+ * type to its respective module, unless the stat cache already holds them.
  */
 void initialize_stats()
 {
-    /* initializes array for monogram stats */
+    /* the stat definitions only depend on the geometry, so reuse them */
     log_print('v',L"\n");
-    log_print('v',L"     Initializing monogram stats... ");
-    initialize_mono_stats(); /* stats/mono.c */
-    log_print('v',L"trimming monogram stats... ");
-    trim_mono_stats(); /* stats/mono.c */
+    log_print('v',L"     Finding stat cache... ");
+    int stats_cache = read_stats_cache(); /* io.c */
     log_print('v',L"Done\n");
+    if (!stats_cache) {
+        /* initializes array for monogram stats */
+        log_print('v',L"     Initializing monogram stats... ");
+        initialize_mono_stats(); /* stats/mono.c */
+        log_print('v',L"Done\n");
 
-    /* initializes array for bigram stats */
-    log_print('v',L"     Initializing bigram stats...   ");
-    initialize_bi_stats(); /* stats/bi.c */
-    log_print('v',L"trimming bigram stats...   ");
-    trim_bi_stats(); /* stats/bi.c */
-    log_print('v',L"Done\n");
+        /* initializes array for bigram stats */
+        log_print('v',L"     Initializing bigram stats...   ");
+        initialize_bi_stats(); /* stats/bi.c */
+        log_print('v',L"Done\n");
 
-    /* initializes array for trigram stats */
-    log_print('v',L"     Initializing trigram stats...  ");
-    initialize_tri_stats(); /* stats/tri.c */
-    log_print('v',L"trimming trigram stats...  ");
-    trim_tri_stats(); /* stats/tri.c */
-    log_print('v',L"Done\n");
+        /* initializes array for trigram stats */
+        log_print('v',L"     Initializing trigram stats...  ");
+        initialize_tri_stats(); /* stats/tri.c */
+        log_print('v',L"Done\n");
 
-    /* initializes array for quadgram stats */
-    log_print('v',L"     Initializing quadgram stats... ");
-    initialize_quad_stats(); /* stats/quad.c */
-    log_print('v',L"trimming quadgram stats... ");
-    trim_quad_stats(); /* stats/quad.c */
-    log_print('v',L"Done\n");
+        /* initializes array for quadgram stats */
+        log_print('v',L"     Initializing quadgram stats... ");
+        initialize_quad_stats(); /* stats/quad.c */
+        log_print('v',L"Done\n");
 
-    /* initializes array for skipgram stats */
-    log_print('v',L"     Initializing skipgram stats... ");
-    initialize_skip_stats(); /* stats/skip.c */
-    log_print('v',L"trimming skipgram stats... ");
-    trim_skip_stats(); /* stats/skip.c */
-    log_print('v',L"Done\n");
+        /* initializes array for skipgram stats */
+        log_print('v',L"     Initializing skipgram stats... ");
+        initialize_skip_stats(); /* stats/skip.c */
+        log_print('v',L"Done\n");
+
+        /* create new stat cache */
+        log_print('v',L"     Creating stat cache... ");
+        cache_stats(); /* io.c */
+        log_print('v',L"Done\n");
+    }
 
     /* initializes array for meta stats */
     log_print('v',L"     Initializing meta stats...     ");
@@ -67,6 +117,11 @@ void initialize_stats()
     log_print('v',L"trimming meta stats...     ");
     trim_meta_stats(); /* stats/meta.c */
     log_print('v',L"Done\n");
+
+    /* index the members of enabled stats by the key positions they touch */
+    log_print('v',L"     Indexing stats by position...  ");
+    index_stats(); /* stats.c */
+    log_print('v',L"Done\n");
 }
 
 /*
@@ -78,6 +133,8 @@ void initialize_stats()
 void free_stats()
 {
     /* frees all stats in the linked list */
+    free_stat_indexes(); /* stats.c */
+    free_stats_cache(); /* io.c */
     log_print('v',L"\n     Freeing monogram stats... ");
     free_mono_stats(); /* stats/mono.c */
     log_print('v',L"Done\n");
@@ -14,7 +14,8 @@
  *       4b. Check if the ngram falls under the stat.
  *       4c. If it does, add it to the ngrams array and increment length.
  *       4d. Otherwise set the ngram array element to -1.
- *     5. Iterate the index.
+ *     5. Call trim_bi_stat() on the index to keep only the members, then
+ *        iterate the index.
  *     6. Add the statistic to the weights files in data/weights/.
  */
 
@@ -28,6 +29,57 @@
 #include "global.h"
 #include "structs.h"
 
+/*
+ * Trims the ngrams of a single stat, moving unused entries to the end, and
+ * packs the members into a pos array of exactly the stat's length. The
+ * ngrams array is shared scratch space during initialization, so it is
+ * detached from the stat afterwards.
+ *
+ * Parameters:
+ *   i: The index of the stat to trim.
+ */
+static void trim_bi_stat(int i)
+{
+    if (stats_bi[i].length != 0)
+    {
+        int left = 0;
+        int right = DIM2 - 1;
+
+        /* Use two pointers to partition the array */
+        while (left < right) {
+            /* Find the next -1 from the left */
+            while (left < right && stats_bi[i].ngrams[left] != -1) {
+                left++;
+            }
+
+            /* Find the next non -1 from the right */
+            while (left < right && stats_bi[i].ngrams[right] == -1) {
+                right--;
+            }
+
+            /* Swap the elements to move -1 to the back and non -1 to the front */
+            if (left < right) {
+                int temp = stats_bi[i].ngrams[left];
+                stats_bi[i].ngrams[left] = stats_bi[i].ngrams[right];
+                stats_bi[i].ngrams[right] = temp;
+                left++;
+                right--;
+            }
+        }
+    }
+
+    /* Pack the members as flat positions for the analysis loop. */
+    stats_bi[i].pos = malloc((stats_bi[i].length + 1) * sizeof(*stats_bi[i].pos));
+    for (int j = 0; j < stats_bi[i].length; j++)
+    {
+        int ngram = stats_bi[i].ngrams[j];
+        stats_bi[i].pos[j][0] = ngram / DIM1;
+        stats_bi[i].pos[j][1] = ngram % DIM1;
+    }
+
+    stats_bi[i].ngrams = NULL;
+}
+
 /*
  * Initializes the array of bigram statistics. The function allocates memory
  * for the stat array and sets default values, including a negative infinity
@@ -37,6 +89,14 @@ void initialize_bi_stats()
 {
     BI_LENGTH = 27;
     stats_bi = (bi_stat *)malloc(sizeof(bi_stat) * BI_LENGTH);
+
+    /* every stat fills the same DIM2 scratch array before it is trimmed */
+    int *ngrams = (int *)malloc(sizeof(int) * DIM2);
+    for (int i = 0; i < BI_LENGTH; i++)
+    {
+        stats_bi[i].ngrams = ngrams;
+    }
+
     int row0, col0, row1, col1;
     int index = 0;
 
@@ -58,6 +118,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize per finger bigram stats */
@@ -78,6 +139,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Left Ring Bigram");
@@ -97,6 +159,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Left Middle Bigram");
@@ -116,6 +179,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Left Index Bigram");
@@ -135,6 +199,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Right Index Bigram");
@@ -154,6 +219,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Right Middle Bigram");
@@ -173,6 +239,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Right Ring Bigram");
@@ -192,6 +259,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Right Pinky Bigram");
@@ -211,6 +279,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize 2U SFBs */
@@ -231,6 +300,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize per finger 2U bigram stats */
@@ -251,6 +321,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Left Ring Bigram");
@@ -270,6 +341,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Left Middle Bigram");
@@ -289,6 +361,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Left Index Bigram");
@@ -308,6 +381,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Right Index Bigram");
@@ -327,6 +401,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Right Middle Bigram");
@@ -346,6 +421,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Right Ring Bigram");
@@ -365,6 +441,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Bad Right Pinky Bigram");
@@ -384,6 +461,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize lateral SFBs */
@@ -404,6 +482,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize per finger lateral bigram stats */
@@ -424,6 +503,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Lateral Left Index Bigram");
@@ -443,6 +523,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Lateral Right Index Bigram");
@@ -462,6 +543,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
 
@@ -482,6 +564,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize russor stats */
@@ -502,6 +585,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Half Russor Bigram");
@@ -521,6 +605,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     /* initialize LSBs */
@@ -541,6 +626,7 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
 
     strcpy(stats_bi[index].name, "Pinky Stretch Bigram");
@@ -560,50 +646,20 @@ void initialize_bi_stats()
             stats_bi[index].ngrams[i] = -1;
         }
     }
+    trim_bi_stat(index);
     index++;
+
+    free(ngrams);
     if (index != BI_LENGTH) {error("BI_LENGTH incorrect for number of bi stats");}
 }
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_bi_stats()
-{
-    for (int i = 0; i < BI_LENGTH; i++)
-    {
-        if (stats_bi[i].length != 0)
-        {
-            int left = 0;
-            int right = DIM2 - 1;
-
-            /* Use two pointers to partition the array */
-            while (left < right) {
-                /* Find the next -1 from the left */
-                while (left < right && stats_bi[i].ngrams[left] != -1) {
-                    left++;
-                }
-
-                /* Find the next non -1 from the right */
-                while (left < right && stats_bi[i].ngrams[right] == -1) {
-                    right--;
-                }
-
-                /* Swap the elements to move -1 to the back and non -1 to the front */
-                if (left < right) {
-                    int temp = stats_bi[i].ngrams[left];
-                    stats_bi[i].ngrams[left] = stats_bi[i].ngrams[right];
-                    stats_bi[i].ngrams[right] = temp;
-                    left++;
-                    right--;
-                }
-            }
-        }
-    }
-}
 
 /* Frees the memory allocated for the bigram statistics array. */
 void free_bi_stats()
 {
+    for (int i = 0; i < BI_LENGTH; i++)
+    {
+        free(stats_bi[i].pos);
+    }
     free(stats_bi);
 }
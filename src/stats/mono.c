@@ -14,7 +14,8 @@
  *       4b. Check if the ngram falls under the stat.
  *       4c. If it does, add it to the ngrams array and increment length.
  *       4d. Otherwise set the ngram array element to -1.
- *     5. Iterate the index.
+ *     5. Call trim_mono_stat() on the index to keep only the members, then
+ *        iterate the index.
  *     6. Add the statistic to the weights files in data/weights/.
  */
 
@@ -28,6 +29,55 @@
 #include "global.h"
 #include "structs.h"
 
+/*
+ * Trims the ngrams of a single stat, moving unused entries to the end, and
+ * packs the members into a pos array of exactly the stat's length. The
+ * ngrams array is shared scratch space during initialization, so it is
+ * detached from the stat afterwards.
+ *
+ * Parameters:
+ *   i: The index of the stat to trim.
+ */
+static void trim_mono_stat(int i)
+{
+    if (stats_mono[i].length != 0)
+    {
+        int left = 0;
+        int right = DIM1 - 1;
+
+        /* Use two pointers to partition the array */
+        while (left < right) {
+            /* Find the next -1 from the left */
+            while (left < right && stats_mono[i].ngrams[left] != -1) {
+                left++;
+            }
+
+            /* Find the next non -1 from the right */
+            while (left < right && stats_mono[i].ngrams[right] == -1) {
+                right--;
+            }
+
+            /* Swap the elements to move -1 to the back and non -1 to the front */
+            if (left < right) {
+                int temp = stats_mono[i].ngrams[left];
+                stats_mono[i].ngrams[left] = stats_mono[i].ngrams[right];
+                stats_mono[i].ngrams[right] = temp;
+                left++;
+                right--;
+            }
+        }
+    }
+
+    /* Pack the members as flat positions for the analysis loop. */
+    stats_mono[i].pos = (unsigned char *)malloc(stats_mono[i].length + 1);
+    for (int j = 0; j < stats_mono[i].length; j++)
+    {
+        stats_mono[i].pos[j] = stats_mono[i].ngrams[j];
+    }
+
+    stats_mono[i].ngrams = NULL;
+}
+
 /*
  * Initializes the array of monogram statistics. The function allocates memory
  * for the stat array and sets default values, including a negative infinity
@@ -37,6 +87,14 @@ void initialize_mono_stats()
 {
     MONO_LENGTH = 53;
     stats_mono = (mono_stat *)malloc(sizeof(mono_stat) * MONO_LENGTH);
+
+    /* every stat fills the same DIM1 scratch array before it is trimmed */
+    int *ngrams = (int *)malloc(sizeof(int) * DIM1);
+    for (int i = 0; i < MONO_LENGTH; i++)
+    {
+        stats_mono[i].ngrams = ngrams;
+    }
+
     int row0, col0;
     int index = 0;
 
@@ -58,6 +116,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 01");
@@ -77,6 +136,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 02");
@@ -96,6 +156,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 03");
@@ -115,6 +176,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 04");
@@ -134,6 +196,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 05");
@@ -153,6 +216,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 06");
@@ -172,6 +236,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 07");
@@ -191,6 +256,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 08");
@@ -210,6 +276,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 09");
@@ -229,6 +296,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 10");
@@ -248,6 +316,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 0 11");
@@ -267,6 +336,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 00");
@@ -286,6 +356,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 01");
@@ -305,6 +376,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 02");
@@ -324,6 +396,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 03");
@@ -343,6 +416,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 04");
@@ -362,6 +436,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 05");
@@ -381,6 +456,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 06");
@@ -400,6 +476,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 07");
@@ -419,6 +496,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 08");
@@ -438,6 +516,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 09");
@@ -457,6 +536,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 10");
@@ -476,6 +556,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 1 11");
@@ -495,6 +576,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 00");
@@ -514,6 +596,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 01");
@@ -533,6 +616,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 02");
@@ -552,6 +636,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 03");
@@ -571,6 +656,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 04");
@@ -590,6 +676,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 05");
@@ -609,6 +696,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 06");
@@ -628,6 +716,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 07");
@@ -647,6 +736,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 08");
@@ -666,6 +756,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 09");
@@ -685,6 +776,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 10");
@@ -704,6 +796,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Heatmap 2 11");
@@ -723,6 +816,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     /* Initialize a new stats for column/finger usage. */
@@ -743,6 +837,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Left Pinky Usage");
@@ -762,6 +857,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Left Ring Usage");
@@ -781,6 +877,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Left Middle Usage");
@@ -800,6 +897,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Left Index Usage");
@@ -819,6 +917,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Left Inner Usage");
@@ -838,6 +937,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Inner Usage");
@@ -857,6 +957,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Index Usage");
@@ -876,6 +977,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Middle Usage");
@@ -895,6 +997,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Ring Usage");
@@ -914,6 +1017,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Pinky Usage");
@@ -933,6 +1037,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Outer Usage");
@@ -952,6 +1057,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     /* Allocate and initialize a new stats for hand usage. */
@@ -972,6 +1078,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Right Hand Usage");
@@ -991,6 +1098,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     /* Allocate and initialize a new stats for row usage. */
@@ -1011,6 +1119,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Home Row Usage");
@@ -1030,6 +1139,7 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
     strcpy(stats_mono[index].name, "Bottom Row Usage");
@@ -1049,51 +1159,21 @@ void initialize_mono_stats()
             stats_mono[index].ngrams[i] = -1;
         }
     }
+    trim_mono_stat(index);
     index++;
 
+
+    free(ngrams);
     if (index != MONO_LENGTH) {error("MONO_LENGTH incorrect for number of mono stats");}
 }
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_mono_stats()
-{
-    for (int i = 0; i < MONO_LENGTH; i++)
-    {
-        if (stats_mono[i].length != 0)
-        {
-            int left = 0;
-            int right = DIM1 - 1;
-
-            /* Use two pointers to partition the array */
-            while (left < right) {
-                /* Find the next -1 from the left */
-                while (left < right && stats_mono[i].ngrams[left] != -1) {
-                    left++;
-                }
-
-                /* Find the next non -1 from the right */
-                while (left < right && stats_mono[i].ngrams[right] == -1) {
-                    right--;
-                }
-
-                /* Swap the elements to move -1 to the back and non -1 to the front */
-                if (left < right) {
-                    int temp = stats_mono[i].ngrams[left];
-                    stats_mono[i].ngrams[left] = stats_mono[i].ngrams[right];
-                    stats_mono[i].ngrams[right] = temp;
-                    left++;
-                    right--;
-                }
-            }
-        }
-    }
-}
 
 /* Frees the memory allocated for the monogram statistics array. */
 void free_mono_stats()
 {
+    for (int i = 0; i < MONO_LENGTH; i++)
+    {
+        free(stats_mono[i].pos);
+    }
     free(stats_mono);
 }
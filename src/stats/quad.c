@@ -14,7 +14,8 @@
  *       4b. Check if the ngram falls under the stat.
  *       4c. If it does, add it to the ngrams array and increment length.
  *       4d. Otherwise set the ngram array element to -1.
- *     5. Iterate the index.
+ *     5. Call trim_quad_stat() on the index to keep only the members, then
+ *        iterate the index.
  *     6. Add the statistic to the weights files in data/weights/.
  */
 
@@ -28,6 +29,59 @@
 #include "global.h"
 #include "structs.h"
 
+/*
+ * Trims the ngrams of a single stat, moving unused entries to the end, and
+ * packs the members into a pos array of exactly the stat's length. The
+ * ngrams array is shared scratch space during initialization, so it is
+ * detached from the stat afterwards.
+ *
+ * Parameters:
+ *   i: The index of the stat to trim.
+ */
+static void trim_quad_stat(int i)
+{
+    if (stats_quad[i].length != 0)
+    {
+        int left = 0;
+        int right = DIM4 - 1;
+
+        /* Use two pointers to partition the array */
+        while (left < right) {
+            /* Find the next -1 from the left */
+            while (left < right && stats_quad[i].ngrams[left] != -1) {
+                left++;
+            }
+
+            /* Find the next non -1 from the right */
+            while (left < right && stats_quad[i].ngrams[right] == -1) {
+                right--;
+            }
+
+             /* Swap the elements to move -1 to the back and non -1 to the front */
+            if (left < right) {
+                int temp = stats_quad[i].ngrams[left];
+                stats_quad[i].ngrams[left] = stats_quad[i].ngrams[right];
+                stats_quad[i].ngrams[right] = temp;
+                left++;
+                right--;
+            }
+        }
+    }
+
+    /* Pack the members as flat positions for the analysis loop. */
+    stats_quad[i].pos = malloc((stats_quad[i].length + 1) * sizeof(*stats_quad[i].pos));
+    for (int j = 0; j < stats_quad[i].length; j++)
+    {
+        int ngram = stats_quad[i].ngrams[j];
+        stats_quad[i].pos[j][0] = ngram / DIM3;
+        stats_quad[i].pos[j][1] = (ngram / DIM2) % DIM1;
+        stats_quad[i].pos[j][2] = (ngram / DIM1) % DIM1;
+        stats_quad[i].pos[j][3] = ngram % DIM1;
+    }
+
+    stats_quad[i].ngrams = NULL;
+}
+
 /*
  * Initializes the array of quadgram statistics. The function allocates memory
  * for the stat array and sets default values, including a negative infinity
@@ -37,6 +91,14 @@ void initialize_quad_stats()
 {
     QUAD_LENGTH = 71;
     stats_quad = (quad_stat *)malloc(sizeof(quad_stat) * QUAD_LENGTH);
+
+    /* every stat fills the same DIM4 scratch array before it is trimmed */
+    int *ngrams = (int *)malloc(sizeof(int) * DIM4);
+    for (int i = 0; i < QUAD_LENGTH; i++)
+    {
+        stats_quad[i].ngrams = ngrams;
+    }
+
     int row0, col0, row1, col1, row2, col2, row3, col3;
     int index = 0;
 
@@ -59,6 +121,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Redirect");
@@ -78,6 +141,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Bad Chained Redirect");
@@ -97,6 +161,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Alternation");
@@ -116,6 +181,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Alternation In");
@@ -135,6 +201,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Alternation Out");
@@ -154,6 +221,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Alternation Mix");
@@ -173,6 +241,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Alternation");
@@ -192,6 +261,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Alternation In");
@@ -211,6 +281,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Alternation Out");
@@ -230,6 +301,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Alternation Mix");
@@ -249,6 +321,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Alternation");
@@ -268,6 +341,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Alternation In");
@@ -287,6 +361,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Alternation Out");
@@ -306,6 +381,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Alternation Mix");
@@ -325,6 +401,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Alternation");
@@ -344,6 +421,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Alternation In");
@@ -363,6 +441,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Alternation Out");
@@ -382,6 +461,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Alternation Mix");
@@ -401,6 +481,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad One Hand");
@@ -420,6 +501,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad One Hand In");
@@ -439,6 +521,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad One Hand Out");
@@ -458,6 +541,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row One Hand");
@@ -477,6 +561,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row One Hand In");
@@ -496,6 +581,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row One Hand Out");
@@ -515,6 +601,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger One Hand");
@@ -534,6 +621,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger One Hand In");
@@ -553,6 +641,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger One Hand Out");
@@ -572,6 +661,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger One Hand");
@@ -591,6 +681,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger One Hand In");
@@ -610,6 +701,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger One Hand Out");
@@ -629,6 +721,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Roll");
@@ -648,6 +741,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Roll In");
@@ -667,6 +761,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Roll Out");
@@ -686,6 +781,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Roll");
@@ -705,6 +801,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Roll In");
@@ -724,6 +821,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Roll Out");
@@ -743,6 +841,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger Roll");
@@ -762,6 +861,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger Roll In");
@@ -781,6 +881,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Adjacent Finger Roll Out");
@@ -800,6 +901,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger Roll");
@@ -819,6 +921,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger Roll In");
@@ -838,6 +941,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Quad Same Row Adjacent Finger Roll Out");
@@ -857,6 +961,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "True Roll");
@@ -876,6 +981,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "True Roll In");
@@ -895,6 +1001,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "True Roll Out");
@@ -914,6 +1021,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row True Roll");
@@ -933,6 +1041,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row True Roll In");
@@ -952,6 +1061,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row True Roll Out");
@@ -971,6 +1081,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger True Roll");
@@ -990,6 +1101,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger True Roll In");
@@ -1009,6 +1121,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger True Roll Out");
@@ -1028,6 +1141,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger True Roll");
@@ -1047,6 +1161,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger True Roll In");
@@ -1066,6 +1181,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger True Roll Out");
@@ -1085,6 +1201,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Roll");
@@ -1104,6 +1221,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Roll In");
@@ -1123,6 +1241,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Roll Out");
@@ -1142,6 +1261,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Chained Roll Mix");
@@ -1161,6 +1281,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Roll");
@@ -1180,6 +1301,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Roll In");
@@ -1199,6 +1321,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Roll Out");
@@ -1218,6 +1341,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Chained Roll Mix");
@@ -1237,6 +1361,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Roll");
@@ -1256,6 +1381,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Roll In");
@@ -1275,6 +1401,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Roll Out");
@@ -1294,6 +1421,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Adjacent Finger Chained Roll Mix");
@@ -1313,6 +1441,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Roll");
@@ -1332,6 +1461,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Roll In");
@@ -1351,6 +1481,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Roll Out");
@@ -1370,6 +1501,7 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
     strcpy(stats_quad[index].name, "Same Row Adjacent Finger Chained Roll Mix");
@@ -1389,52 +1521,22 @@ void initialize_quad_stats()
             stats_quad[index].ngrams[i] = -1;
         }
     }
+    trim_quad_stat(index);
     index++;
 
+
+    free(ngrams);
     if (index != QUAD_LENGTH) { error("QUAD_LENGTH incorrect for number of quad stats"); }
 }
 
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_quad_stats()
-{
-    for (int i = 0; i < QUAD_LENGTH; i++)
-    {
-        if (stats_quad[i].length != 0)
-        {
-            int left = 0;
-            int right = DIM4 - 1;
-
-            /* Use two pointers to partition the array */
-            while (left < right) {
-                /* Find the next -1 from the left */
-                while (left < right && stats_quad[i].ngrams[left] != -1) {
-                    left++;
-                }
-
-                /* Find the next non -1 from the right */
-                while (left < right && stats_quad[i].ngrams[right] == -1) {
-                    right--;
-                }
-
-                 /* Swap the elements to move -1 to the back and non -1 to the front */
-                if (left < right) {
-                    int temp = stats_quad[i].ngrams[left];
-                    stats_quad[i].ngrams[left] = stats_quad[i].ngrams[right];
-                    stats_quad[i].ngrams[right] = temp;
-                    left++;
-                    right--;
-                }
-            }
-        }
-    }
-}
 
 /* Frees the memory allocated for the quadgram statistics array. */
 void free_quad_stats()
 {
+    for (int i = 0; i < QUAD_LENGTH; i++)
+    {
+        free(stats_quad[i].pos);
+    }
     free(stats_quad);
 }
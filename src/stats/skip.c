@@ -15,7 +15,8 @@
  *       4b. Check if the ngram falls under the stat.
  *       4c. If it does, add it to the ngrams array and increment length.
  *       4d. Otherwise set the ngram array element to -1.
- *     5. Iterate the index.
+ *     5. Call trim_skip_stat() on the index to keep only the members, then
+ *        iterate the index.
  *     6. Add the statistic to the weights files in data/weights/.
  */
 
@@ -29,6 +30,57 @@
 #include "global.h"
 #include "structs.h"
 
+/*
+ * Trims the ngrams of a single stat, moving unused entries to the end, and
+ * packs the members into a pos array of exactly the stat's length. The
+ * ngrams array is shared scratch space during initialization, so it is
+ * detached from the stat afterwards.
+ *
+ * Parameters:
+ *   i: The index of the stat to trim.
+ */
+static void trim_skip_stat(int i)
+{
+    if (stats_skip[i].length != 0)
+    {
+        int left = 0;
+        int right = DIM2 - 1;
+
+        /* Use two pointers to partition the array */
+        while (left < right) {
+            /* Find the next -1 from the left */
+            while (left < right && stats_skip[i].ngrams[left] != -1) {
+                left++;
+            }
+
+            /* Find the next non -1 from the right */
+            while (left < right && stats_skip[i].ngrams[right] == -1) {
+                right--;
+            }
+
+             /* Swap the elements to move -1 to the back and non -1 to the front */
+            if (left < right) {
+                int temp = stats_skip[i].ngrams[left];
+                stats_skip[i].ngrams[left] = stats_skip[i].ngrams[right];
+                stats_skip[i].ngrams[right] = temp;
+                left++;
+                right--;
+            }
+        }
+    }
+
+    /* Pack the members as flat positions for the analysis loop. */
+    stats_skip[i].pos = malloc((stats_skip[i].length + 1) * sizeof(*stats_skip[i].pos));
+    for (int j = 0; j < stats_skip[i].length; j++)
+    {
+        int ngram = stats_skip[i].ngrams[j];
+        stats_skip[i].pos[j][0] = ngram / DIM1;
+        stats_skip[i].pos[j][1] = ngram % DIM1;
+    }
+
+    stats_skip[i].ngrams = NULL;
+}
+
 /*
  * Initializes the array of skipgram statistics. The function allocates memory
  * for the stat array and sets default values, including a negative infinity
@@ -38,6 +90,14 @@ void initialize_skip_stats()
 {
     SKIP_LENGTH = 23;
     stats_skip = (skip_stat *)malloc(sizeof(skip_stat) * SKIP_LENGTH);
+
+    /* every stat fills the same DIM2 scratch array before it is trimmed */
+    int *ngrams = (int *)malloc(sizeof(int) * DIM2);
+    for (int i = 0; i < SKIP_LENGTH; i++)
+    {
+        stats_skip[i].ngrams = ngrams;
+    }
+
     int row0, col0, row1, col1;
     int index = 0;
 
@@ -61,6 +121,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     /* per finger SFS */
@@ -81,6 +142,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Left Ring Skipgram");
@@ -100,6 +162,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Left Middle Skipgram");
@@ -119,6 +182,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Left Index Skipgram");
@@ -138,6 +202,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Right Index Skipgram");
@@ -157,6 +222,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Right Middle Skipgram");
@@ -176,6 +242,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Right Ring Skipgram");
@@ -195,6 +262,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Right Pinky Skipgram");
@@ -214,6 +282,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     /* 2U SFS */
@@ -234,6 +303,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     /* per finger 2U SFS */
@@ -254,6 +324,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Left Ring Skipgram");
@@ -273,6 +344,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Left Middle Skipgram");
@@ -292,6 +364,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Left Index Skipgram");
@@ -311,6 +384,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Right Index Skipgram");
@@ -330,6 +404,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Right Middle Skipgram");
@@ -349,6 +424,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Right Ring Skipgram");
@@ -368,6 +444,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Bad Right Pinky Skipgram");
@@ -387,6 +464,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
 
@@ -408,6 +486,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     /* initialize per finger lateral skipgram stats */
@@ -428,6 +507,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Lateral Left Index Skipgram");
@@ -447,6 +527,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
     strcpy(stats_skip[index].name, "Lateral Right Index Skipgram");
@@ -466,6 +547,7 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
 
@@ -486,51 +568,21 @@ void initialize_skip_stats()
             stats_skip[index].ngrams[i] = -1;
         }
     }
+    trim_skip_stat(index);
     index++;
 
+
+    free(ngrams);
     if (index != SKIP_LENGTH) {error("SKIP_LENGTH incorrect for number of skip stats");}
 }
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_skip_stats()
-{
-    for (int i = 0; i < SKIP_LENGTH; i++)
-    {
-        if (stats_skip[i].length != 0)
-        {
-            int left = 0;
-            int right = DIM2 - 1;
-
-            /* Use two pointers to partition the array */
-            while (left < right) {
-                /* Find the next -1 from the left */
-                while (left < right && stats_skip[i].ngrams[left] != -1) {
-                    left++;
-                }
-
-                /* Find the next non -1 from the right */
-                while (left < right && stats_skip[i].ngrams[right] == -1) {
-                    right--;
-                }
-
-                 /* Swap the elements to move -1 to the back and non -1 to the front */
-                if (left < right) {
-                    int temp = stats_skip[i].ngrams[left];
-                    stats_skip[i].ngrams[left] = stats_skip[i].ngrams[right];
-                    stats_skip[i].ngrams[right] = temp;
-                    left++;
-                    right--;
-                }
-            }
-        }
-    }
-}
 
 /* Frees the memory allocated for the skipgram statistics array. */
 void free_skip_stats()
 {
+    for (int i = 0; i < SKIP_LENGTH; i++)
+    {
+        free(stats_skip[i].pos);
+    }
     free(stats_skip);
 }
@@ -14,7 +14,8 @@
  *       4b. Check if the ngram falls under the stat.
  *       4c. If it does, add it to the ngrams array and increment length.
  *       4d. Otherwise set the ngram array element to -1.
- *     5. Iterate the index.
+ *     5. Call trim_tri_stat() on the index to keep only the members, then
+ *        iterate the index.
  *     6. Add the statistic to the weights files in data/weights/.
  */
 
@@ -29,6 +30,58 @@
 #include "structs.h"
 
 
+/*
+ * Trims the ngrams of a single stat, moving unused entries to the end, and
+ * packs the members into a pos array of exactly the stat's length. The
+ * ngrams array is shared scratch space during initialization, so it is
+ * detached from the stat afterwards.
+ *
+ * Parameters:
+ *   i: The index of the stat to trim.
+ */
+static void trim_tri_stat(int i)
+{
+    if (stats_tri[i].length != 0)
+    {
+        int left = 0;
+        int right = DIM3 - 1;
+
+        /* Use two pointers to partition the array */
+        while (left < right) {
+            /* Find the next -1 from the left */
+            while (left < right && stats_tri[i].ngrams[left] != -1) {
+                left++;
+            }
+
+            /* Find the next non -1 from the right */
+            while (left < right && stats_tri[i].ngrams[right] == -1) {
+                right--;
+            }
+
+             /* Swap the elements to move -1 to the back and non -1 to the front */
+            if (left < right) {
+                int temp = stats_tri[i].ngrams[left];
+                stats_tri[i].ngrams[left] = stats_tri[i].ngrams[right];
+                stats_tri[i].ngrams[right] = temp;
+                left++;
+                right--;
+            }
+        }
+    }
+
+    /* Pack the members as flat positions for the analysis loop. */
+    stats_tri[i].pos = malloc((stats_tri[i].length + 1) * sizeof(*stats_tri[i].pos));
+    for (int j = 0; j < stats_tri[i].length; j++)
+    {
+        int ngram = stats_tri[i].ngrams[j];
+        stats_tri[i].pos[j][0] = ngram / DIM2;
+        stats_tri[i].pos[j][1] = (ngram / DIM1) % DIM1;
+        stats_tri[i].pos[j][2] = ngram % DIM1;
+    }
+
+    stats_tri[i].ngrams = NULL;
+}
+
 /*
  * Initializes the array of tripgram statistics. The function allocates memory
  * for the stat array and sets default values, including a negative infinity
@@ -38,6 +91,14 @@ void initialize_tri_stats()
 {
     TRI_LENGTH = 39;
     stats_tri = (tri_stat *)malloc(sizeof(tri_stat) * TRI_LENGTH);
+
+    /* every stat fills the same DIM3 scratch array before it is trimmed */
+    int *ngrams = (int *)malloc(sizeof(int) * DIM3);
+    for (int i = 0; i < TRI_LENGTH; i++)
+    {
+        stats_tri[i].ngrams = ngrams;
+    }
+
     int row0, col0, row1, col1, row2, col2;
     int index = 0;
 
@@ -60,6 +121,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     /* standard trigram stats after this */
@@ -80,6 +142,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Bad Redirect");
@@ -99,6 +162,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Alternation");
@@ -118,6 +182,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Alternation In");
@@ -137,6 +202,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Alternation Out");
@@ -156,6 +222,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Alternation");
@@ -175,6 +242,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Alternation In");
@@ -194,6 +262,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Alternation Out");
@@ -213,6 +282,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Alternation");
@@ -232,6 +302,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Alternation In");
@@ -251,6 +322,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Alternation Out");
@@ -270,6 +342,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Alternation");
@@ -289,6 +362,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Alternation In");
@@ -308,6 +382,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Alternation Out");
@@ -327,6 +402,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "One Hand");
@@ -346,6 +422,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "One Hand In");
@@ -365,6 +442,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "One Hand Out");
@@ -384,6 +462,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row One Hand");
@@ -403,6 +482,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row One Hand In");
@@ -422,6 +502,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row One Hand Out");
@@ -441,6 +522,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger One Hand");
@@ -460,6 +542,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger One Hand In");
@@ -479,6 +562,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger One Hand Out");
@@ -498,6 +582,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger One Hand");
@@ -517,6 +602,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger One Hand In");
@@ -536,6 +622,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger One Hand Out");
@@ -555,6 +642,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Roll");
@@ -574,6 +662,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Roll In");
@@ -593,6 +682,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Roll Out");
@@ -612,6 +702,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Roll");
@@ -631,6 +722,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Roll In");
@@ -650,6 +742,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Roll Out");
@@ -669,6 +762,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Roll");
@@ -688,6 +782,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Roll In");
@@ -707,6 +802,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Adjacent Finger Roll Out");
@@ -726,6 +822,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Roll");
@@ -745,6 +842,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Roll In");
@@ -764,6 +862,7 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
     strcpy(stats_tri[index].name, "Same Row Adjacent Finger Roll Out");
@@ -783,51 +882,21 @@ void initialize_tri_stats()
             stats_tri[index].ngrams[i] = -1;
         }
     }
+    trim_tri_stat(index);
     index++;
 
+
+    free(ngrams);
     if (index != TRI_LENGTH) {error("TRI_LENGTH incorrect for number of tri stats");}
 }
 
-/*
- * Trims the ngrams in the array to move unused entries to the end.
- * This process ensures memory efficiency by eliminating gaps in the array.
- */
-void trim_tri_stats()
-{
-    for (int i = 0; i < TRI_LENGTH; i++)
-    {
-        if (stats_tri[i].length != 0)
-        {
-            int left = 0;
-            int right = DIM3 - 1;
-
-            /* Use two pointers to partition the array */
-            while (left < right) {
-                /* Find the next -1 from the left */
-                while (left < right && stats_tri[i].ngrams[left] != -1) {
-                    left++;
-                }
-
-                /* Find the next non -1 from the right */
-                while (left < right && stats_tri[i].ngrams[right] == -1) {
-                    right--;
-                }
-
-                 /* Swap the elements to move -1 to the back and non -1 to the front */
-                if (left < right) {
-                    int temp = stats_tri[i].ngrams[left];
-                    stats_tri[i].ngrams[left] = stats_tri[i].ngrams[right];
-                    stats_tri[i].ngrams[right] = temp;
-                    left++;
-                    right--;
-                }
-            }
-        }
-    }
-}
 
 /* Frees the memory allocated for the trigram statistics array. */
 void free_tri_stats()
 {
+    for (int i = 0; i < TRI_LENGTH; i++)
+    {
+        free(stats_tri[i].pos);
+    }
     free(stats_tri);
 }
@@ -6,6 +6,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 
 #include "stats_util.h"
 #include "global.h"
@@ -93,6 +94,69 @@ int find_stat_index(char *stat_name, char type) {
     return -1;
 }
 
+/*
+ * Builds the reverse index of a stat's members by key position.
+ *
+ * Parameters:
+ *   pos: The stat's members, width flat key positions each.
+ *   width: The number of positions per member (1 to 4).
+ *   length: The number of members.
+ *
+ * Returns:
+ *   The index, to be released with free().
+ */
+stat_index *build_stat_index(const unsigned char *pos, int width, int length)
+{
+    int count[dim1] = {0};
+    int total = 0;
+    for (int m = 0; m < length; m++) {
+        for (int k = 0; k < width; k++) {
+            /* count each position once per member */
+            int p = pos[m * width + k];
+            int seen = 0;
+            for (int j = 0; j < k; j++) {seen |= pos[m * width + j] == p;}
+            if (!seen) {count[p]++; total++;}
+        }
+    }
+
+    stat_index *index = malloc(sizeof(stat_index) + (total + 1) * sizeof(int));
+    if (index == NULL) {error("failed to malloc stat index");}
+    index->start[0] = 0;
+    for (int p = 0; p < DIM1; p++) {
+        index->start[p + 1] = index->start[p] + count[p];
+        count[p] = index->start[p];
+    }
+    for (int m = 0; m < length; m++) {
+        for (int k = 0; k < width; k++) {
+            int p = pos[m * width + k];
+            int seen = 0;
+            for (int j = 0; j < k; j++) {seen |= pos[m * width + j] == p;}
+            if (!seen) {index->members[count[p]++] = m;}
+        }
+    }
+    return index;
+}
+
+/*
+ * Builds the mask of a bigram or skipgram stat's members over all position
+ * pairs, 1 at p0 * dim1 + p1 for the member (p0, p1) and 0 elsewhere.
+ *
+ * Parameters:
+ *   pos: The stat's members.
+ *   length: The number of members.
+ *
+ * Returns:
+ *   The PAIR_LENGTH floats of the mask, 64-byte aligned, to be released with free().
+ */
+float *build_pair_mask(const unsigned char (*pos)[2], int length)
+{
+    float *mask = aligned_alloc(64, PAIR_LENGTH * sizeof(float));
+    if (mask == NULL) {error("failed to malloc pair mask");}
+    memset(mask, 0, PAIR_LENGTH * sizeof(float));
+    for (int m = 0; m < length; m++) {mask[pos[m][0] * DIM1 + pos[m][1]] = 1;}
+    return mask;
+}
+
 /* 'l' for left hand, 'r' for right hand. */
 char hand(int row0, int col0)
 {
@@ -0,0 +1,165 @@
+/*
+ * sweep.c - Weight sweeps.
+ *
+ * Scores many layouts under many weight sets. Each layout is analyzed once,
+ * and its stat vector is multiplied by the weights of every set in blocks
+ * small enough to stay in registers and L1.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "analyze.h"
+#include "util.h"
+
+/* Weight sets scored together by one pass over a block's stat vectors. */
+#define SWEEP_TILE 64
+
+/*
+ * Parses a sweep request and compiles its weight sets into one plan and
+ * weight matrix. The run keeps using the request's layouts array.
+ *
+ * Parameters:
+ *   request: The request object.
+ *   message: Set to a static JSON error if the request is invalid.
+ *
+ * Returns: The run, or NULL if the request is invalid.
+ */
+sweep_run *create_sweep_run(json_object *request, const char **message)
+{
+    json_object *j_layouts, *j_weights;
+    if (!json_object_object_get_ex(request, "layouts", &j_layouts) ||
+        !json_object_object_get_ex(request, "weights", &j_weights) ||
+        !json_object_is_type(j_layouts, json_type_array) ||
+        !json_object_is_type(j_weights, json_type_array)) {
+        *message = "{\"error\": \"Invalid JSON payload: missing layouts or weights.\"}";
+        return NULL;
+    }
+    size_t sets = json_object_array_length(j_weights);
+    if (sets < 1 || sets > MAX_SWEEP_WEIGHTS) {
+        *message = "{\"error\": \"Invalid weights: expected 1 to 1024 weight sets.\"}";
+        return NULL;
+    }
+
+    CustomWeights *weights = malloc(sets * sizeof(CustomWeights));
+    if (!weights) {error("Failed to allocate memory for sweep run.");}
+    for (size_t m = 0; m < sets; m++) {
+        if (!parse_weights(json_object_array_get_idx(j_weights, m), &weights[m])) {
+            free(weights);
+            *message = "{\"error\": \"Invalid weights: unknown or skipped stat, or not a finite number.\"}";
+            return NULL;
+        }
+    }
+
+    sweep_run *run = calloc(1, sizeof(sweep_run));
+    if (!run) {error("Failed to allocate memory for sweep run.");}
+    run->layouts = j_layouts;
+    run->count = json_object_array_length(j_layouts);
+    run->sets = (int)sets;
+
+    /* one column of the stat vectors per distinct stat of any set */
+    int total = stat_id('e', META_LENGTH);
+    int *column = malloc(total * sizeof(int));
+    run->ids = malloc(total * sizeof(int));
+    if (!column || !run->ids) {error("Failed to allocate memory for sweep run.");}
+    memset(column, 0xFF, total * sizeof(int));
+    alloc_plan(&run->plan);
+    for (int m = 0; m < run->sets; m++) {
+        for (int i = 0; i < weights[m].length; i++) {
+            int id = stat_id(weights[m].types[i], weights[m].indices[i]);
+            if (column[id] != -1) {continue;}
+            column[id] = run->stats;
+            run->ids[run->stats++] = id;
+            plan_stat(run->plan, weights[m].types[i], weights[m].indices[i]);
+        }
+    }
+
+    run->matrix = calloc((size_t)run->stats * run->sets, sizeof(float));
+    run->scores = malloc(run->count * run->sets * sizeof(float));
+    run->invalid = calloc(run->count, 1);
+    if ((run->stats && !run->matrix) || (run->count && (!run->scores || !run->invalid))) {
+        error("Failed to allocate memory for sweep run.");
+    }
+    for (int m = 0; m < run->sets; m++) {
+        for (int i = 0; i < weights[m].length; i++) {
+            int s = column[stat_id(weights[m].types[i], weights[m].indices[i])];
+            run->matrix[(size_t)s * run->sets + m] += (float)weights[m].values[i];
+        }
+    }
+
+    free(column);
+    free(weights);
+    return run;
+}
+
+/* Returns the number of blocks of a sweep, SWEEP_BLOCK layouts each. */
+size_t sweep_blocks(sweep_run *run)
+{
+    return (run->count + SWEEP_BLOCK - 1) / SWEEP_BLOCK;
+}
+
+/*
+ * Analyzes one block of layouts and fills its rows of the score matrix. Safe
+ * to call for different blocks of the same run concurrently.
+ *
+ * Parameters:
+ *   run: The run.
+ *   block: The index of the block, from 0 to sweep_blocks(run) - 1.
+ */
+void sweep_block(sweep_run *run, size_t block)
+{
+    size_t first = block * SWEEP_BLOCK;
+    int rows = run->count - first < SWEEP_BLOCK ? (int)(run->count - first) : SWEEP_BLOCK;
+    int stats = run->stats, sets = run->sets;
+
+    /* the block's stat vectors, stat by stat so each weight row is read once per block */
+    float *vectors = calloc((size_t)stats * SWEEP_BLOCK, sizeof(float));
+    if (stats && !vectors) {error("Failed to allocate memory for sweep block.");}
+    layout *lt = thread_layout(0);
+    for (int r = 0; r < rows; r++)
+    {
+        json_object *j_layout_str = json_object_array_get_idx(run->layouts, first + r);
+        if (!json_object_is_type(j_layout_str, json_type_string) ||
+            !parse_layout_from_string(lt, json_object_get_string(j_layout_str))) {
+            run->invalid[first + r] = 1;
+            continue;
+        }
+        single_analyze(lt, run->plan);
+        for (int s = 0; s < stats; s++) {vectors[s * SWEEP_BLOCK + r] = lt->scores[run->ids[s]];}
+    }
+
+    for (int tile = 0; tile < sets; tile += SWEEP_TILE)
+    {
+        int width = sets - tile < SWEEP_TILE ? sets - tile : SWEEP_TILE;
+        float acc[SWEEP_BLOCK][SWEEP_TILE] = {{0}};
+        for (int s = 0; s < stats; s++)
+        {
+            const float *w = run->matrix + (size_t)s * sets + tile;
+            const float *v = vectors + s * SWEEP_BLOCK;
+            for (int r = 0; r < SWEEP_BLOCK; r++) {
+                for (int m = 0; m < width; m++) {acc[r][m] += v[r] * w[m];}
+            }
+        }
+        for (int r = 0; r < rows; r++) {
+            memcpy(run->scores + (first + r) * sets + tile, acc[r], width * sizeof(float));
+        }
+    }
+    free(vectors);
+}
+
+/*
+ * Frees a sweep run.
+ *
+ * Parameters:
+ *   run: The run to free.
+ */
+void free_sweep_run(sweep_run *run)
+{
+    free_plan(run->plan);
+    free(run->ids);
+    free(run->matrix);
+    free(run->scores);
+    free(run->invalid);
+    free(run);
+}
@@ -0,0 +1,207 @@
+/*
+ * tensor.c - Compiled weight sets.
+ *
+ * Implements the compilation of a weight set into per-position weights, and
+ * the single pass that scores a layout against them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tensor.h"
+#include "util.h"
+
+/* Orders quadgram tuples by their positions. */
+static int compare_tuples(const void *a, const void *b)
+{
+    return memcmp(((const weighted_tuple *)a)->pos, ((const weighted_tuple *)b)->pos, 4);
+}
+
+/* Sorts the weighted quadgram tuples in place and merges those on the same positions. */
+static void merge_quads(weight_tensors *t)
+{
+    qsort(t->quads, t->quad_length, sizeof(weighted_tuple), compare_tuples);
+    int length = 0;
+    for (int i = 0; i < t->quad_length; i++)
+    {
+        if (length && !memcmp(t->quads[length - 1].pos, t->quads[i].pos, 4)) {
+            t->quads[length - 1].weight += t->quads[i].weight;
+        } else {
+            t->quads[length++] = t->quads[i];
+        }
+    }
+    t->quad_length = length;
+}
+
+/* Appends the tuples of a dense pair tensor that hold a weight. */
+static void list_pairs(weight_tensors *t, const float *tensor, const float *table)
+{
+    for (int r = 0; r < DIM2; r++)
+    {
+        if (tensor[r] == 0) {continue;}
+        weighted_tuple *tuple = &t->pairs[t->pair_length++];
+        tuple->pos[0] = r / DIM1;
+        tuple->pos[1] = r % DIM1;
+        tuple->weight = tensor[r];
+        tuple->table = table;
+    }
+}
+
+/*
+ * Compiles a weight set into per-position weights.
+ *
+ * Parameters:
+ *   weights: The weight set, as accepted by parse_weights().
+ *
+ * Returns: The compiled weights, to be freed with free_weight_tensors().
+ */
+weight_tensors *compile_weights(CustomWeights *weights)
+{
+    weight_tensors *t = calloc(1, sizeof(weight_tensors));
+    if (!t) {error("Failed to allocate memory for weight tensors.");}
+    t->bi = calloc(dim2, sizeof(float));
+    t->skip = calloc(9 * dim2, sizeof(float));
+    t->tri = calloc(dim3, sizeof(float));
+    if (!t->bi || !t->skip || !t->tri) {error("Failed to allocate memory for weight tensors.");}
+
+    /* quadgrams are too many to hold densely, their tuples are merged by sorting */
+    int quad_length = 0;
+    for (int i = 0; i < weights->length; i++) {
+        if (weights->types[i] == 'q') {quad_length += stats_quad[weights->indices[i]].length;}
+    }
+    t->quads = malloc((quad_length + 1) * sizeof(weighted_tuple));
+    if (!t->quads) {error("Failed to allocate memory for weight tensors.");}
+
+    for (int i = 0; i < weights->length; i++)
+    {
+        float weight = weights->values[i];
+        int index = weights->indices[i];
+        switch (weights->types[i])
+        {
+            case 'm':
+                for (int j = 0; j < stats_mono[index].length; j++) {
+                    t->mono[stats_mono[index].pos[j]] += weight;
+                }
+                break;
+            case 'b':
+                for (int j = 0; j < stats_bi[index].length; j++) {
+                    const unsigned char *pos = stats_bi[index].pos[j];
+                    t->bi[pos[0] * DIM1 + pos[1]] += weight;
+                }
+                break;
+            case 't':
+                for (int j = 0; j < stats_tri[index].length; j++) {
+                    const unsigned char *pos = stats_tri[index].pos[j];
+                    t->tri[(pos[0] * DIM1 + pos[1]) * DIM1 + pos[2]] += weight;
+                }
+                break;
+            case 'q':
+                for (int j = 0; j < stats_quad[index].length; j++) {
+                    weighted_tuple *tuple = &t->quads[t->quad_length++];
+                    memcpy(tuple->pos, stats_quad[index].pos[j], 4);
+                    tuple->weight = weight;
+                    tuple->table = linear_quad;
+                }
+                break;
+            default:
+            {
+                int k = weights->types[i] - '0';
+                float *skip = t->skip + (k - 1) * DIM2;
+                for (int j = 0; j < stats_skip[index].length; j++) {
+                    const unsigned char *pos = stats_skip[index].pos[j];
+                    skip[pos[0] * DIM1 + pos[1]] += weight;
+                }
+                t->skip_mask |= 1 << k;
+            }
+        }
+    }
+    merge_quads(t);
+
+    int length = 0;
+    for (int r = 0; r < DIM2; r++) {length += t->bi[r] != 0;}
+    for (int r = 0; r < 9 * DIM2; r++) {length += t->skip[r] != 0;}
+    t->pairs = malloc((length + 1) * sizeof(weighted_tuple));
+    if (!t->pairs) {error("Failed to allocate memory for weight tensors.");}
+    list_pairs(t, t->bi, linear_bi);
+    for (int k = 1; k <= 9; k++) {
+        if (t->skip_mask & (1 << k)) {list_pairs(t, t->skip + (k - 1) * DIM2, linear_skip + index_skip(k, 0, 0));} /* util.c */
+    }
+
+    length = 0;
+    for (int r = 0; r < DIM3; r++) {length += t->tri[r] != 0;}
+    t->triples = malloc((length + 1) * sizeof(weighted_tuple));
+    if (!t->triples) {error("Failed to allocate memory for weight tensors.");}
+    for (int r = 0; r < DIM3; r++)
+    {
+        if (t->tri[r] == 0) {continue;}
+        weighted_tuple *tuple = &t->triples[t->triple_length++];
+        tuple->pos[0] = r / DIM2;
+        tuple->pos[1] = r / DIM1 % DIM1;
+        tuple->pos[2] = r % DIM1;
+        tuple->weight = t->tri[r];
+        tuple->table = linear_tri;
+    }
+    return t;
+}
+
+/*
+ * Returns the weighted score of a layout in one pass over the compiled
+ * weights. The layout needs no analysis and its scores are left untouched.
+ *
+ * Parameters:
+ *   t: The compiled weights.
+ *   lt: The layout to score.
+ */
+float tensor_score(weight_tensors *t, layout *lt)
+{
+    /* characters pre-scaled for each place in an ngram, as in analyze.c */
+    int c1[dim1], c2[dim1], c3[dim1], c4[dim1];
+    for (int p = 0; p < DIM1; p++)
+    {
+        int ch = lt->matrix[p / COL][p % COL] != -1 ? lt->matrix[p / COL][p % COL] : 0;
+        c1[p] = ch;
+        c2[p] = ch * LANG_LENGTH;
+        c3[p] = ch * LANG_LENGTH * LANG_LENGTH;
+        c4[p] = ch * LANG_LENGTH * LANG_LENGTH * LANG_LENGTH;
+    }
+
+    /* summed in double, so the order of the tuples costs no precision */
+    double score = 0;
+    for (int p = 0; p < DIM1; p++) {score += t->mono[p] * linear_mono[c1[p]];}
+
+    for (int i = 0; i < t->pair_length; i++)
+    {
+        const weighted_tuple *tuple = &t->pairs[i];
+        score += tuple->weight * tuple->table[c2[tuple->pos[0]] + c1[tuple->pos[1]]];
+    }
+
+    for (int i = 0; i < t->triple_length; i++)
+    {
+        const unsigned char *pos = t->triples[i].pos;
+        score += t->triples[i].weight * linear_tri[c3[pos[0]] + c2[pos[1]] + c1[pos[2]]];
+    }
+
+    for (int i = 0; i < t->quad_length; i++)
+    {
+        const unsigned char *pos = t->quads[i].pos;
+        score += t->quads[i].weight * linear_quad[c4[pos[0]] + c3[pos[1]] + c2[pos[2]] + c1[pos[3]]];
+    }
+    return (float)score;
+}
+
+/*
+ * Frees compiled weights.
+ *
+ * Parameters:
+ *   t: The compiled weights to free.
+ */
+void free_weight_tensors(weight_tensors *t)
+{
+    free(t->bi);
+    free(t->skip);
+    free(t->tri);
+    free(t->pairs);
+    free(t->triples);
+    free(t->quads);
+    free(t);
+}
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "util.h"
 #include "global.h"
@@ -211,128 +213,301 @@ size_t index_skip(int skip_index, int j, int k) {
     return skip_index * LANG_LENGTH * LANG_LENGTH + j * LANG_LENGTH + k;
 }
 
+/* Sums the raw counts of each ngram type into the total_* globals. */
+static void count_corpus_totals()
+{
+    size_t size_mono = LANG_LENGTH;
+    size_t size_bi = size_mono * LANG_LENGTH;
+    size_t size_tri = size_bi * LANG_LENGTH;
+    size_t size_quad = size_tri * LANG_LENGTH;
+
+    total_mono = total_bi = total_tri = total_quad = 0;
+    for (size_t i = 0; i < size_mono; i++) {total_mono += corpus_mono[i];}
+    for (size_t i = 0; i < size_bi; i++) {total_bi += corpus_bi[i];}
+    for (size_t i = 0; i < size_tri; i++) {total_tri += corpus_tri[i];}
+    for (size_t i = 0; i < size_quad; i++) {total_quad += corpus_quad[i];}
+    for (int k = 1; k <= 9; k++) {
+        const long long *skip = corpus_skip + index_skip(k, 0, 0);
+        total_skip[k] = 0;
+        for (size_t i = 0; i < size_bi; i++) {total_skip[k] += skip[i];}
+    }
+}
+
 /* Normalizes the corpus data from raw frequencies to percentages. */
 void normalize_corpus()
 {
-    long long total_mono = 0;
-    long long total_bi = 0;
-    long long total_tri = 0;
-    long long total_quad = 0;
-    long long total_skip[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    size_t size_mono = LANG_LENGTH;
+    size_t size_bi = size_mono * LANG_LENGTH;
+    size_t size_tri = size_bi * LANG_LENGTH;
+    size_t size_quad = size_tri * LANG_LENGTH;
 
     log_print('n',L"Calculating totals... ");
 
-    for (int i = 0; i < LANG_LENGTH; i++) {
-        total_mono += corpus_mono[i];
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            total_bi += corpus_bi[i][j];
-            for (int k = 0; k < LANG_LENGTH; k++) {
-                total_tri += corpus_tri[i][j][k];
-                for (int l = 0; l < LANG_LENGTH; l++) {
-                    total_quad += corpus_quad[i][j][k][l];
-                }
-            }
-        }
-    }
-
-    for (int i = 1; i <= 9; i++) {
-        for (int j = 0; j < LANG_LENGTH; j++) {
-            for (int k = 0; k < LANG_LENGTH; k++) {
-                total_skip[i] += corpus_skip[i][j][k];
-            }
-        }
-    }
+    count_corpus_totals();
 
     log_print('n',L"Normalizing... ");
 
     if (total_mono > 0) {
-        for (int i = 0; i < LANG_LENGTH; i++) {
-            linear_mono[index_mono(i)] = (float)corpus_mono[i] * 100 / total_mono;
+        for (size_t i = 0; i < size_mono; i++) {
+            linear_mono[i] = (float)corpus_mono[i] * 100 / total_mono;
         }
     }
 
     if (total_bi > 0) {
-        for (int i = 0; i < LANG_LENGTH; i++) {
-            for (int j = 0; j < LANG_LENGTH; j++) {
-                linear_bi[index_bi(i, j)] = (float)corpus_bi[i][j] * 100 / total_bi;
-            }
+        for (size_t i = 0; i < size_bi; i++) {
+            linear_bi[i] = (float)corpus_bi[i] * 100 / total_bi;
         }
     }
 
     if (total_tri > 0) {
-        for (int i = 0; i < LANG_LENGTH; i++) {
-            for (int j = 0; j < LANG_LENGTH; j++) {
-                for (int k = 0; k < LANG_LENGTH; k++) {
-                    linear_tri[index_tri(i, j, k)] = (float)corpus_tri[i][j][k] * 100 / total_tri;
-                }
-            }
+        for (size_t i = 0; i < size_tri; i++) {
+            linear_tri[i] = (float)corpus_tri[i] * 100 / total_tri;
         }
     }
 
     if (total_quad > 0) {
-        for (int i = 0; i < LANG_LENGTH; i++) {
-            for (int j = 0; j < LANG_LENGTH; j++) {
-                for (int k = 0; k < LANG_LENGTH; k++) {
-                    for (int l = 0; l < LANG_LENGTH; l++) {
-                        linear_quad[index_quad(i, j, k, l)] = (float)corpus_quad[i][j][k][l] * 100 / total_quad;
-                    }
-                }
+        for (size_t i = 0; i < size_quad; i++) {
+            linear_quad[i] = (float)corpus_quad[i] * 100 / total_quad;
+        }
+    }
+
+    for (int k = 1; k <= 9; k++) {
+        if (total_skip[k] > 0) {
+            size_t base = index_skip(k, 0, 0);
+            for (size_t i = 0; i < size_bi; i++) {
+                linear_skip[base + i] = (float)corpus_skip[base + i] * 100 / total_skip[k];
             }
         }
     }
+}
 
-    if (total_skip > 0) {
-        for (int i = 1; i <= 9; i++) {
-            for (int j = 0; j < LANG_LENGTH; j++) {
-                for (int k = 0; k < LANG_LENGTH; k++) {
-                    linear_skip[index_skip(i, j, k)] = (float)corpus_skip[i][j][k] * 100 / total_skip[i];
-                }
+/*
+ * Interleaves the normalized skipgram frequencies by skip distance into
+ * skip_rows, so the nine distances of a pair of characters are one vector.
+ * Slot 0 and the padding of each row stay zero.
+ */
+void interleave_skips()
+{
+    size_t pairs = (size_t)LANG_LENGTH * LANG_LENGTH;
+    skip_rows = (float *)aligned_alloc(64, pairs * SKIP_ROW * sizeof(float));
+    if (skip_rows == NULL) {error("failed to malloc skip rows");}
+    memset(skip_rows, 0, pairs * SKIP_ROW * sizeof(float));
+
+    for (int j = 0; j < LANG_LENGTH; j++) {
+        for (int k = 0; k < LANG_LENGTH; k++) {
+            float *freqs = skip_rows + ((size_t)j * LANG_LENGTH + k) * SKIP_ROW;
+            for (int skip = 1; skip <= 9; skip++) {
+                freqs[skip] = linear_skip[index_skip(skip, j, k)];
             }
         }
     }
 }
 
+/* Alignment of a layout's score block, one cache line. */
+#define SCORE_ALIGN 64
+
+/* Rounds a size up to a whole number of cache lines. */
+static size_t align_up(size_t size)
+{
+    return (size + SCORE_ALIGN - 1) / SCORE_ALIGN * SCORE_ALIGN;
+}
+
+/* Returns the number of stats of every type together. */
+static size_t scores_length()
+{
+    return (size_t)MONO_LENGTH + BI_LENGTH + TRI_LENGTH + QUAD_LENGTH
+        + 9 * (size_t)SKIP_LENGTH + META_LENGTH;
+}
+
 /*
- * Allocates memory for a new layout.
+ * Returns the position of a stat in a layout's flat scores array.
  * Parameters:
- *   lt: Pointer to a layout pointer where the newly allocated layout will be stored.
+ *   type: The type of the statistic ('m', 'b', 't', 'q', '1'-'9' for the
+ *         skipgram distances, or 'e' for meta).
+ *   index: The index of the statistic within its type.
  */
-void alloc_layout(layout **lt)
+int stat_id(char type, int index)
 {
-    *lt = (layout *)malloc(sizeof(layout));
-    if (*lt == NULL) {error("failed to malloc layout");}
+    int skip = MONO_LENGTH + BI_LENGTH + TRI_LENGTH + QUAD_LENGTH;
+    switch (type) {
+        case 'm': return index;
+        case 'b': return MONO_LENGTH + index;
+        case 't': return MONO_LENGTH + BI_LENGTH + index;
+        case 'q': return MONO_LENGTH + BI_LENGTH + TRI_LENGTH + index;
+        case 'e': return skip + 9 * SKIP_LENGTH + index;
+        default:  return skip + (type - '1') * SKIP_LENGTH + index;
+    }
+}
 
+/*
+ * Allocates memory for a new layout. The layout and all of its scores live in
+ * a single cache-aligned block, with the scores as one flat array indexed by
+ * stat_id(); the per-type score pointers point into it.
+ * Parameters:
+ *   lt: Pointer to a layout pointer where the newly allocated layout will be stored.
+ */
+void alloc_layout(layout **lt)
+{
+    size_t head = align_up(sizeof(layout) + 10 * sizeof(float *));
+    size_t size = head + align_up(scores_length() * sizeof(float));
+    char *block = (char *)aligned_alloc(SCORE_ALIGN, size);
+    if (block == NULL) {error("failed to malloc layout");}
+    memset(block, 0, size);
+
+    *lt = (layout *)block;
+    (*lt)->skip_score = (float **)(block + sizeof(layout));
+    (*lt)->scores = (float *)(block + head);
     (*lt)->score = 0;
 
-    (*lt)->mono_score = (float *)calloc(MONO_LENGTH, sizeof(float));
-    (*lt)->bi_score = (float *)calloc(BI_LENGTH, sizeof(float));
-    (*lt)->tri_score = (float *)calloc(TRI_LENGTH, sizeof(float));
-    (*lt)->quad_score = (float *)calloc(QUAD_LENGTH, sizeof(float));
-    (*lt)->skip_score = (float **)malloc(10 * sizeof(float *));
+    (*lt)->mono_score = (*lt)->scores + stat_id('m', 0);
+    (*lt)->bi_score = (*lt)->scores + stat_id('b', 0);
+    (*lt)->tri_score = (*lt)->scores + stat_id('t', 0);
+    (*lt)->quad_score = (*lt)->scores + stat_id('q', 0);
+    (*lt)->skip_score[0] = NULL;
     for (int i = 1; i < 10; i++) {
-        (*lt)->skip_score[i] = (float *)calloc(SKIP_LENGTH, sizeof(float));
+        (*lt)->skip_score[i] = (*lt)->scores + stat_id('0' + i, 0);
     }
-    (*lt)->meta_score = (float *)calloc(META_LENGTH, sizeof(float));
+    (*lt)->meta_score = (*lt)->scores + stat_id('e', 0);
 }
 
 /*
  * Frees the memory occupied by a layout.
  * Parameters:
- *   lt: Pointer to the layout to be freed.
+ *   lt: Pointer to the layout to be freed.
  */
 void free_layout(layout *lt)
 {
-    for (int i = 1; i < 10; i++) {
-        free(lt->skip_score[i]);
+    free(lt);
+}
+
+static pthread_key_t thread_layout_key;
+static pthread_once_t thread_layout_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_layouts(void *arg)
+{
+    layout **layouts = (layout **)arg;
+    for (int i = 0; i < THREAD_LAYOUTS; i++) {
+        if (layouts[i]) {free_layout(layouts[i]);}
     }
-    free(lt->meta_score);
-    free(lt->skip_score);
-    free(lt->quad_score);
-    free(lt->tri_score);
-    free(lt->bi_score);
-    free(lt->mono_score);
+    free(layouts);
+}
 
-    free(lt);
+static void create_thread_layout_key()
+{
+    if (pthread_key_create(&thread_layout_key, &free_thread_layouts)) {
+        error("failed to create thread layout key");
+    }
+}
+
+/*
+ * Returns a scratch layout owned by the calling thread, allocated on its first
+ * use and freed when the thread exits. Every call on a thread with the same
+ * slot returns the same layout, so it must not be freed and its contents do
+ * not survive the next user of that slot on that thread.
+ * Parameters:
+ *   slot: Which of the thread's layouts to return, from 0 to THREAD_LAYOUTS - 1.
+ */
+layout *thread_layout(int slot)
+{
+    pthread_once(&thread_layout_once, &create_thread_layout_key);
+    layout **layouts = (layout **)pthread_getspecific(thread_layout_key);
+    if (layouts == NULL) {
+        layouts = (layout **)calloc(THREAD_LAYOUTS, sizeof(layout *));
+        if (layouts == NULL || pthread_setspecific(thread_layout_key, layouts)) {
+            error("failed to set thread layouts");
+        }
+    }
+    if (layouts[slot] == NULL) {alloc_layout(&layouts[slot]);}
+    return layouts[slot];
+}
+
+/*
+ * Allocates memory for a new, empty evaluation plan.
+ * Parameters:
+ *   plan: Pointer to a plan pointer where the newly allocated plan will be stored.
+ */
+void alloc_plan(eval_plan **plan)
+{
+    *plan = (eval_plan *)malloc(sizeof(eval_plan));
+    if (*plan == NULL) {error("failed to malloc plan");}
+
+    (*plan)->mono = (int *)malloc(MONO_LENGTH * sizeof(int));
+    (*plan)->bi = (int *)malloc(BI_LENGTH * sizeof(int));
+    (*plan)->tri = (int *)malloc(TRI_LENGTH * sizeof(int));
+    (*plan)->quad = (int *)malloc(QUAD_LENGTH * sizeof(int));
+    (*plan)->skip = (int *)malloc(SKIP_LENGTH * sizeof(int));
+    (*plan)->skip_masks = (int *)calloc(SKIP_LENGTH, sizeof(int));
+    (*plan)->mono_length = 0;
+    (*plan)->bi_length = 0;
+    (*plan)->tri_length = 0;
+    (*plan)->quad_length = 0;
+    (*plan)->skip_length = 0;
+}
+
+/*
+ * Frees the memory occupied by an evaluation plan.
+ * Parameters:
+ *   plan: Pointer to the plan to be freed.
+ */
+void free_plan(eval_plan *plan)
+{
+    free(plan->skip_masks);
+    free(plan->skip);
+    free(plan->quad);
+    free(plan->tri);
+    free(plan->bi);
+    free(plan->mono);
+
+    free(plan);
+}
+
+/*
+ * Appends an index to one of a plan's lists if it is not already present.
+ * Returns: The position of the index in the list.
+ */
+static int plan_add(int *list, int *length, int index)
+{
+    for (int i = 0; i < *length; i++)
+    {
+        if (list[i] == index) {return i;}
+    }
+    list[*length] = index;
+    return (*length)++;
+}
+
+/*
+ * Adds a statistic to an evaluation plan, ignoring stats already planned.
+ * Parameters:
+ *   plan: Pointer to the plan.
+ *   type: The type of the statistic ('m', 'b', 't', 'q', or '1'-'9' for the
+ *         skip distance of a skipgram stat).
+ *   index: The index of the statistic in its stats_* array.
+ */
+void plan_stat(eval_plan *plan, char type, int index)
+{
+    int i;
+    switch (type)
+    {
+        case 'm':
+            plan_add(plan->mono, &plan->mono_length, index);
+            break;
+        case 'b':
+            plan_add(plan->bi, &plan->bi_length, index);
+            break;
+        case 't':
+            plan_add(plan->tri, &plan->tri_length, index);
+            break;
+        case 'q':
+            plan_add(plan->quad, &plan->quad_length, index);
+            break;
+        case '1': case '2': case '3': case '4': case '5':
+        case '6': case '7': case '8': case '9':
+            i = plan_add(plan->skip, &plan->skip_length, index);
+            plan->skip_masks[i] |= 1 << (type - '0');
+            break;
+        default:
+            error("invalid stat type in plan");
+    }
 }
 
 /*
@@ -437,8 +612,90 @@ void skeleton_copy(layout *lt_dest, layout *lt_src)
     lt_dest->score = lt_src->score;
 }
 
-/* Returns a random float between 0 and 1. */
-float random_float() {
-    return (float)rand() / RAND_MAX;
+/*
+ * Advances a caller-owned xorshift64* generator and returns its next output.
+ * Parameters:
+ *   state: Pointer to the generator state, which must not be zero.
+ */
+static uint64_t random_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Returns a random float between 0 and 1 from a caller-owned xorshift64*
+ * generator. Each thread keeps its own state, so concurrent searches never
+ * contend on the global rand().
+ * Parameters:
+ *   state: Pointer to the generator state, which must not be zero.
+ */
+float random_float(uint64_t *state) {
+    return (random_next(state) >> 40) * (1.0f / (1 << 24));
+}
+
+/*
+ * Returns a random integer between 0 and n - 1.
+ * Parameters:
+ *   state: Pointer to the generator state, which must not be zero.
+ *   n: The number of possible values.
+ */
+int random_int(uint64_t *state, int n) {
+    return (int)(((random_next(state) >> 32) * n) >> 32);
 }
 
+/*
+ * Inserts a layout into a ranking, best first, keeping at most top distinct
+ * layouts. A layout already ranked keeps its better score.
+ * Parameters:
+ *   head: Pointer to the head of the ranking.
+ *   length: Pointer to the number of layouts in the ranking.
+ *   top: The maximum number of layouts to keep.
+ *   matrix: The keys of the layout.
+ *   score: The score of the layout.
+ */
+void rank_layout(layout_node **head, int *length, int top, int matrix[row][col], float score)
+{
+    layout_node **link = head;
+    int place = 0;
+    for (; *link && (*link)->score >= score; link = &(*link)->next, place++) {
+        if (!memcmp((*link)->matrix, matrix, sizeof((*link)->matrix))) {return;}
+    }
+    if (place >= top) {return;}
+
+    layout_node *node = malloc(sizeof(layout_node));
+    if (!node) {error("Failed to allocate memory for ranking.");}
+    strcpy(node->name, "ranked");
+    memcpy(node->matrix, matrix, sizeof(node->matrix));
+    node->score = score;
+    node->next = *link;
+    *link = node;
+    (*length)++;
+
+    /* drop the worse copy of the same layout, or the last one if over top */
+    for (link = &node->next, place++; *link; link = &(*link)->next, place++) {
+        if (place >= top || !memcmp((*link)->matrix, matrix, sizeof(node->matrix))) {
+            layout_node *drop = *link;
+            *link = drop->next;
+            free(drop);
+            (*length)--;
+            break;
+        }
+    }
+}
+
+/*
+ * Frees a ranking list.
+ * Parameters:
+ *   list: The head of the list, may be NULL.
+ */
+void free_ranking(layout_node *list)
+{
+    while (list) {
+        layout_node *next = list->next;
+        free(list);
+        list = next;
+    }
+}
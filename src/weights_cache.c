@@ -0,0 +1,198 @@
+/*
+ * weights_cache.c - Compiled weight set cache.
+ *
+ * Implements an LRU cache of compiled weight sets, keyed by the text of the
+ * weights object, so repeated weights skip parsing, stat lookup and
+ * compilation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "weights_cache.h"
+#include "util.h"
+
+/* Number of hash buckets, a power of two. */
+#define WEIGHTS_BUCKETS 64
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static compiled_weights *buckets[WEIGHTS_BUCKETS];
+/* the cached weight sets from most to least recently used */
+static compiled_weights *newest, *oldest;
+static int cached_count;
+static uint64_t next_id = 1;
+static long hit_count, miss_count;
+
+/* Returns the 64-bit FNV-1a hash of a string. */
+static uint64_t hash_key(const char *key)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (; *key; key++) {hash = (hash ^ (unsigned char)*key) * 0x100000001B3ULL;}
+    return hash;
+}
+
+/* Frees compiled weights and everything derived from them. */
+static void destroy_weights(compiled_weights *cw)
+{
+    free_plan(cw->plan);
+    free_weight_tensors(cw->tensors);
+    free(cw->key);
+    free(cw);
+}
+
+/* Unlinks a weight set from the recency list. Needs the cache lock. */
+static void unlink_recency(compiled_weights *cw)
+{
+    if (cw->newer) {cw->newer->older = cw->older;} else {newest = cw->older;}
+    if (cw->older) {cw->older->newer = cw->newer;} else {oldest = cw->newer;}
+    cw->newer = cw->older = NULL;
+}
+
+/* Makes a weight set the most recently used. Needs the cache lock. */
+static void push_newest(compiled_weights *cw)
+{
+    cw->older = newest;
+    if (newest) {newest->newer = cw;} else {oldest = cw;}
+    newest = cw;
+}
+
+/*
+ * Finds a cached weight set and takes a reference to it, making it the most
+ * recently used. Needs the cache lock. Returns NULL on a miss.
+ */
+static compiled_weights *take_cached(const char *key, uint64_t hash)
+{
+    for (compiled_weights *cw = buckets[hash & (WEIGHTS_BUCKETS - 1)]; cw; cw = cw->chain)
+    {
+        if (cw->hash != hash || strcmp(cw->key, key)) {continue;}
+        cw->refs++;
+        unlink_recency(cw);
+        push_newest(cw);
+        return cw;
+    }
+    return NULL;
+}
+
+/*
+ * Removes the least recently used weight set from the cache. Needs the cache
+ * lock. Returns it if nobody uses it any more and it must be freed, NULL
+ * otherwise.
+ */
+static compiled_weights *evict_oldest()
+{
+    compiled_weights *cw = oldest;
+    unlink_recency(cw);
+    compiled_weights **link = &buckets[cw->hash & (WEIGHTS_BUCKETS - 1)];
+    while (*link != cw) {link = &(*link)->chain;}
+    *link = cw->chain;
+    cw->cached = 0;
+    cached_count--;
+    return cw->refs ? NULL : cw;
+}
+
+/*
+ * Returns the compiled form of a weights object, from the cache if the same
+ * object was compiled recently, otherwise compiling and caching it. The least
+ * recently used weight set leaves the cache once it is full. Safe to call
+ * from any thread.
+ *
+ * Parameters:
+ *   j_weights: The weights object of a request.
+ *
+ * Returns: The compiled weights, to be given back with release_weights(), or
+ *          NULL if parse_weights() rejects the object.
+ */
+compiled_weights *acquire_weights(json_object *j_weights)
+{
+    const char *key = json_object_to_json_string_ext(j_weights, JSON_C_TO_STRING_PLAIN);
+    uint64_t hash = hash_key(key);
+
+    pthread_mutex_lock(&cache_mutex);
+    compiled_weights *cw = take_cached(key, hash);
+    if (cw) {hit_count++;} else {miss_count++;}
+    pthread_mutex_unlock(&cache_mutex);
+    if (cw) {return cw;}
+
+    /* compile without the lock, other weight sets stay available meanwhile */
+    cw = calloc(1, sizeof(compiled_weights));
+    if (!cw) {error("Failed to allocate memory for compiled weights.");}
+    if (!parse_weights(j_weights, &cw->weights)) {
+        free(cw);
+        return NULL;
+    }
+    alloc_plan(&cw->plan);
+    build_eval_plan(cw->plan, &cw->weights);
+    cw->tensors = compile_weights(&cw->weights);
+    cw->key = strdup(key);
+    if (!cw->key) {error("Failed to allocate memory for compiled weights.");}
+    cw->hash = hash;
+    cw->refs = 1;
+
+    pthread_mutex_lock(&cache_mutex);
+    /* another request may have compiled the same weights in the meantime */
+    compiled_weights *existing = take_cached(key, hash);
+    compiled_weights *evicted = NULL;
+    if (!existing)
+    {
+        compiled_weights **bucket = &buckets[hash & (WEIGHTS_BUCKETS - 1)];
+        cw->chain = *bucket;
+        *bucket = cw;
+        push_newest(cw);
+        cw->id = next_id++;
+        cw->cached = 1;
+        if (++cached_count > WEIGHTS_CACHE_SIZE) {evicted = evict_oldest();}
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    if (evicted) {destroy_weights(evicted);}
+    if (existing) {
+        destroy_weights(cw);
+        return existing;
+    }
+    return cw;
+}
+
+/*
+ * Gives back compiled weights from acquire_weights(). Weights that already
+ * left the cache are freed with their last user.
+ *
+ * Parameters:
+ *   cw: The compiled weights.
+ */
+void release_weights(compiled_weights *cw)
+{
+    pthread_mutex_lock(&cache_mutex);
+    int unused = --cw->refs == 0 && !cw->cached;
+    pthread_mutex_unlock(&cache_mutex);
+    if (unused) {destroy_weights(cw);}
+}
+
+/*
+ * Reads the counters of the cache.
+ *
+ * Parameters:
+ *   hits, misses: Set to the lookups answered from the cache and those that
+ *                 compiled, since the server started.
+ *   entries: Set to the number of weight sets cached.
+ */
+void weights_cache_counts(long *hits, long *misses, long *entries)
+{
+    pthread_mutex_lock(&cache_mutex);
+    *hits = hit_count;
+    *misses = miss_count;
+    *entries = cached_count;
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+/* Frees every cached weight set. No weights may be in use. */
+void free_weights_cache()
+{
+    pthread_mutex_lock(&cache_mutex);
+    while (oldest)
+    {
+        compiled_weights *cw = evict_oldest();
+        if (cw) {destroy_weights(cw);}
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}